@@ -8,17 +8,45 @@
 #include <algorithm>
 #include <cctype>
 #include <sstream>
+#include <deque>
+#include <set>
 #include <unordered_map>
+#include <unordered_set>
 #include <random>
+#include <numeric>
+#include <cmath>
 #include <filesystem>
-
-// Platform-specific SHA-256
-#ifdef __APPLE__
-    #include <CommonCrypto/CommonDigest.h>
-#else
-    // Simple self-contained SHA-256 (public domain from Zedwood)
-    #include <cstring>
-    // (Full implementation provided below)
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <string_view>
+#include <charconv>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <optional>
+#include <chrono>
+#include <cerrno>
+#include <array>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+// SIMD kernels are selected at runtime, so the binary stays portable
+#if defined(__x86_64__) || defined(__i386__)
+    #define CLOUD_X86 1
+    #include <immintrin.h>
+    #include <cpuid.h>
 #endif
 
 namespace fs = std::filesystem;
@@ -26,391 +54,7959 @@ using namespace std;
 
 // ================== Configuration ==================
 namespace Config {
-    const string USERS_FILE   = "cloud_users.dat";
+    const string USERS_FILE   = "cloud_users.tbl";
+    const string LEGACY_USERS_FILE = "cloud_users.dat";  // text format, imported once
     const string DATA_DIR     = "cloud_data/";
-    const string LOG_FILE     = "cloud_system.log";
-    const double FREE_STORAGE_LIMIT    = 1024.0;   // MB
-    const double PREMIUM_STORAGE_LIMIT = 10240.0;  // MB
-    const double ADMIN_STORAGE_LIMIT   = 102400.0; // MB
+    const string AUDIT_DIR    = "cloud_audit/";
+    const int64_t MB = 1ll << 20;
+    const int64_t FREE_STORAGE_LIMIT    = 1024 * MB;
+    const int64_t PREMIUM_STORAGE_LIMIT = 10240 * MB;
+    const int64_t ADMIN_STORAGE_LIMIT   = 102400 * MB;
+
+    const size_t LOG_RING_CAPACITY     = 8192;  // audit events, power of two
+    const int    LOG_FLUSH_INTERVAL_MS = 50;
+    const uint64_t AUDIT_SEGMENT_BYTES = 16ull << 20;  // roll over to a new segment
+    const unsigned AUDIT_SHUTDOWN_RETRIES = 3;         // failed writes at shutdown before events are dropped
+    const uint64_t USER_WAL_COMPACT_BYTES = 8ull << 20; // fold the user log into the snapshot
+    const unsigned FILE_LOADER_THREADS = 0;            // bulk catalog load; 0 = one per core
+    const size_t FILE_LOG_COMPACT_MIN_ENTRIES = 64;    // never compact smaller catalog logs
+    const double FILE_LOG_COMPACT_DEAD_RATIO  = 0.5;   // compact once this share is dead
+    const bool   SEARCH_GLOBAL_INDEX = false;          // also index every user's files together
+    const string PUBLIC_CATALOG_FILE = DATA_DIR + "public.catalog";
+    const size_t BATCH_FLUSH_OPS = 10000;              // --batch: commands per durability flush
+    const int    QUOTA_RECONCILE_INTERVAL_S = 300;     // recount usage from the file catalog
+    const string CHUNK_DIR = DATA_DIR + "chunks/";     // file contents, deduplicated
+    const size_t CHUNK_MIN_BYTES = 16 << 10;           // content-defined chunk sizes
+    const size_t CHUNK_AVG_BYTES = 64 << 10;           // power of two
+    const size_t CHUNK_MAX_BYTES = 256 << 10;
+    const size_t UPLOAD_BLOCK_BYTES = 1 << 20;         // read size when streaming uploads
+    const string MASTER_KEY_FILE = "cloud_master.key"; // wraps every file key; keep it safe
+    const string REPLICA_DIR = "cloud_replicas/";      // stand-in stores of the other regions
+    const string REPLICATION_LOG = DATA_DIR + "replication.log";
+    const bool   REPLICATION_SYNC_ACK = false;         // GLOBAL changes wait for every replica
+    const int    REPLICATION_ACK_TIMEOUT_MS = 5000;    // then the change completes asynchronously
+    const size_t REPLICATION_BATCH = 256;              // queued changes a replica applies per sync
+    const int    REPLICATION_RETRY_MS = 1000;          // after a replica fails to apply a batch
+    const string METRICS_FILE = "cloud_metrics.prom";  // Prometheus text, rewritten periodically
+    const string METRICS_SOCKET = "cloud_metrics.sock"; // the same over HTTP; "" turns it off
+    const int    METRICS_EXPORT_INTERVAL_S = 15;
+    const int    SESSION_TTL_S = 3600;                 // lifetime of a session token
+    const int    MFA_CHALLENGE_TTL_S = 300;            // time to answer an MFA challenge
+    const string REVOKED_TOKENS_FILE = DATA_DIR + "revoked.log";  // logged-out tokens, until they expire
+    const string   PASSWORD_KDF = "argon2id";          // new password hashes: "argon2id" or "pbkdf2"
+    const uint32_t ARGON2_MEMORY_KIB = 19456;          // per hash, so KDF_THREADS times this at most
+    const uint32_t ARGON2_PASSES = 2;
+    const uint32_t ARGON2_LANES = 1;
+    const uint32_t PBKDF2_ITERATIONS = 600000;
+    const unsigned KDF_THREADS = 2;                    // password hashes computed at once
+    const size_t   KDF_QUEUE = 64;                     // hashes waiting; more are refused (BUSY)
+    const int      KDF_DEADLINE_MS = 5000;             // a login gives up waiting for its hash
 
     const int MAX_FAILED_LOGINS = 5;
     const int PASSWORD_MIN_LEN  = 8;
 }
 
-// ================== SHA-256 Wrapper ==================
-string sha256(const string& input) {
-#ifdef __APPLE__
-    unsigned char hash[CC_SHA256_DIGEST_LENGTH];
-    CC_SHA256(input.data(), (CC_LONG)input.size(), hash);
-    stringstream ss;
-    for (int i = 0; i < CC_SHA256_DIGEST_LENGTH; ++i)
-        ss << hex << setw(2) << setfill('0') << (int)hash[i];
-    return ss.str();
-#else
-    // Use the self-contained SHA256 class (see below)
-    SHA256 sha;
-    sha.update(input);
-    return sha.final();
-#endif
-}
+// ================== CPU Features ==================
+namespace cpu {
+    bool hasShaNi() {
+#ifdef CLOUD_X86
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+        return (ebx & (1u << 29)) && __builtin_cpu_supports("sse4.1");
+#else
+        return false;
+#endif
+    }
+
+    bool hasAvx2() {
+#ifdef CLOUD_X86
+        return __builtin_cpu_supports("avx2");
+#else
+        return false;
+#endif
+    }
+
+    bool hasAesNi() {
+#ifdef CLOUD_X86
+        return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") &&
+               __builtin_cpu_supports("sse4.1");
+#else
+        return false;
+#endif
+    }
+}
+
+// ================== SHA-256 Engine ==================
+// Native SHA-256 with three compression back ends picked once at startup:
+//   - SHA-NI   (x86 SHA extensions, fastest single stream)
+//   - AVX2     (8 independent messages per pass, used by sha256Batch)
+//   - scalar   (portable fallback)
+// Set CLOUD_SHA256_IMPL=scalar|shani|avx2 to force a back end for testing.
+namespace sha256impl {
+    alignas(64) const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    const uint32_t H0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    enum class Impl { SCALAR, SHANI, AVX2 };
+
+    inline uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    inline uint32_t load32be(const uint8_t* p) {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    }
+
+    inline void store32be(uint8_t* p, uint32_t v) {
+        p[0] = uint8_t(v >> 24); p[1] = uint8_t(v >> 16); p[2] = uint8_t(v >> 8); p[3] = uint8_t(v);
+    }
+
+    void compressScalar(uint32_t state[8], const uint8_t* data, size_t nblocks) {
+        uint32_t w[64];
+        while (nblocks--) {
+            for (int i = 0; i < 16; ++i) w[i] = load32be(data + 4 * i);
+            for (int i = 16; i < 64; ++i) {
+                uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+            for (int i = 0; i < 64; ++i) {
+                uint32_t S1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+                uint32_t ch = (e & f) ^ (~e & g);
+                uint32_t t1 = h + S1 + ch + K[i] + w[i];
+                uint32_t S0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+                uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+                uint32_t t2 = S0 + maj;
+                h = g; g = f; f = e; e = d + t1;
+                d = c; c = b; b = a; a = t1 + t2;
+            }
+            state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+            state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+            data += 64;
+        }
+    }
+
+#ifdef CLOUD_X86
+    __attribute__((target("sha,sse4.1")))
+    void compressShaNi(uint32_t state[8], const uint8_t* data, size_t nblocks) {
+        const __m128i BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+        // The SHA instructions want the state split as ABEF / CDGH
+        __m128i tmp    = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+        __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+        __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+        state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+        while (nblocks--) {
+            const __m128i abefSave = state0;
+            const __m128i cdghSave = state1;
+            __m128i w[4];
+
+            for (int g = 0; g < 16; ++g) {
+                __m128i cur;
+                if (g < 4) {
+                    cur = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * g)), BSWAP);
+                } else {
+                    cur = _mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]);
+                    cur = _mm_add_epi32(cur, _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4));
+                    cur = _mm_sha256msg2_epu32(cur, w[(g + 3) & 3]);
+                }
+                w[g & 3] = cur;
+
+                __m128i msg = _mm_add_epi32(cur, _mm_load_si128((const __m128i*)&K[4 * g]));
+                state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+                msg = _mm_shuffle_epi32(msg, 0x0E);
+                state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+            }
+
+            state0 = _mm_add_epi32(state0, abefSave);
+            state1 = _mm_add_epi32(state1, cdghSave);
+            data += 64;
+        }
+
+        tmp    = _mm_shuffle_epi32(state0, 0x1B);
+        state1 = _mm_shuffle_epi32(state1, 0xB1);
+        state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+        state1 = _mm_alignr_epi8(state1, tmp, 8);
+        _mm_storeu_si128((__m128i*)&state[0], state0);
+        _mm_storeu_si128((__m128i*)&state[4], state1);
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i rotr8(__m256i x, int n) {
+        return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+    }
+
+    // One compression per lane for 8 independent messages. state[i] holds
+    // word i of all eight lanes; lanes whose bit is clear in activeMask keep
+    // their previous state (used when messages have different block counts).
+    __attribute__((target("avx2")))
+    void compress8Avx2(__m256i state[8], const uint8_t* const blocks[8], uint32_t activeMask) {
+        __m256i w[16];
+        for (int t = 0; t < 16; ++t) {
+            w[t] = _mm256_set_epi32(
+                (int)load32be(blocks[7] + 4 * t), (int)load32be(blocks[6] + 4 * t),
+                (int)load32be(blocks[5] + 4 * t), (int)load32be(blocks[4] + 4 * t),
+                (int)load32be(blocks[3] + 4 * t), (int)load32be(blocks[2] + 4 * t),
+                (int)load32be(blocks[1] + 4 * t), (int)load32be(blocks[0] + 4 * t));
+        }
+
+        __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+        __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; ++i) {
+            __m256i wi;
+            if (i < 16) {
+                wi = w[i];
+            } else {
+                __m256i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr8(w15, 7), rotr8(w15, 18)), _mm256_srli_epi32(w15, 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr8(w2, 17), rotr8(w2, 19)), _mm256_srli_epi32(w2, 10));
+                wi = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0), _mm256_add_epi32(w[(i - 7) & 15], s1));
+                w[i & 15] = wi;
+            }
+
+            __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(rotr8(e, 6), rotr8(e, 11)), rotr8(e, 25));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1),
+                         _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32((int)K[i]), wi)));
+            __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(rotr8(a, 2), rotr8(a, 13)), rotr8(a, 22));
+            __m256i maj = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)),
+                                           _mm256_and_si256(b, c));
+            __m256i t2 = _mm256_add_epi32(S0, maj);
+            h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+            d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+        }
+
+        const __m256i mask = _mm256_cmpeq_epi32(
+            _mm256_and_si256(_mm256_set1_epi32((int)activeMask), _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128)),
+            _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128));
+        const __m256i out[8] = { a, b, c, d, e, f, g, h };
+        for (int i = 0; i < 8; ++i)
+            state[i] = _mm256_blendv_epi8(state[i], _mm256_add_epi32(state[i], out[i]), mask);
+    }
+#endif
+
+    Impl detectImpl() {
+        const char* forced = getenv("CLOUD_SHA256_IMPL");
+        string want = forced ? forced : "";
+        if (want == "scalar") return Impl::SCALAR;
+        if (want == "avx2" && cpu::hasAvx2()) return Impl::AVX2;
+        if ((want.empty() || want == "shani") && cpu::hasShaNi()) return Impl::SHANI;
+        if (cpu::hasAvx2()) return Impl::AVX2;
+        return Impl::SCALAR;
+    }
+
+    Impl activeImpl() {
+        static const Impl impl = detectImpl();
+        return impl;
+    }
+
+    // Single-stream compression. AVX2 only helps across messages, so a
+    // lone stream falls back to scalar on machines without SHA-NI.
+    void compress(uint32_t state[8], const uint8_t* data, size_t nblocks) {
+#ifdef CLOUD_X86
+        if (activeImpl() == Impl::SHANI) { compressShaNi(state, data, nblocks); return; }
+#endif
+        compressScalar(state, data, nblocks);
+    }
+}
+
+class SHA256 {
+public:
+    static constexpr size_t DIGEST_SIZE = 32;
+    static constexpr size_t BLOCK_SIZE  = 64;
+
+    SHA256() { reset(); }
+
+    void reset() {
+        memcpy(state, sha256impl::H0, sizeof(state));
+        bufLen = 0;
+        totalLen = 0;
+    }
+
+    void update(const void* data, size_t len) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        totalLen += len;
+
+        if (bufLen > 0) {
+            size_t take = min(len, BLOCK_SIZE - bufLen);
+            memcpy(buf + bufLen, p, take);
+            bufLen += take; p += take; len -= take;
+            if (bufLen < BLOCK_SIZE) return;
+            sha256impl::compress(state, buf, 1);
+            bufLen = 0;
+        }
+
+        size_t full = len / BLOCK_SIZE;
+        if (full > 0) {
+            sha256impl::compress(state, p, full);
+            p += full * BLOCK_SIZE;
+            len -= full * BLOCK_SIZE;
+        }
+
+        if (len > 0) {
+            memcpy(buf, p, len);
+            bufLen = len;
+        }
+    }
+
+    void update(const string& s) { update(s.data(), s.size()); }
+
+    // Writes the 32-byte digest into out and resets the context for reuse.
+    void final(uint8_t out[DIGEST_SIZE]) {
+        uint64_t bits = totalLen * 8;
+        buf[bufLen++] = 0x80;
+        if (bufLen > BLOCK_SIZE - 8) {
+            memset(buf + bufLen, 0, BLOCK_SIZE - bufLen);
+            sha256impl::compress(state, buf, 1);
+            bufLen = 0;
+        }
+        memset(buf + bufLen, 0, BLOCK_SIZE - 8 - bufLen);
+        for (int i = 0; i < 8; ++i) buf[BLOCK_SIZE - 1 - i] = uint8_t(bits >> (8 * i));
+        sha256impl::compress(state, buf, 1);
+
+        for (int i = 0; i < 8; ++i) sha256impl::store32be(out + 4 * i, state[i]);
+        reset();
+    }
+
+private:
+    uint32_t state[8];
+    uint8_t  buf[BLOCK_SIZE];
+    size_t   bufLen;
+    uint64_t totalLen;
+};
+
+// One message for sha256Batch: hashes head||tail without concatenating them
+// (e.g. salt||password). Either part may be empty.
+struct Sha256Job {
+    const uint8_t* head{nullptr};
+    size_t headLen{0};
+    const uint8_t* tail{nullptr};
+    size_t tailLen{0};
+    uint8_t* digest{nullptr};   // caller-owned, SHA256::DIGEST_SIZE bytes
+};
+
+namespace sha256impl {
+    inline size_t paddedBlocks(const Sha256Job& j) {
+        return (j.headLen + j.tailLen + 9 + 63) / 64;
+    }
+
+    // Materializes block `index` of the padded message into out[64].
+    void fillBlock(const Sha256Job& j, size_t index, uint8_t out[64]) {
+        const size_t total = j.headLen + j.tailLen;
+        const size_t start = index * 64;
+        size_t pos = 0;
+
+        if (start < j.headLen) {
+            size_t n = min<size_t>(64, j.headLen - start);
+            memcpy(out, j.head + start, n);
+            pos = n;
+        }
+        if (pos < 64 && start + pos < total) {
+            size_t off = start + pos - j.headLen;
+            size_t n = min<size_t>(64 - pos, j.tailLen - off);
+            memcpy(out + pos, j.tail + off, n);
+            pos += n;
+        }
+        if (pos < 64) {
+            memset(out + pos, 0, 64 - pos);
+            if (start + pos == total) out[pos] = 0x80;
+        }
+        if (index + 1 == paddedBlocks(j)) {
+            uint64_t bits = uint64_t(total) * 8;
+            for (int i = 0; i < 8; ++i) out[63 - i] = uint8_t(bits >> (8 * i));
+        }
+    }
+
+#ifdef CLOUD_X86
+    __attribute__((target("avx2")))
+    void batchAvx2(const Sha256Job* jobs, size_t n) {
+        alignas(32) uint8_t scratch[8][64];
+        for (size_t base = 0; base < n; base += 8) {
+            const size_t lanes = min<size_t>(8, n - base);
+            size_t blocks[8] = {};
+            size_t maxBlocks = 0;
+            for (size_t l = 0; l < lanes; ++l) {
+                blocks[l] = paddedBlocks(jobs[base + l]);
+                maxBlocks = max(maxBlocks, blocks[l]);
+            }
+
+            __m256i state[8];
+            for (int i = 0; i < 8; ++i) state[i] = _mm256_set1_epi32((int)H0[i]);
+
+            const uint8_t* ptrs[8];
+            for (size_t b = 0; b < maxBlocks; ++b) {
+                uint32_t active = 0;
+                for (size_t l = 0; l < 8; ++l) {
+                    if (l < lanes && b < blocks[l]) {
+                        fillBlock(jobs[base + l], b, scratch[l]);
+                        active |= 1u << l;
+                    }
+                    ptrs[l] = scratch[l];
+                }
+                compress8Avx2(state, ptrs, active);
+            }
+
+            alignas(32) uint32_t words[8][8];
+            for (int i = 0; i < 8; ++i) _mm256_store_si256((__m256i*)words[i], state[i]);
+            for (size_t l = 0; l < lanes; ++l)
+                for (int i = 0; i < 8; ++i) store32be(jobs[base + l].digest + 4 * i, words[i][l]);
+        }
+    }
+#endif
+}
+
+// Hashes n independent messages. On AVX2 machines without SHA-NI the
+// messages go through the 8-lane kernel; otherwise each one is hashed
+// with the fastest single-stream back end.
+void sha256Batch(const Sha256Job* jobs, size_t n) {
+#ifdef CLOUD_X86
+    if (sha256impl::activeImpl() == sha256impl::Impl::AVX2) {
+        sha256impl::batchAvx2(jobs, n);
+        return;
+    }
+#endif
+    uint8_t block[64];
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t state[8];
+        memcpy(state, sha256impl::H0, sizeof(state));
+        const size_t total = sha256impl::paddedBlocks(jobs[i]);
+        for (size_t b = 0; b < total; ++b) {
+            sha256impl::fillBlock(jobs[i], b, block);
+            sha256impl::compress(state, block, 1);
+        }
+        for (int w = 0; w < 8; ++w) sha256impl::store32be(jobs[i].digest + 4 * w, state[w]);
+    }
+}
+
+// Two hex digits per byte value
+struct HexPairs {
+    char pairs[512];
+    constexpr HexPairs() : pairs() {
+        const char digits[] = "0123456789abcdef";
+        for (int i = 0; i < 256; ++i) {
+            pairs[2 * i]     = digits[i >> 4];
+            pairs[2 * i + 1] = digits[i & 0x0f];
+        }
+    }
+};
+constexpr HexPairs HEX_PAIRS;
+
+// Writes 2*len characters to out.
+inline void hexEncode(const uint8_t* data, size_t len, char* out) {
+    for (size_t i = 0; i < len; ++i) memcpy(out + 2 * i, HEX_PAIRS.pairs + 2 * data[i], 2);
+}
+
+string toHex(const uint8_t* data, size_t len) {
+    string out(len * 2, '\0');
+    hexEncode(data, len, &out[0]);
+    return out;
+}
+
+// Decodes exactly 2*len hex digits into out; false on malformed input.
+bool fromHex(string_view hex, uint8_t* out, size_t len) {
+    if (hex.size() != len * 2) return false;
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    for (size_t i = 0; i < len; ++i) {
+        int hi = nibble(hex[2 * i]), lo = nibble(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out[i] = uint8_t((hi << 4) | lo);
+    }
+    return true;
+}
+
+// Runs in time independent of where the buffers differ.
+bool constantTimeEqual(const uint8_t* a, const uint8_t* b, size_t len) {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < len; ++i) diff |= uint8_t(a[i] ^ b[i]);
+    return diff == 0;
+}
+
+// ================== SHA-256 Wrapper ==================
+string sha256(const string& input) {
+    uint8_t digest[SHA256::DIGEST_SIZE];
+    SHA256 sha;
+    sha.update(input);
+    sha.final(digest);
+    return toHex(digest, sizeof(digest));
+}
+
+// HMAC-SHA256 (RFC 2104). The key's padded blocks are absorbed once, so
+// each mac() costs the message's compressions plus two.
+class HmacSha256 {
+public:
+    HmacSha256() = default;
+    HmacSha256(const uint8_t* key, size_t keyLen) { setKey(key, keyLen); }
+    ~HmacSha256() { inner.reset(); outer.reset(); }
+
+    void setKey(const uint8_t* key, size_t keyLen) {
+        uint8_t block[SHA256::BLOCK_SIZE] = {0};
+        if (keyLen > sizeof(block)) {
+            SHA256 k;
+            k.update(key, keyLen);
+            k.final(block);
+        } else {
+            memcpy(block, key, keyLen);
+        }
+        uint8_t pad[SHA256::BLOCK_SIZE];
+        for (size_t i = 0; i < sizeof(pad); ++i) pad[i] = block[i] ^ 0x36;
+        inner.reset();
+        inner.update(pad, sizeof(pad));
+        for (size_t i = 0; i < sizeof(pad); ++i) pad[i] = block[i] ^ 0x5c;
+        outer.reset();
+        outer.update(pad, sizeof(pad));
+        memset(block, 0, sizeof(block));
+        memset(pad, 0, sizeof(pad));
+    }
+
+    void mac(const void* msg, size_t len, uint8_t out[SHA256::DIGEST_SIZE]) const {
+        SHA256 h = inner;
+        h.update(msg, len);
+        h.final(out);
+        h = outer;
+        h.update(out, SHA256::DIGEST_SIZE);
+        h.final(out);
+    }
+
+private:
+    SHA256 inner, outer;
+};
+
+void hmacSha256(const uint8_t* key, size_t keyLen, const void* msg, size_t len,
+                uint8_t out[SHA256::DIGEST_SIZE]) {
+    HmacSha256(key, keyLen).mac(msg, len, out);
+}
+
+// ================== AES-256-GCM ==================
+// One-shot AES-256-GCM (NIST SP 800-38D) with two back ends picked once
+// at startup:
+//   - AES-NI + PCLMULQDQ: 8 counter blocks per pass, GHASH folded over
+//     eight blocks against precomputed powers of H with one reduction
+//   - portable: T-table AES and 4-bit table GHASH (not constant time)
+// Set CLOUD_AES_IMPL=portable to force the fallback for testing.
+namespace aesimpl {
+    struct Tables {
+        uint8_t  sbox[256];
+        uint32_t te[4][256];
+    };
+
+    inline uint8_t xtime(uint8_t x) { return uint8_t((x << 1) ^ ((x & 0x80) ? 0x1b : 0)); }
+
+    const Tables& tables() {
+        static const Tables t = [] {
+            Tables t{};
+            uint8_t p = 1, q = 1;
+            do {   // walk GF(2^8) by 3 and 1/3 together; q = p^-1
+                p = uint8_t(p ^ xtime(p));
+                q ^= uint8_t(q << 1);
+                q ^= uint8_t(q << 2);
+                q ^= uint8_t(q << 4);
+                if (q & 0x80) q ^= 0x09;
+                auto rotl = [](uint8_t v, int n) { return uint8_t((v << n) | (v >> (8 - n))); };
+                t.sbox[p] = uint8_t(q ^ rotl(q, 1) ^ rotl(q, 2) ^ rotl(q, 3) ^ rotl(q, 4) ^ 0x63);
+            } while (p != 1);
+            t.sbox[0] = 0x63;
+            for (int i = 0; i < 256; ++i) {
+                uint8_t s = t.sbox[i], s2 = xtime(s), s3 = uint8_t(s2 ^ s);
+                uint32_t w = (uint32_t(s2) << 24) | (uint32_t(s) << 16) | (uint32_t(s) << 8) | s3;
+                for (int k = 0; k < 4; ++k) t.te[k][i] = (w >> (8 * k)) | (w << (32 - 8 * k) % 32);
+            }
+            return t;
+        }();
+        return t;
+    }
+
+    inline uint32_t load32be(const uint8_t* p) { return sha256impl::load32be(p); }
+    inline void store32be(uint8_t* p, uint32_t v) { sha256impl::store32be(p, v); }
+
+    inline uint64_t load64be(const uint8_t* p) { return (uint64_t(load32be(p)) << 32) | load32be(p + 4); }
+    inline void store64be(uint8_t* p, uint64_t v) {
+        store32be(p, uint32_t(v >> 32));
+        store32be(p + 4, uint32_t(v));
+    }
+
+    // FIPS-197 key schedule; the round keys as bytes suit both back ends.
+    void expandKey(const uint8_t key[32], uint8_t rk[240]) {
+        const Tables& t = tables();
+        uint32_t w[60];
+        for (int i = 0; i < 8; ++i) w[i] = load32be(key + 4 * i);
+        uint8_t rcon = 1;
+        for (int i = 8; i < 60; ++i) {
+            uint32_t v = w[i - 1];
+            auto sub = [&](uint32_t x) {
+                return (uint32_t(t.sbox[x >> 24]) << 24) | (uint32_t(t.sbox[(x >> 16) & 0xff]) << 16) |
+                       (uint32_t(t.sbox[(x >> 8) & 0xff]) << 8) | t.sbox[x & 0xff];
+            };
+            if (i % 8 == 0) {
+                v = sub((v << 8) | (v >> 24)) ^ (uint32_t(rcon) << 24);
+                rcon = xtime(rcon);
+            } else if (i % 8 == 4) {
+                v = sub(v);
+            }
+            w[i] = w[i - 8] ^ v;
+        }
+        for (int i = 0; i < 60; ++i) store32be(rk + 4 * i, w[i]);
+        memset(w, 0, sizeof(w));
+    }
+
+    void encryptBlockPortable(const uint8_t rk[240], const uint8_t in[16], uint8_t out[16]) {
+        const Tables& t = tables();
+        uint32_t s[4], n[4];
+        for (int i = 0; i < 4; ++i) s[i] = load32be(in + 4 * i) ^ load32be(rk + 4 * i);
+        for (int r = 1; r < 14; ++r) {
+            for (int i = 0; i < 4; ++i)
+                n[i] = t.te[0][s[i] >> 24] ^ t.te[1][(s[(i + 1) & 3] >> 16) & 0xff] ^
+                       t.te[2][(s[(i + 2) & 3] >> 8) & 0xff] ^ t.te[3][s[(i + 3) & 3] & 0xff] ^
+                       load32be(rk + 16 * r + 4 * i);
+            memcpy(s, n, sizeof(s));
+        }
+        for (int i = 0; i < 4; ++i) {
+            uint32_t v = (uint32_t(t.sbox[s[i] >> 24]) << 24) | (uint32_t(t.sbox[(s[(i + 1) & 3] >> 16) & 0xff]) << 16) |
+                         (uint32_t(t.sbox[(s[(i + 2) & 3] >> 8) & 0xff]) << 8) | t.sbox[s[(i + 3) & 3] & 0xff];
+            store32be(out + 4 * i, v ^ load32be(rk + 224 + 4 * i));
+        }
+    }
+
+    // GHASH multiply by H through 4-bit tables (Shoup).
+    struct GhashTable {
+        uint64_t hl[16], hh[16];
+
+        void init(const uint8_t h[16]) {
+            uint64_t vh = load64be(h), vl = load64be(h + 8);
+            hl[0] = hh[0] = 0;
+            hl[8] = vl;
+            hh[8] = vh;
+            for (int i = 4; i > 0; i >>= 1) {
+                uint64_t carry = (vl & 1) * 0xe100000000000000ull;
+                vl = (vh << 63) | (vl >> 1);
+                vh = (vh >> 1) ^ carry;
+                hl[i] = vl;
+                hh[i] = vh;
+            }
+            for (int i = 2; i <= 8; i *= 2)
+                for (int j = 1; j < i; ++j) {
+                    hh[i + j] = hh[i] ^ hh[j];
+                    hl[i + j] = hl[i] ^ hl[j];
+                }
+        }
+
+        void mul(uint8_t x[16]) const {
+            static const uint64_t LAST4[16] = {
+                0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+                0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+            };
+            uint8_t lo = x[15] & 0xf;
+            uint64_t zh = hh[lo], zl = hl[lo];
+            for (int i = 15; i >= 0; --i) {
+                lo = x[i] & 0xf;
+                uint8_t hi = x[i] >> 4;
+                if (i != 15) {
+                    uint8_t rem = zl & 0xf;
+                    zl = (zh << 60) | (zl >> 4);
+                    zh = (zh >> 4) ^ (LAST4[rem] << 48);
+                    zh ^= hh[lo];
+                    zl ^= hl[lo];
+                }
+                uint8_t rem = zl & 0xf;
+                zl = (zh << 60) | (zl >> 4);
+                zh = (zh >> 4) ^ (LAST4[rem] << 48);
+                zh ^= hh[hi];
+                zl ^= hl[hi];
+            }
+            store64be(x, zh);
+            store64be(x + 8, zl);
+        }
+    };
+
+    // x ^= data (zero padded to whole blocks), multiplying by H per block
+    void ghashPortable(const GhashTable& h, uint8_t x[16], const uint8_t* data, size_t len) {
+        while (len > 0) {
+            size_t n = min<size_t>(16, len);
+            for (size_t i = 0; i < n; ++i) x[i] ^= data[i];
+            h.mul(x);
+            data += n;
+            len -= n;
+        }
+    }
+
+    inline void incCounter(uint8_t ctr[16]) { store32be(ctr + 12, load32be(ctr + 12) + 1); }
+
+    // CTR from ctr over in -> out, folding the ciphertext into x.
+    void cryptPortable(const uint8_t rk[240], const GhashTable& h, uint8_t ctr[16],
+                       const uint8_t* in, size_t len, uint8_t* out, uint8_t x[16], bool encrypt) {
+        uint8_t ks[16];
+        while (len > 0) {
+            size_t n = min<size_t>(16, len);
+            encryptBlockPortable(rk, ctr, ks);
+            incCounter(ctr);
+            if (!encrypt) ghashPortable(h, x, in, n);
+            for (size_t i = 0; i < n; ++i) out[i] = in[i] ^ ks[i];
+            if (encrypt) ghashPortable(h, x, out, n);
+            in += n;
+            out += n;
+            len -= n;
+        }
+    }
+
+#ifdef CLOUD_X86
+    // Blocks are byte-reversed so that GHASH's bit order maps onto carry-less
+    // multiplication (Intel's GCM white paper).
+    #define AESGCM_TARGET __attribute__((target("aes,pclmul,sse4.1")))
+
+    AESGCM_TARGET inline __m128i bswap128(__m128i v) {
+        return _mm_shuffle_epi8(v, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    }
+
+    // lo/mid/hi accumulate a 256-bit product before one reduction
+    AESGCM_TARGET inline void clmulAcc(__m128i a, __m128i b, __m128i& lo, __m128i& mid, __m128i& hi) {
+        lo  = _mm_xor_si128(lo, _mm_clmulepi64_si128(a, b, 0x00));
+        hi  = _mm_xor_si128(hi, _mm_clmulepi64_si128(a, b, 0x11));
+        mid = _mm_xor_si128(mid, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+                                               _mm_clmulepi64_si128(a, b, 0x01)));
+    }
+
+    AESGCM_TARGET inline __m128i reduce(__m128i lo, __m128i mid, __m128i hi) {
+        lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+        hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+        // shift the 256-bit product left by one
+        __m128i c0 = _mm_srli_epi32(lo, 31), c1 = _mm_srli_epi32(hi, 31);
+        lo = _mm_slli_epi32(lo, 1);
+        hi = _mm_slli_epi32(hi, 1);
+        __m128i carry = _mm_srli_si128(c0, 12);
+        c1 = _mm_slli_si128(c1, 4);
+        c0 = _mm_slli_si128(c0, 4);
+        lo = _mm_or_si128(lo, c0);
+        hi = _mm_or_si128(_mm_or_si128(hi, c1), carry);
+        // reduce modulo x^128 + x^7 + x^2 + x + 1
+        __m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+                                  _mm_slli_epi32(lo, 25));
+        __m128i b = _mm_srli_si128(a, 4);
+        lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+        __m128i d = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+                                  _mm_xor_si128(_mm_srli_epi32(lo, 7), b));
+        return _mm_xor_si128(hi, _mm_xor_si128(lo, d));
+    }
+
+    AESGCM_TARGET inline __m128i gfmul(__m128i a, __m128i b) {
+        __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+        clmulAcc(a, b, lo, mid, hi);
+        return reduce(lo, mid, hi);
+    }
+
+    AESGCM_TARGET void encryptBlockAesni(const uint8_t rk[240], const uint8_t in[16], uint8_t out[16]) {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), _mm_loadu_si128((const __m128i*)rk));
+        for (int r = 1; r < 14; ++r) b = _mm_aesenc_si128(b, _mm_loadu_si128((const __m128i*)(rk + 16 * r)));
+        _mm_storeu_si128((__m128i*)out, _mm_aesenclast_si128(b, _mm_loadu_si128((const __m128i*)(rk + 224))));
+    }
+
+    // hpow[i] = H^(i+1), byte-reversed
+    AESGCM_TARGET void powersAesni(const uint8_t h[16], uint8_t hpow[8][16]) {
+        __m128i h1 = bswap128(_mm_loadu_si128((const __m128i*)h)), p = h1;
+        for (int i = 0; i < 8; ++i) {
+            _mm_storeu_si128((__m128i*)hpow[i], p);
+            p = gfmul(p, h1);
+        }
+    }
+
+    AESGCM_TARGET void ghashAesni(const uint8_t hpow[8][16], uint8_t x[16], const uint8_t* data, size_t len) {
+        __m128i h1 = _mm_loadu_si128((const __m128i*)hpow[0]);
+        __m128i acc = bswap128(_mm_loadu_si128((const __m128i*)x));
+        while (len > 0) {
+            alignas(16) uint8_t blk[16] = {0};
+            size_t n = min<size_t>(16, len);
+            memcpy(blk, data, n);
+            acc = gfmul(_mm_xor_si128(acc, bswap128(_mm_load_si128((const __m128i*)blk))), h1);
+            data += n;
+            len -= n;
+        }
+        _mm_storeu_si128((__m128i*)x, bswap128(acc));
+    }
+
+    AESGCM_TARGET void cryptAesni(const uint8_t rk[240], const uint8_t hpow[8][16], uint8_t ctr[16],
+                                  const uint8_t* in, size_t len, uint8_t* out, uint8_t x[16], bool encrypt) {
+        __m128i k[15], h[8];
+        for (int r = 0; r < 15; ++r) k[r] = _mm_loadu_si128((const __m128i*)(rk + 16 * r));
+        for (int i = 0; i < 8; ++i) h[i] = _mm_loadu_si128((const __m128i*)hpow[i]);
+        const __m128i base = _mm_loadu_si128((const __m128i*)ctr);
+        uint32_t n = load32be(ctr + 12);
+        __m128i acc = bswap128(_mm_loadu_si128((const __m128i*)x));
+
+        size_t off = 0;
+        for (; off + 128 <= len; off += 128, n += 8) {
+            __m128i b[8], g[8];
+            // unrolled so the eight blocks stay in registers
+            #pragma GCC unroll 8
+            for (int i = 0; i < 8; ++i)
+                b[i] = _mm_xor_si128(_mm_insert_epi32(base, (int)__builtin_bswap32(n + i), 3), k[0]);
+            #pragma GCC unroll 13
+            for (int r = 1; r < 14; ++r)
+                #pragma GCC unroll 8
+                for (int i = 0; i < 8; ++i) b[i] = _mm_aesenc_si128(b[i], k[r]);
+            #pragma GCC unroll 8
+            for (int i = 0; i < 8; ++i) {
+                __m128i d = _mm_loadu_si128((const __m128i*)(in + off + 16 * i));
+                __m128i c = _mm_xor_si128(d, _mm_aesenclast_si128(b[i], k[14]));
+                _mm_storeu_si128((__m128i*)(out + off + 16 * i), c);
+                g[i] = bswap128(encrypt ? c : d);
+            }
+            __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+            clmulAcc(_mm_xor_si128(acc, g[0]), h[7], lo, mid, hi);
+            #pragma GCC unroll 7
+            for (int i = 1; i < 8; ++i) clmulAcc(g[i], h[7 - i], lo, mid, hi);
+            acc = reduce(lo, mid, hi);
+        }
+        for (; off < len; off += 16, ++n) {
+            __m128i b = _mm_xor_si128(_mm_insert_epi32(base, (int)__builtin_bswap32(n), 3), k[0]);
+            for (int r = 1; r < 14; ++r) b = _mm_aesenc_si128(b, k[r]);
+            b = _mm_aesenclast_si128(b, k[14]);
+            alignas(16) uint8_t ks[16], din[16] = {0}, dout[16] = {0};
+            size_t m = min<size_t>(16, len - off);
+            _mm_store_si128((__m128i*)ks, b);
+            memcpy(din, in + off, m);
+            for (size_t i = 0; i < m; ++i) dout[i] = din[i] ^ ks[i];
+            memcpy(out + off, dout, m);
+            __m128i g = bswap128(_mm_load_si128((const __m128i*)(encrypt ? dout : din)));
+            acc = gfmul(_mm_xor_si128(acc, g), h[0]);
+        }
+        store32be(ctr + 12, n);
+        _mm_storeu_si128((__m128i*)x, bswap128(acc));
+    }
+    #undef AESGCM_TARGET
+#endif
+
+    enum class Impl { PORTABLE, AESNI };
+
+    Impl detectImpl() {
+        const char* forced = getenv("CLOUD_AES_IMPL");
+        if (forced && string(forced) == "portable") return Impl::PORTABLE;
+        return cpu::hasAesNi() ? Impl::AESNI : Impl::PORTABLE;
+    }
+
+    Impl activeImpl() {
+        static const Impl impl = detectImpl();
+        return impl;
+    }
+}
+
+class Aes256Gcm {
+public:
+    static constexpr size_t KEY_SIZE   = 32;
+    static constexpr size_t NONCE_SIZE = 12;
+    static constexpr size_t TAG_SIZE   = 16;
+
+    explicit Aes256Gcm(const uint8_t key[KEY_SIZE]) : Aes256Gcm(key, aesimpl::activeImpl()) {}
+
+    // A given back end; AESNI requires cpu::hasAesNi().
+    Aes256Gcm(const uint8_t key[KEY_SIZE], aesimpl::Impl backEnd) : impl(backEnd) {
+        aesimpl::expandKey(key, rk);
+        uint8_t h[16] = {0};
+        encryptBlock(h, h);
+#ifdef CLOUD_X86
+        if (impl == aesimpl::Impl::AESNI) aesimpl::powersAesni(h, hpow);
+        else
+#endif
+        table.init(h);
+        memset(h, 0, sizeof(h));
+    }
+
+    Aes256Gcm(const Aes256Gcm&) = delete;
+    Aes256Gcm& operator=(const Aes256Gcm&) = delete;
+
+    ~Aes256Gcm() {
+        volatile uint8_t* p = rk;
+        for (size_t i = 0; i < sizeof(rk); ++i) p[i] = 0;
+    }
+
+    // out may equal in.
+    void encrypt(const uint8_t nonce[NONCE_SIZE], const uint8_t* aad, size_t aadLen,
+                 const uint8_t* in, size_t len, uint8_t* out, uint8_t tag[TAG_SIZE]) const {
+        run(nonce, aad, aadLen, in, len, out, tag, true);
+    }
+
+    // False, with out zeroed, if the tag does not match.
+    bool decrypt(const uint8_t nonce[NONCE_SIZE], const uint8_t* aad, size_t aadLen,
+                 const uint8_t* in, size_t len, const uint8_t tag[TAG_SIZE], uint8_t* out) const {
+        uint8_t expect[TAG_SIZE];
+        run(nonce, aad, aadLen, in, len, out, expect, false);
+        if (constantTimeEqual(expect, tag, TAG_SIZE)) return true;
+        memset(out, 0, len);
+        return false;
+    }
+
+private:
+    aesimpl::Impl impl;
+    alignas(16) uint8_t rk[240];
+    alignas(16) uint8_t hpow[8][16];
+    aesimpl::GhashTable table;
+
+    void encryptBlock(const uint8_t in[16], uint8_t out[16]) const {
+#ifdef CLOUD_X86
+        if (impl == aesimpl::Impl::AESNI) { aesimpl::encryptBlockAesni(rk, in, out); return; }
+#endif
+        aesimpl::encryptBlockPortable(rk, in, out);
+    }
+
+    void ghash(uint8_t x[16], const uint8_t* data, size_t len) const {
+#ifdef CLOUD_X86
+        if (impl == aesimpl::Impl::AESNI) { aesimpl::ghashAesni(hpow, x, data, len); return; }
+#endif
+        aesimpl::ghashPortable(table, x, data, len);
+    }
+
+    void run(const uint8_t nonce[NONCE_SIZE], const uint8_t* aad, size_t aadLen,
+             const uint8_t* in, size_t len, uint8_t* out, uint8_t tag[TAG_SIZE], bool encrypting) const {
+        uint8_t j0[16], ctr[16], x[16] = {0};
+        memcpy(j0, nonce, NONCE_SIZE);
+        aesimpl::store32be(j0 + 12, 1);
+        memcpy(ctr, j0, sizeof(ctr));
+        aesimpl::incCounter(ctr);
+
+        ghash(x, aad, aadLen);
+#ifdef CLOUD_X86
+        if (impl == aesimpl::Impl::AESNI) aesimpl::cryptAesni(rk, hpow, ctr, in, len, out, x, encrypting);
+        else
+#endif
+        aesimpl::cryptPortable(rk, table, ctr, in, len, out, x, encrypting);
+
+        uint8_t lens[16];
+        aesimpl::store64be(lens, uint64_t(aadLen) * 8);
+        aesimpl::store64be(lens + 8, uint64_t(len) * 8);
+        ghash(x, lens, sizeof(lens));
+        encryptBlock(j0, tag);
+        for (size_t i = 0; i < TAG_SIZE; ++i) tag[i] ^= x[i];
+    }
+};
+
+// ================== Password KDF ==================
+// Password hashing schemes. Each user's stored hash names its scheme and
+// cost, so users hashed under different schemes coexist; a login that
+// verifies under an outdated one rehashes under the current policy.
+//   <64 hex>                                              salted SHA-256 (legacy)
+//   $pbkdf2-sha256$i=<iterations>$<64 hex>                PBKDF2-HMAC-SHA256 (RFC 8018)
+//   $argon2id$v=19$m=<KiB>,t=<passes>,p=<lanes>$<64 hex>  Argon2id (RFC 9106)
+// The salt is the user's salt field, as text, for every scheme.
+
+// BLAKE2b (RFC 7693), unkeyed, as Argon2 needs it.
+class Blake2b {
+public:
+    static constexpr size_t BLOCK_SIZE = 128;
+    static constexpr size_t MAX_OUT    = 64;
+
+    explicit Blake2b(size_t outLen) : outLen(outLen) {
+        memcpy(h, IV, sizeof(h));
+        h[0] ^= 0x01010000 ^ outLen;
+    }
+
+    void update(const void* data, size_t len) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (len > 0) {
+            // The last block is compressed by final(), so a full buffer waits for more input
+            if (bufLen == BLOCK_SIZE) {
+                counter += BLOCK_SIZE;
+                compress(buf, false);
+                bufLen = 0;
+            }
+            size_t take = min(len, BLOCK_SIZE - bufLen);
+            memcpy(buf + bufLen, p, take);
+            bufLen += take; p += take; len -= take;
+        }
+    }
+
+    void final(uint8_t* out) {
+        counter += bufLen;
+        memset(buf + bufLen, 0, BLOCK_SIZE - bufLen);
+        compress(buf, true);
+        uint8_t full[MAX_OUT];
+        for (int i = 0; i < 8; ++i)
+            for (int j = 0; j < 8; ++j) full[8 * i + j] = uint8_t(h[i] >> (8 * j));
+        memcpy(out, full, outLen);
+    }
+
+    static void hash(uint8_t* out, size_t outLen, const void* in, size_t inLen) {
+        Blake2b b(outLen);
+        b.update(in, inLen);
+        b.final(out);
+    }
+
+private:
+    static constexpr uint64_t IV[8] = {
+        0x6a09e667f3bcc908ull, 0xbb67ae8584caa73bull, 0x3c6ef372fe94f82bull, 0xa54ff53a5f1d36f1ull,
+        0x510e527fade682d1ull, 0x9b05688c2b3e6c1full, 0x1f83d9abfb41bd6bull, 0x5be0cd19137e2179ull};
+    static constexpr uint8_t SIGMA[12][16] = {
+        {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+        {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+        {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+        {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+        {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+        {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+        {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+        {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+        {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+        {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+        {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+        {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3}};
+
+    uint64_t h[8];
+    uint64_t counter{0};   // bytes so far; inputs here stay far below 2^64
+    uint8_t  buf[BLOCK_SIZE];
+    size_t   bufLen{0};
+    size_t   outLen;
+
+    static inline uint64_t rotr(uint64_t v, int n) { return (v >> n) | (v << (64 - n)); }
+
+    void compress(const uint8_t* block, bool last) {
+        uint64_t m[16], v[16];
+        for (int i = 0; i < 16; ++i) {
+            m[i] = 0;
+            for (int j = 7; j >= 0; --j) m[i] = m[i] << 8 | block[8 * i + j];
+        }
+        memcpy(v, h, sizeof(h));
+        memcpy(v + 8, IV, sizeof(IV));
+        v[12] ^= counter;
+        if (last) v[14] = ~v[14];
+        auto g = [&](int a, int b, int c, int d, uint64_t x, uint64_t y) {
+            v[a] += v[b] + x; v[d] = rotr(v[d] ^ v[a], 32);
+            v[c] += v[d];     v[b] = rotr(v[b] ^ v[c], 24);
+            v[a] += v[b] + y; v[d] = rotr(v[d] ^ v[a], 16);
+            v[c] += v[d];     v[b] = rotr(v[b] ^ v[c], 63);
+        };
+        for (int r = 0; r < 12; ++r) {
+            const uint8_t* s = SIGMA[r];
+            g(0, 4, 8, 12, m[s[0]], m[s[1]]);
+            g(1, 5, 9, 13, m[s[2]], m[s[3]]);
+            g(2, 6, 10, 14, m[s[4]], m[s[5]]);
+            g(3, 7, 11, 15, m[s[6]], m[s[7]]);
+            g(0, 5, 10, 15, m[s[8]], m[s[9]]);
+            g(1, 6, 11, 12, m[s[10]], m[s[11]]);
+            g(2, 7, 8, 13, m[s[12]], m[s[13]]);
+            g(3, 4, 9, 14, m[s[14]], m[s[15]]);
+        }
+        for (int i = 0; i < 8; ++i) h[i] ^= v[i] ^ v[i + 8];
+    }
+};
+
+namespace argon2 {
+    constexpr uint32_t VERSION = 0x13;
+    constexpr uint32_t SYNC_POINTS = 4;
+    constexpr size_t   BLOCK_WORDS = 128;   // 1 KiB
+
+    struct Block { uint64_t v[BLOCK_WORDS]; };
+
+    inline void put32(uint8_t* p, uint32_t v) {
+        for (int i = 0; i < 4; ++i) p[i] = uint8_t(v >> (8 * i));
+    }
+
+    // H' (RFC 9106 section 3.3): variable-length hash built from BLAKE2b-512
+    void hashLong(uint8_t* out, uint32_t outLen, const uint8_t* in, size_t inLen) {
+        uint8_t len[4];
+        put32(len, outLen);
+        if (outLen <= Blake2b::MAX_OUT) {
+            Blake2b b(outLen);
+            b.update(len, sizeof(len));
+            b.update(in, inLen);
+            b.final(out);
+            return;
+        }
+        uint8_t v[Blake2b::MAX_OUT];
+        Blake2b b(Blake2b::MAX_OUT);
+        b.update(len, sizeof(len));
+        b.update(in, inLen);
+        b.final(v);
+        memcpy(out, v, 32);
+        uint32_t done = 32;
+        while (outLen - done > Blake2b::MAX_OUT) {
+            Blake2b::hash(v, Blake2b::MAX_OUT, v, Blake2b::MAX_OUT);
+            memcpy(out + done, v, 32);
+            done += 32;
+        }
+        Blake2b::hash(out + done, outLen - done, v, Blake2b::MAX_OUT);
+    }
+
+    inline uint64_t rotr(uint64_t v, int n) { return (v >> n) | (v << (64 - n)); }
+
+    // BLAKE2b round with the multiplications of BlaMka, on 16 words
+    inline void mix(uint64_t& a, uint64_t& b, uint64_t& c, uint64_t& d) {
+        a = a + b + 2 * (a & 0xffffffffu) * (b & 0xffffffffu); d = rotr(d ^ a, 32);
+        c = c + d + 2 * (c & 0xffffffffu) * (d & 0xffffffffu); b = rotr(b ^ c, 24);
+        a = a + b + 2 * (a & 0xffffffffu) * (b & 0xffffffffu); d = rotr(d ^ a, 16);
+        c = c + d + 2 * (c & 0xffffffffu) * (d & 0xffffffffu); b = rotr(b ^ c, 63);
+    }
+
+    inline void permute(uint64_t* v[16]) {
+        mix(*v[0], *v[4], *v[8],  *v[12]);
+        mix(*v[1], *v[5], *v[9],  *v[13]);
+        mix(*v[2], *v[6], *v[10], *v[14]);
+        mix(*v[3], *v[7], *v[11], *v[15]);
+        mix(*v[0], *v[5], *v[10], *v[15]);
+        mix(*v[1], *v[6], *v[11], *v[12]);
+        mix(*v[2], *v[7], *v[8],  *v[13]);
+        mix(*v[3], *v[4], *v[9],  *v[14]);
+    }
+
+    // Compression G: next = P(prev ^ ref) ^ prev ^ ref, also xored with the
+    // old next on passes after the first.
+    void fillBlock(const Block& prev, const Block& ref, Block& next, bool withXor) {
+        Block r, tmp;
+        for (size_t i = 0; i < BLOCK_WORDS; ++i) r.v[i] = prev.v[i] ^ ref.v[i];
+        tmp = r;
+        if (withXor)
+            for (size_t i = 0; i < BLOCK_WORDS; ++i) tmp.v[i] ^= next.v[i];
+        uint64_t* v[16];
+        for (int row = 0; row < 8; ++row) {
+            for (int i = 0; i < 16; ++i) v[i] = &r.v[16 * row + i];
+            permute(v);
+        }
+        for (int col = 0; col < 8; ++col) {
+            for (int i = 0; i < 8; ++i) {
+                v[2 * i]     = &r.v[2 * col + 16 * i];
+                v[2 * i + 1] = &r.v[2 * col + 16 * i + 1];
+            }
+            permute(v);
+        }
+        for (size_t i = 0; i < BLOCK_WORDS; ++i) next.v[i] = tmp.v[i] ^ r.v[i];
+    }
+
+    struct Params {
+        uint32_t memoryKiB{19456};
+        uint32_t passes{2};
+        uint32_t lanes{1};
+    };
+
+    // Argon2id tag of outLen bytes. memory holds the blocks and is reused
+    // across calls, so a caller that keeps it allocates once. secret and ad
+    // are K and X of the RFC.
+    bool hash(const Params& prm, const uint8_t* pwd, size_t pwdLen, const uint8_t* salt, size_t saltLen,
+              const uint8_t* secret, size_t secretLen, const uint8_t* ad, size_t adLen,
+              uint8_t* out, uint32_t outLen, vector<Block>& memory) {
+        const uint32_t p = prm.lanes, t = prm.passes;
+        if (p == 0 || p > 0xffffff || t == 0 || outLen < 4 || prm.memoryKiB < 8 * p || saltLen < 8) return false;
+        const uint32_t segment = prm.memoryKiB / (SYNC_POINTS * p);
+        const uint32_t laneLen = segment * SYNC_POINTS;
+        const uint32_t blocks = laneLen * p;
+        memory.resize(blocks);
+
+        // H0, then the first two blocks of every lane
+        uint8_t h0[Blake2b::MAX_OUT + 8];
+        {
+            Blake2b b(Blake2b::MAX_OUT);
+            uint8_t w[4];
+            auto word = [&](uint32_t v) { put32(w, v); b.update(w, sizeof(w)); };
+            auto bytes = [&](const uint8_t* d, size_t n) { word((uint32_t)n); if (n) b.update(d, n); };
+            word(p); word(outLen); word(prm.memoryKiB); word(t); word(VERSION); word(2);   // type 2: Argon2id
+            bytes(pwd, pwdLen);
+            bytes(salt, saltLen);
+            bytes(secret, secretLen);
+            bytes(ad, adLen);
+            b.final(h0);
+        }
+        uint8_t blockBytes[sizeof(Block)];
+        auto toBlock = [&](Block& blk) {
+            for (size_t i = 0; i < BLOCK_WORDS; ++i) {
+                uint64_t v = 0;
+                for (int j = 7; j >= 0; --j) v = v << 8 | blockBytes[8 * i + j];
+                blk.v[i] = v;
+            }
+        };
+        for (uint32_t l = 0; l < p; ++l) {
+            for (uint32_t i = 0; i < 2; ++i) {
+                put32(h0 + Blake2b::MAX_OUT, i);
+                put32(h0 + Blake2b::MAX_OUT + 4, l);
+                hashLong(blockBytes, sizeof(blockBytes), h0, sizeof(h0));
+                toBlock(memory[l * laneLen + i]);
+            }
+        }
+
+        Block zero{}, input{}, address{};
+        for (uint32_t pass = 0; pass < t; ++pass) {
+            for (uint32_t slice = 0; slice < SYNC_POINTS; ++slice) {
+                for (uint32_t lane = 0; lane < p; ++lane) {
+                    const bool independent = pass == 0 && slice < SYNC_POINTS / 2;
+                    auto nextAddresses = [&] {
+                        ++input.v[6];
+                        fillBlock(zero, input, address, false);
+                        fillBlock(zero, address, address, false);
+                    };
+                    if (independent) {
+                        input = Block{};
+                        input.v[0] = pass; input.v[1] = lane; input.v[2] = slice;
+                        input.v[3] = blocks; input.v[4] = t; input.v[5] = 2;
+                    }
+                    uint32_t start = 0;
+                    if (pass == 0 && slice == 0) {
+                        start = 2;
+                        if (independent) nextAddresses();
+                    }
+                    uint32_t cur = lane * laneLen + slice * segment + start;
+                    uint32_t prev = cur % laneLen == 0 ? cur + laneLen - 1 : cur - 1;
+                    for (uint32_t i = start; i < segment; ++i, ++cur, ++prev) {
+                        if (cur % laneLen == 1) prev = cur - 1;
+                        uint64_t rnd;
+                        if (independent) {
+                            if (i % BLOCK_WORDS == 0) nextAddresses();
+                            rnd = address.v[i % BLOCK_WORDS];
+                        } else {
+                            rnd = memory[prev].v[0];
+                        }
+                        uint32_t refLane = pass == 0 && slice == 0 ? lane : uint32_t((rnd >> 32) % p);
+                        bool sameLane = refLane == lane;
+
+                        // Reference index (RFC 9106 section 3.4.1.2)
+                        int64_t back = sameLane ? int64_t(i) - 1 : (i == 0 ? -1 : 0);
+                        uint64_t area = uint64_t(pass == 0 ? (slice == 0 ? int64_t(i) - 1 : int64_t(slice) * segment + back)
+                                                           : int64_t(laneLen) - segment + back);
+                        uint64_t x = rnd & 0xffffffffu;
+                        x = x * x >> 32;
+                        uint64_t rel = area - 1 - (area * x >> 32);
+                        uint64_t startPos = pass != 0 && slice != SYNC_POINTS - 1 ? uint64_t(slice + 1) * segment : 0;
+                        uint32_t refIndex = uint32_t((startPos + rel) % laneLen);
+
+                        fillBlock(memory[prev], memory[refLane * laneLen + refIndex], memory[cur], pass != 0);
+                    }
+                }
+            }
+        }
+
+        Block last = memory[laneLen - 1];
+        for (uint32_t l = 1; l < p; ++l)
+            for (size_t i = 0; i < BLOCK_WORDS; ++i) last.v[i] ^= memory[l * laneLen + laneLen - 1].v[i];
+        for (size_t i = 0; i < BLOCK_WORDS; ++i)
+            for (int j = 0; j < 8; ++j) blockBytes[8 * i + j] = uint8_t(last.v[i] >> (8 * j));
+        hashLong(out, outLen, blockBytes, sizeof(blockBytes));
+        memset(blockBytes, 0, sizeof(blockBytes));
+        memset(h0, 0, sizeof(h0));
+        return true;
+    }
+}
+
+// PBKDF2-HMAC-SHA256 (RFC 8018), one output block.
+void pbkdf2Sha256(const uint8_t* pwd, size_t pwdLen, const uint8_t* salt, size_t saltLen,
+                  uint32_t iterations, uint8_t out[SHA256::DIGEST_SIZE]) {
+    HmacSha256 prf(pwd, pwdLen);
+    string first(reinterpret_cast<const char*>(salt), saltLen);
+    first.append("\0\0\0\1", 4);   // block index 1
+    uint8_t u[SHA256::DIGEST_SIZE];
+    prf.mac(first.data(), first.size(), u);
+    memcpy(out, u, sizeof(u));
+    for (uint32_t i = 1; i < iterations; ++i) {
+        prf.mac(u, sizeof(u), u);
+        for (size_t j = 0; j < sizeof(u); ++j) out[j] ^= u[j];
+    }
+    memset(u, 0, sizeof(u));
+}
+
+namespace PasswordHash {
+    enum class Scheme : uint8_t { SHA256_SALTED, PBKDF2_SHA256, ARGON2ID };
+
+    struct Params {
+        Scheme         scheme{Scheme::ARGON2ID};
+        uint32_t       iterations{0};   // PBKDF2
+        argon2::Params argon;
+
+        bool operator==(const Params& o) const {
+            if (scheme != o.scheme) return false;
+            if (scheme == Scheme::PBKDF2_SHA256) return iterations == o.iterations;
+            if (scheme == Scheme::ARGON2ID)
+                return argon.memoryKiB == o.argon.memoryKiB && argon.passes == o.argon.passes &&
+                       argon.lanes == o.argon.lanes;
+            return true;
+        }
+    };
+
+    // What new hashes use: Config, or CLOUD_PASSWORD_KDF=pbkdf2|argon2id.
+    const Params& policy() {
+        static const Params p = [] {
+            Params q;
+            const char* forced = getenv("CLOUD_PASSWORD_KDF");
+            string name = forced ? forced : Config::PASSWORD_KDF;
+            q.scheme = name == "pbkdf2" ? Scheme::PBKDF2_SHA256 : Scheme::ARGON2ID;
+            q.iterations = Config::PBKDF2_ITERATIONS;
+            q.argon = {Config::ARGON2_MEMORY_KIB, Config::ARGON2_PASSES, Config::ARGON2_LANES};
+            return q;
+        }();
+        return p;
+    }
+
+    // Splits "$name$params$hex" (or bare hex) into params and digest.
+    bool parse(const string& stored, Params& out, uint8_t digest[SHA256::DIGEST_SIZE]) {
+        if (stored.empty() || stored[0] != '$') {
+            out = Params{Scheme::SHA256_SALTED, 0, {}};
+            return fromHex(stored, digest, SHA256::DIGEST_SIZE);
+        }
+        size_t last = stored.rfind('$');
+        if (!fromHex(string_view(stored).substr(last + 1), digest, SHA256::DIGEST_SIZE)) return false;
+        string_view head = string_view(stored).substr(0, last);
+        unsigned long a = 0, b = 0, c = 0;
+        int used = 0;
+        string h(head);
+        if (sscanf(h.c_str(), "$pbkdf2-sha256$i=%lu%n", &a, &used) == 1 && used == (int)h.size()) {
+            out = Params{Scheme::PBKDF2_SHA256, (uint32_t)a, {}};
+            return a > 0 && a <= 0xffffffffu;
+        }
+        if (sscanf(h.c_str(), "$argon2id$v=19$m=%lu,t=%lu,p=%lu%n", &a, &b, &c, &used) == 3 &&
+            used == (int)h.size()) {
+            out = Params{Scheme::ARGON2ID, 0, {(uint32_t)a, (uint32_t)b, (uint32_t)c}};
+            return a <= (1u << 22) && b <= 0xffffffffu && c <= 0xffffffu;   // at most 4 GiB
+        }
+        return false;
+    }
+
+    string format(const Params& p, const uint8_t digest[SHA256::DIGEST_SIZE]) {
+        string hex = toHex(digest, SHA256::DIGEST_SIZE);
+        switch (p.scheme) {
+            case Scheme::SHA256_SALTED: return hex;
+            case Scheme::PBKDF2_SHA256: return "$pbkdf2-sha256$i=" + to_string(p.iterations) + "$" + hex;
+            case Scheme::ARGON2ID:
+                return "$argon2id$v=19$m=" + to_string(p.argon.memoryKiB) + ",t=" + to_string(p.argon.passes) +
+                       ",p=" + to_string(p.argon.lanes) + "$" + hex;
+        }
+        return hex;
+    }
+
+    // The digest of password under p. scratch is Argon2's memory, kept by
+    // the caller between calls.
+    bool derive(const Params& p, const string& salt, const string& password,
+                uint8_t out[SHA256::DIGEST_SIZE], vector<argon2::Block>& scratch) {
+        const uint8_t* pw = reinterpret_cast<const uint8_t*>(password.data());
+        const uint8_t* s = reinterpret_cast<const uint8_t*>(salt.data());
+        switch (p.scheme) {
+            case Scheme::SHA256_SALTED: {
+                SHA256 sha;
+                sha.update(salt);
+                sha.update(password);
+                sha.final(out);
+                return true;
+            }
+            case Scheme::PBKDF2_SHA256:
+                pbkdf2Sha256(pw, password.size(), s, salt.size(), p.iterations, out);
+                return true;
+            case Scheme::ARGON2ID:
+                return argon2::hash(p.argon, pw, password.size(), s, salt.size(), nullptr, 0, nullptr, 0,
+                                    out, SHA256::DIGEST_SIZE, scratch);
+        }
+        return false;
+    }
+
+    bool needsRehash(const string& stored) {
+        Params p;
+        uint8_t digest[SHA256::DIGEST_SIZE];
+        return !parse(stored, p, digest) || !(p == policy());
+    }
+}
+
+// ================== Enums ==================
+enum class UserRole { FREE_USER, PREMIUM_USER, ADMIN };
+enum class Region   { ASIA, EUROPE, AMERICA, GLOBAL };
+enum class FileType { DOCUMENT, IMAGE, VIDEO, AUDIO, OTHER };
+enum class AuditEventType {
+    SYSTEM, REGISTER, LOGIN_SUCCESS, LOGIN_FAIL, LOCKOUT,
+    LOGOUT, UPLOAD, DELETE, UPGRADE, ADMIN_ACTION
+};
+enum class AuditReason : uint8_t {
+    NONE, NOT_FOUND, INACTIVE, LOCKED, BAD_PASSWORD, MFA_FAILED,
+    TOO_MANY_FAILURES, UNLOCK_USER, APP_START, APP_CLOSE, EVENTS_DROPPED,
+    QUOTA_DRIFT
+};
+
+// ================== Helpers ==================
+string formatTime(time_t t) {
+    tm ltm;
+    localtime_r(&t, &ltm);
+    char buffer[32];
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &ltm);
+    return string(buffer);
+}
+
+string getCurrentTime() {
+    return formatTime(time(nullptr));
+}
+
+// Inverse of formatTime: "YYYY-mm-dd HH:MM:SS" in local time. mktime()
+// is slow, so the start of the last hour seen is cached per thread.
+bool parseLocalTime(string_view s, time_t& out) {
+    if (s.size() != 19 || s[4] != '-' || s[7] != '-' || s[10] != ' ' || s[13] != ':' || s[16] != ':')
+        return false;
+    auto num = [&](size_t at, size_t len, int& v) {
+        return from_chars(s.data() + at, s.data() + at + len, v).ptr == s.data() + at + len;
+    };
+    int minute, second;
+    if (!num(14, 2, minute) || !num(17, 2, second) || minute > 59 || second > 60) return false;
+
+    static thread_local char cachedHour[13] = {};
+    static thread_local time_t cachedStart = -1;
+    if (cachedStart == -1 || memcmp(cachedHour, s.data(), 13) != 0) {
+        tm t{};
+        if (!num(0, 4, t.tm_year) || !num(5, 2, t.tm_mon) || !num(8, 2, t.tm_mday) || !num(11, 2, t.tm_hour))
+            return false;
+        t.tm_year -= 1900;
+        t.tm_mon -= 1;
+        t.tm_isdst = -1;
+        time_t start = mktime(&t);
+        if (start == (time_t)-1) return false;
+        memcpy(cachedHour, s.data(), 13);
+        cachedStart = start;
+    }
+    out = cachedStart + minute * 60 + second;
+    return true;
+}
+
+// Converts a megabyte figure (user input, legacy records) to whole bytes.
+int64_t mbToBytes(double mb) {
+    return (int64_t)llround(mb * (double)Config::MB);
+}
+
+string formatFileSize(int64_t bytes) {
+    double sizeMB = (double)bytes / Config::MB;
+    stringstream ss;
+    if (sizeMB < 1.0) {
+        double kb = sizeMB * 1024.0;
+        ss << fixed << setprecision( (abs(kb - round(kb)) < 1e-6) ? 0 : 1 ) << kb << " KB";
+    } else if (sizeMB < 1024.0) {
+        ss << fixed << setprecision( (abs(sizeMB - round(sizeMB)) < 1e-6) ? 0 : 1 ) << sizeMB << " MB";
+    } else {
+        double gb = sizeMB / 1024.0;
+        ss << fixed << setprecision( (abs(gb*10 - round(gb*10)) < 1e-6) ? 1 : 2 ) << gb << " GB";
+    }
+    return ss.str();
+}
+
+FileType detectFileType(const string& filename) {
+    size_t pos = filename.find_last_of('.');
+    if (pos == string::npos) return FileType::OTHER;
+    string ext = filename.substr(pos + 1);
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+    if (ext == "txt" || ext == "pdf" || ext == "doc" || ext == "docx" || ext == "xlsx" || ext == "pptx")
+        return FileType::DOCUMENT;
+    if (ext == "jpg" || ext == "jpeg" || ext == "png" || ext == "gif" || ext == "bmp")
+        return FileType::IMAGE;
+    if (ext == "mp4" || ext == "avi" || ext == "mov" || ext == "wmv" || ext == "mkv")
+        return FileType::VIDEO;
+    if (ext == "mp3" || ext == "wav" || ext == "flac" || ext == "aac")
+        return FileType::AUDIO;
+    return FileType::OTHER;
+}
+
+// ---------- Random ----------
+// One ChaCha20 keystream per thread, keyed from getentropy(). Output is
+// served from a buffer of keystream blocks; every refill rekeys from the
+// first 32 bytes it generates, so a captured state cannot reproduce
+// earlier output.
+class SecureRandom {
+private:
+    static constexpr size_t BLOCKS = 8;
+
+    uint32_t key[8];
+    uint64_t counter{0};
+    alignas(64) uint8_t buf[64 * BLOCKS];
+    size_t pos{sizeof(buf)};
+
+    static inline uint32_t rotl(uint32_t v, int n) { return (v << n) | (v >> (32 - n)); }
+
+    static inline void quarter(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d) {
+        a += b; d ^= a; d = rotl(d, 16);
+        c += d; b ^= c; b = rotl(b, 12);
+        a += b; d ^= a; d = rotl(d, 8);
+        c += d; b ^= c; b = rotl(b, 7);
+    }
+
+    void refill() {
+        for (size_t b = 0; b < BLOCKS; ++b) {
+            const uint32_t input[4] = {(uint32_t)counter, (uint32_t)(counter >> 32), 0, 0};
+            block(key, input, buf + 64 * b);
+            ++counter;
+        }
+        for (int i = 0; i < 8; ++i) key[i] = load32le(buf + 4 * i);
+        memset(buf, 0, 32);
+        counter = 0;
+        pos = 32;
+    }
+
+    static inline uint32_t load32le(const uint8_t* p) {
+        return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+    }
+
+    SecureRandom() {
+        uint8_t seed[32];
+        if (getentropy(seed, sizeof(seed)) != 0) throw runtime_error("getentropy failed");
+        for (int i = 0; i < 8; ++i) key[i] = load32le(seed + 4 * i);
+        memset(seed, 0, sizeof(seed));
+    }
+
+public:
+    // One ChaCha20 block (RFC 8439): input is words 12..15 of the state,
+    // i.e. block counter and nonce.
+    static void block(const uint32_t key[8], const uint32_t input[4], uint8_t out[64]) {
+        const uint32_t init[16] = {
+            0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+            key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+            input[0], input[1], input[2], input[3]};
+        uint32_t x[16];
+        memcpy(x, init, sizeof(x));
+        for (int round = 0; round < 10; ++round) {
+            quarter(x[0], x[4], x[8],  x[12]);
+            quarter(x[1], x[5], x[9],  x[13]);
+            quarter(x[2], x[6], x[10], x[14]);
+            quarter(x[3], x[7], x[11], x[15]);
+            quarter(x[0], x[5], x[10], x[15]);
+            quarter(x[1], x[6], x[11], x[12]);
+            quarter(x[2], x[7], x[8],  x[13]);
+            quarter(x[3], x[4], x[9],  x[14]);
+        }
+        for (int i = 0; i < 16; ++i) {
+            uint32_t v = x[i] + init[i];
+            out[4 * i]     = uint8_t(v);
+            out[4 * i + 1] = uint8_t(v >> 8);
+            out[4 * i + 2] = uint8_t(v >> 16);
+            out[4 * i + 3] = uint8_t(v >> 24);
+        }
+    }
+
+    static SecureRandom& local() {
+        static thread_local SecureRandom rng;
+        return rng;
+    }
+
+    void fill(void* out, size_t len) {
+        uint8_t* p = static_cast<uint8_t*>(out);
+        while (len > 0) {
+            if (pos == sizeof(buf)) refill();
+            size_t n = min(len, sizeof(buf) - pos);
+            memcpy(p, buf + pos, n);
+            memset(buf + pos, 0, n);
+            pos += n;
+            p += n;
+            len -= n;
+        }
+    }
+
+    uint64_t next64() {
+        uint64_t v;
+        fill(&v, sizeof(v));
+        return v;
+    }
+
+    // Uniform in [0, bound), without modulo bias.
+    uint32_t below(uint32_t bound) {
+        uint32_t limit = uint32_t(0) - (uint32_t(0) - bound) % bound;   // largest multiple of bound, mod 2^32
+        while (true) {
+            uint32_t v;
+            fill(&v, sizeof(v));
+            if (limit == 0 || v < limit) return v % bound;
+        }
+    }
+};
+
+string randomHex(size_t bytes) {
+    string out(bytes * 2, '\0');
+    uint8_t chunk[32];
+    for (size_t done = 0; done < bytes;) {
+        size_t n = min(bytes - done, sizeof(chunk));
+        SecureRandom::local().fill(chunk, n);
+        hexEncode(chunk, n, &out[2 * done]);
+        done += n;
+    }
+    return out;
+}
+
+string generateSalt() {
+    return randomHex(16);
+}
+
+string generateMfaCode() {
+    uint32_t v = SecureRandom::local().below(1000000);
+    char code[7];
+    for (int i = 5; i >= 0; --i, v /= 10) code[i] = char('0' + v % 10);
+    code[6] = '\0';
+    return string(code, 6);
+}
+
+// 128-bit file identifier. Text form is "file_" followed by 32 hex digits;
+// ids issued before this type existed have fewer digits (their two halves
+// were not zero padded) and parse to the same value every time.
+struct FileId {
+    uint64_t hi{0};
+    uint64_t lo{0};
+
+    static constexpr size_t TEXT_LEN = 37;
+
+    bool empty() const { return (hi | lo) == 0; }
+    bool operator==(const FileId& o) const { return hi == o.hi && lo == o.lo; }
+    bool operator!=(const FileId& o) const { return !(*this == o); }
+    bool operator<(const FileId& o) const { return hi != o.hi ? hi < o.hi : lo < o.lo; }
+
+    // Writes exactly TEXT_LEN characters.
+    void format(char* out) const {
+        uint8_t raw[16];
+        for (int i = 0; i < 8; ++i) {
+            raw[i]     = uint8_t(hi >> (56 - 8 * i));
+            raw[8 + i] = uint8_t(lo >> (56 - 8 * i));
+        }
+        memcpy(out, "file_", 5);
+        hexEncode(raw, sizeof(raw), out + 5);
+    }
+
+    string str() const {
+        string s(TEXT_LEN, '\0');
+        format(&s[0]);
+        return s;
+    }
+
+    void appendTo(string& out) const {
+        size_t at = out.size();
+        out.resize(at + TEXT_LEN);
+        format(&out[at]);
+    }
+
+    static bool parse(string_view s, FileId& out) {
+        if (s.size() <= 5 || s.size() > TEXT_LEN || s.substr(0, 5) != "file_") return false;
+        FileId id;
+        for (char c : s.substr(5)) {
+            int v = c >= '0' && c <= '9' ? c - '0'
+                  : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                  : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (v < 0) return false;
+            id.hi = (id.hi << 4) | (id.lo >> 60);
+            id.lo = (id.lo << 4) | uint64_t(v);
+        }
+        out = id;
+        return true;
+    }
+};
+
+namespace std {
+    template <> struct hash<FileId> {
+        size_t operator()(const FileId& id) const noexcept {
+            return size_t(id.lo ^ (id.hi * 0x9e3779b97f4a7c15ull));
+        }
+    };
+}
+
+FileId generateFileId() {
+    FileId id;
+    do {
+        id.hi = SecureRandom::local().next64();
+        id.lo = SecureRandom::local().next64();
+    } while (id.empty());
+    return id;
+}
+
+// ---------- Durable file I/O ----------
+// fdatasync where available; only the data has to reach the disk
+inline int syncFd(int fd) {
+#if defined(__linux__)
+    return ::fdatasync(fd);
+#else
+    return ::fsync(fd);
+#endif
+}
+
+bool writeAllFd(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= size_t(n);
+    }
+    return true;
+}
+
+// Makes a rename/create inside `dir` durable.
+void syncDir(const string& dir) {
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    ::fsync(fd);
+    ::close(fd);
+}
+
+// Syncs the whole file system holding dir: cheaper than one fsync per
+// file when many files changed.
+bool syncFileSystem(const string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+#if defined(__linux__)
+    bool ok = ::syncfs(fd) == 0;
+#else
+    ::sync();
+    bool ok = true;
+#endif
+    ::close(fd);
+    return ok;
+}
+
+// Marks fd close-on-exec, and non-blocking if asked: the portable form of
+// SOCK_CLOEXEC, SOCK_NONBLOCK and pipe2.
+bool setFdFlags(int fd, bool nonBlocking = false) {
+    int fdFlags = ::fcntl(fd, F_GETFD);
+    if (fdFlags < 0 || ::fcntl(fd, F_SETFD, fdFlags | FD_CLOEXEC) != 0) return false;
+    if (!nonBlocking) return true;
+    int flFlags = ::fcntl(fd, F_GETFL);
+    return flFlags >= 0 && ::fcntl(fd, F_SETFL, flFlags | O_NONBLOCK) == 0;
+}
+
+string parentDir(const string& path) {
+    size_t slash = path.find_last_of('/');
+    return slash == string::npos ? "." : path.substr(0, slash + 1);
+}
+
+// Crash-safe replace: write tmp, fsync, rename over path, fsync the directory.
+bool writeFileAtomic(const string& path, const string& data) {
+    string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = writeAllFd(fd, data.data(), data.size()) && ::fsync(fd) == 0;
+    ::close(fd);
+    if (!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    syncDir(parentDir(path));
+    return true;
+}
+
+// Replaces out with the file's contents; reuses out's capacity.
+bool readFile(const string& path, string& out) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (::fstat(fd, &st) != 0) { ::close(fd); return false; }
+    out.resize((size_t)st.st_size);
+    size_t got = 0;
+    while (true) {
+        if (got == out.size()) out.resize(out.size() + 4096);  // grew since fstat
+        ssize_t n = ::read(fd, &out[got], out.size() - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    ::close(fd);
+    out.resize(got);
+    return true;
+}
+
+// ---------- Read-ahead ----------
+// Calls produce(buf) on a helper thread, up to `depth` buffers ahead of the
+// consumer, so the next read overlaps work on the current buffer. produce
+// returns false at the end of its input. Buffers are recycled.
+template <typename Produce>
+class ReadAhead {
+public:
+    explicit ReadAhead(Produce p, size_t depth = 2)
+        : produce(std::move(p)), depth(depth), worker([this] { run(); }) {}
+
+    ReadAhead(const ReadAhead&) = delete;
+    ReadAhead& operator=(const ReadAhead&) = delete;
+
+    ~ReadAhead() {
+        {
+            lock_guard<mutex> lk(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    // Swaps the next buffer into out; false once the input is exhausted.
+    bool next(string& out) {
+        unique_lock<mutex> lk(mtx);
+        cv.wait(lk, [&] { return !ready.empty() || done; });
+        if (ready.empty()) return false;
+        swap(out, ready.front());
+        spare.push_back(std::move(ready.front()));
+        ready.pop_front();
+        cv.notify_all();
+        return true;
+    }
+
+private:
+    Produce produce;
+    size_t depth;
+    mutex mtx;
+    condition_variable cv;
+    deque<string> ready;
+    vector<string> spare;
+    bool stopping{false};
+    bool done{false};
+    thread worker;     // last: starts once everything above exists
+
+    void run() {
+        string buf;
+        while (true) {
+            {
+                unique_lock<mutex> lk(mtx);
+                cv.wait(lk, [&] { return stopping || ready.size() < depth; });
+                if (stopping) break;
+                if (!spare.empty()) {
+                    buf.swap(spare.back());
+                    spare.pop_back();
+                }
+            }
+            if (!produce(buf)) break;
+            lock_guard<mutex> lk(mtx);
+            ready.push_back(std::move(buf));
+            buf.clear();
+            cv.notify_all();
+        }
+        lock_guard<mutex> lk(mtx);
+        done = true;
+        cv.notify_all();
+    }
+};
+
+uint32_t crc32(const void* data, size_t len) {
+    static const auto table = [] {
+        array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; ++i) c = table[(c ^ p[i]) & 0xff] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+// Length + CRC framed records, shared by the write-ahead logs:
+//   u32 payload length, u32 crc32(payload), payload
+void appendFramed(string& out, const string& payload) {
+    uint32_t len = (uint32_t)payload.size(), crc = crc32(payload.data(), payload.size());
+    for (int i = 0; i < 4; ++i) out += char(len >> (8 * i));
+    for (int i = 0; i < 4; ++i) out += char(crc >> (8 * i));
+    out += payload;
+}
+
+// Calls fn(payload) for each intact record; returns the offset just past the
+// last one, so a torn tail left by a crash can be truncated away.
+template <typename Fn>
+size_t forEachFramed(const string& data, Fn fn) {
+    auto u32 = [&](size_t off) {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data()) + off;
+        return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+    };
+    size_t off = 0;
+    while (off + 8 <= data.size()) {
+        uint32_t len = u32(off), crc = u32(off + 4);
+        if (off + 8 + len > data.size()) break;
+        if (crc32(data.data() + off + 8, len) != crc) break;
+        fn(data.substr(off + 8, len));
+        off += 8 + len;
+    }
+    return off;
+}
+
+// ================== Models ==================
+// Byte total that uploads reserve against without holding the user lock:
+// tryReserve either adds the whole amount within the limit or nothing.
+// Copies take a snapshot of the value.
+class ByteCounter {
+    atomic<int64_t> bytes{0};
+    atomic<int32_t> pending{0};   // reservations not yet committed or released
+public:
+    ByteCounter() = default;
+    ByteCounter(const ByteCounter& o) : bytes(o.load()) {}
+    ByteCounter& operator=(const ByteCounter& o) { bytes.store(o.load()); return *this; }
+    ByteCounter& operator=(int64_t v) { bytes.store(v); return *this; }
+
+    int64_t load() const { return bytes.load(memory_order_acquire); }
+    bool inFlight() const { return pending.load(memory_order_acquire) != 0; }
+
+    // Opens a reservation of n bytes; settle it with commit() or cancel().
+    bool tryReserve(int64_t n, int64_t limit) {
+        pending.fetch_add(1, memory_order_acq_rel);
+        if (tryGrow(n, limit)) return true;
+        pending.fetch_sub(1, memory_order_acq_rel);
+        return false;
+    }
+    // Adds n to an open reservation, e.g. as a streamed upload arrives.
+    bool tryGrow(int64_t n, int64_t limit) {
+        int64_t cur = load();
+        do {
+            if (n > limit - cur) return false;
+        } while (!bytes.compare_exchange_weak(cur, cur + n, memory_order_acq_rel));
+        return true;
+    }
+    void commit() { pending.fetch_sub(1, memory_order_acq_rel); }
+    void cancel(int64_t n) { bytes.fetch_sub(n, memory_order_acq_rel); commit(); }
+    void release(int64_t n) { bytes.fetch_sub(n, memory_order_acq_rel); }
+    void adjust(int64_t delta) { bytes.fetch_add(delta, memory_order_acq_rel); }
+};
+
+struct User {
+    string username;
+    string salt;
+    string passwordHash;
+    string fullName;
+    int    age{};
+    string gender;
+    UserRole role{UserRole::FREE_USER};
+    ByteCounter usedBytes;
+    time_t registrationDate{};
+    bool   isActive{true};
+    int    failedLogins{0};
+    bool   isLocked{false};
+    time_t lastLoginTime{0};
+    bool   mfaEnabled{false};
+
+    string roleString() const {
+        switch (role) {
+            case UserRole::FREE_USER:   return "Free User";
+            case UserRole::PREMIUM_USER:return "Premium User";
+            case UserRole::ADMIN:       return "Administrator";
+        }
+        return "Unknown";
+    }
+
+    int64_t storageLimit() const {
+        using namespace Config;
+        switch (role) {
+            case UserRole::FREE_USER:    return FREE_STORAGE_LIMIT;
+            case UserRole::PREMIUM_USER: return PREMIUM_STORAGE_LIMIT;
+            case UserRole::ADMIN:        return ADMIN_STORAGE_LIMIT;
+        }
+        return FREE_STORAGE_LIMIT;
+    }
+
+    string salutation() const {
+        bool male = (gender == "M" || gender == "m" || gender == "Male");
+        if (age > 40) return male ? "Sir" : "Ma'am";
+        return male ? "Mr." : "Ms.";
+    }
+};
+
+// Hashes salt||password straight into a digest, no concatenated temporary.
+void passwordDigest(const string& salt, const string& password, uint8_t out[SHA256::DIGEST_SIZE]) {
+    SHA256 sha;
+    sha.update(salt);
+    sha.update(password);
+    sha.final(out);
+}
+
+// Empty when the name is acceptable, otherwise why not. Names end up in
+// file paths and '|' separated records, so the alphabet is restricted.
+string usernameProblem(const string& name) {
+    if (name.size() < 3) return "Username must be at least 3 characters.";
+    if (name.size() > 63) return "Username must be at most 63 characters.";
+    for (char c : name)
+        if (!isalnum((unsigned char)c) && c != '.' && c != '_' && c != '-')
+            return "Username may only contain letters, digits, '.', '_' and '-'.";
+    if (name[0] == '.') return "Username may not start with '.'.";
+    return "";
+}
+
+string passwordProblem(const string& pwd) {
+    if ((int)pwd.size() < Config::PASSWORD_MIN_LEN) return "Password too short.";
+    bool hasDigit = false, hasAlpha = false;
+    for (char c : pwd) {
+        if (isdigit((unsigned char)c)) hasDigit = true;
+        if (isalpha((unsigned char)c)) hasAlpha = true;
+    }
+    if (!hasDigit || !hasAlpha) return "Password must contain both letters and digits.";
+    return "";
+}
+
+// Free text stored in '|' separated, line based records
+bool storableText(const string& s) {
+    return s.find_first_of("|\r\n") == string::npos;
+}
+
+// Batch login verification (CloudEngine::verifyLogins)
+// BUSY: the password could not be checked in time (KDF pool full or
+// slow); nothing about the account changed.
+enum class LoginStatus { OK, MFA_REQUIRED, NOT_FOUND, INACTIVE, LOCKED, BAD_PASSWORD, LOCKED_OUT, BUSY };
+
+struct LoginAttempt {
+    string username;
+    string password;
+};
+
+struct LoginResult {
+    LoginStatus status{LoginStatus::NOT_FOUND};
+    int failedLogins{0};    // counter after this attempt was applied
+};
+
+string regionName(Region region) {
+    switch (region) {
+        case Region::ASIA:    return "Asia";
+        case Region::EUROPE:  return "Europe";
+        case Region::AMERICA: return "America";
+        case Region::GLOBAL:  return "Global";
+    }
+    return "Unknown";
+}
+
+// Lower-case region name, for directory names
+string regionSlug(Region region) {
+    string name = regionName(region);
+    for (auto& c : name) c = (char)tolower((unsigned char)c);
+    return name;
+}
+
+string fileTypeName(FileType type) {
+    switch (type) {
+        case FileType::DOCUMENT: return "Document";
+        case FileType::IMAGE:    return "Image";
+        case FileType::VIDEO:    return "Video";
+        case FileType::AUDIO:    return "Audio";
+        case FileType::OTHER:    return "Other";
+    }
+    return "Unknown";
+}
+
+struct FileRecord {
+    FileId id;
+    string name;
+    string owner;
+    Region region{Region::GLOBAL};
+    FileType type{FileType::OTHER};
+    time_t uploaded{0};
+    int64_t sizeBytes{0};
+    string description;
+    bool   isPublic{false};
+    bool   encryptedAtRest{false};
+
+    string regionString() const { return regionName(region); }
+    string typeString() const { return fileTypeName(type); }
+    string dateString() const { return formatTime(uploaded); }
+};
+
+// ================== Metrics ==================
+// Latencies of engine operations and persistence calls, plus a few
+// counters. Each thread records into its own Metrics::Slot and is that
+// slot's only writer. Recording is therefore relaxed loads and stores:
+// no locks and no read-modify-write instructions. Readers sum every slot
+// while writers carry on; a snapshot may see a sample's count before its
+// latency, which skews it by at most the samples in flight. Slots of
+// finished threads are reused, never freed.
+//
+// Latencies go into log-linear (HDR style) buckets of nanoseconds, 16 per
+// power of two. Quantiles are therefore within 1/16 of the true value,
+// from 1 ns up to the 2^40 ns (~18 min) clamp. A thread allocates an
+// operation's buckets the first time it records that operation.
+namespace Metrics {
+    enum class Op : uint8_t {
+        // engine operations
+        LOGIN, VERIFY_LOGINS, MFA, AUTHENTICATE, KDF, REGISTER, UPLOAD, DOWNLOAD, DELETE, LIST, SEARCH, GET,
+        VISIBILITY, PUBLIC_PAGE,
+        // persistence
+        USER_COMMIT, USER_SAVE, FILE_ADD, FILE_DELETE, FILE_SET_PUBLIC, FILE_SAVE, FILE_LOAD,
+        REGION_LOG_BATCH, CHUNK_COMMIT, REPLICA_BATCH, AUDIT_WRITE, REVOCATION_WRITE,
+        COUNT
+    };
+    constexpr size_t OPS = (size_t)Op::COUNT;
+
+    enum class Counter : uint8_t { UPLOADED_BYTES, DOWNLOADED_BYTES, AUDIT_WRITE_ERRORS, COUNT };
+    constexpr size_t COUNTERS = (size_t)Counter::COUNT;
+
+    const char* opName(Op op) {
+        static const char* const names[OPS] = {
+            "login", "verify_logins", "mfa", "authenticate", "kdf", "register", "upload", "download", "delete", "list",
+            "search", "get", "visibility", "public_page",
+            "user_commit", "user_save", "file_add", "file_delete", "file_set_public", "file_save", "file_load",
+            "region_log_batch", "chunk_commit", "replica_batch", "audit_write", "revocation_write",
+        };
+        return names[(size_t)op];
+    }
+
+    bool isPersistence(Op op) { return op >= Op::USER_COMMIT; }
+
+    constexpr int    SUB_BITS = 4;
+    constexpr size_t SUB      = size_t(1) << SUB_BITS;
+    constexpr int    MAX_BITS = 40;
+    constexpr size_t BUCKETS  = size_t(MAX_BITS - SUB_BITS + 1) * SUB;
+
+    inline size_t bucketOf(uint64_t ns) {
+        if (ns >> MAX_BITS) ns = (uint64_t(1) << MAX_BITS) - 1;
+        if (ns < SUB) return size_t(ns);
+        int msb = 63 - __builtin_clzll(ns);
+        return size_t(msb - SUB_BITS + 1) * SUB + size_t(ns >> (msb - SUB_BITS)) - SUB;
+    }
+
+    // Largest value that lands in bucket b
+    inline uint64_t bucketHigh(size_t b) {
+        if (b < SUB) return b;
+        int shift = int(b / SUB) - 1;
+        return ((uint64_t(b % SUB + SUB) + 1) << shift) - 1;
+    }
+
+    struct Histogram {
+        array<atomic<uint64_t>, BUCKETS> buckets;
+        atomic<uint64_t> count;
+        atomic<uint64_t> sumNs;
+        atomic<uint64_t> maxNs;
+    };
+
+    struct alignas(64) Slot {
+        atomic<bool> inUse{false};
+        Slot* next{nullptr};                      // fixed once the slot is listed
+        array<atomic<Histogram*>, OPS> hist{};
+        array<atomic<uint64_t>, COUNTERS> counters{};
+    };
+
+    inline atomic<Slot*> slotList{nullptr};
+    inline thread_local Slot* threadSlot = nullptr;
+
+    // Hands the thread's slot back when it exits.
+    struct SlotRelease {
+        ~SlotRelease() {
+            if (threadSlot) threadSlot->inUse.store(false, memory_order_release);
+        }
+    };
+    inline thread_local SlotRelease slotRelease;
+
+    // Only the owning thread writes, so no read-modify-write is needed.
+    inline void bump(atomic<uint64_t>& a, uint64_t n) {
+        a.store(a.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+    Slot& claimSlot() {
+        Slot* s = slotList.load(memory_order_acquire);
+        for (; s; s = s->next) {
+            bool idle = false;
+            if (!s->inUse.load(memory_order_relaxed) &&
+                s->inUse.compare_exchange_strong(idle, true, memory_order_acquire))
+                break;
+        }
+        if (!s) {
+            s = new Slot();
+            s->inUse.store(true, memory_order_relaxed);
+            s->next = slotList.load(memory_order_relaxed);
+            while (!slotList.compare_exchange_weak(s->next, s, memory_order_release, memory_order_relaxed)) {}
+        }
+        (void)&slotRelease;   // registers the release at thread exit
+        threadSlot = s;
+        return *s;
+    }
+
+    inline Slot& localSlot() { return threadSlot ? *threadSlot : claimSlot(); }
+
+    inline void record(Op op, uint64_t ns) {
+        atomic<Histogram*>& ref = localSlot().hist[(size_t)op];
+        Histogram* h = ref.load(memory_order_relaxed);
+        if (!h) {
+            h = new Histogram();
+            ref.store(h, memory_order_release);
+        }
+        bump(h->buckets[bucketOf(ns)], 1);
+        bump(h->sumNs, ns);
+        if (ns > h->maxNs.load(memory_order_relaxed)) h->maxNs.store(ns, memory_order_relaxed);
+        bump(h->count, 1);
+    }
+
+    inline void add(Counter c, uint64_t n) { bump(localSlot().counters[(size_t)c], n); }
+
+    // Records the time from construction to destruction.
+    class Timer {
+        Op op;
+        chrono::steady_clock::time_point start;
+    public:
+        explicit Timer(Op o) : op(o), start(chrono::steady_clock::now()) {}
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+        ~Timer() {
+            auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+            record(op, uint64_t(max<int64_t>(ns, 0)));
+        }
+    };
+
+    struct OpStats {
+        uint64_t count{0};
+        uint64_t sumNs{0};
+        uint64_t maxNs{0};
+        vector<uint64_t> buckets;   // empty until something was recorded
+
+        double meanNs() const { return count ? double(sumNs) / double(count) : 0.0; }
+
+        // Upper bound of the bucket holding the q-th sample, capped at the max
+        uint64_t quantileNs(double q) const {
+            if (!count) return 0;
+            uint64_t rank = max<uint64_t>(1, uint64_t(ceil(q * double(count)))), seen = 0;
+            for (size_t b = 0; b < buckets.size(); ++b)
+                if ((seen += buckets[b]) >= rank) return min(bucketHigh(b), maxNs);
+            return maxNs;
+        }
+
+        // Samples of at most ns, to bucket precision
+        uint64_t countAtMost(uint64_t ns) const {
+            uint64_t n = 0;
+            for (size_t b = 0; b < buckets.size() && bucketHigh(b) <= ns; ++b) n += buckets[b];
+            return n;
+        }
+    };
+
+    struct Snapshot {
+        array<OpStats, OPS> ops;
+        array<uint64_t, COUNTERS> counters{};
+    };
+
+    Snapshot snapshot() {
+        Snapshot snap;
+        for (Slot* s = slotList.load(memory_order_acquire); s; s = s->next) {
+            for (size_t i = 0; i < COUNTERS; ++i) snap.counters[i] += s->counters[i].load(memory_order_relaxed);
+            for (size_t op = 0; op < OPS; ++op) {
+                const Histogram* h = s->hist[op].load(memory_order_acquire);
+                if (!h) continue;
+                OpStats& o = snap.ops[op];
+                if (o.buckets.empty()) o.buckets.assign(BUCKETS, 0);
+                for (size_t b = 0; b < BUCKETS; ++b) o.buckets[b] += h->buckets[b].load(memory_order_relaxed);
+                o.count += h->count.load(memory_order_relaxed);
+                o.sumNs += h->sumNs.load(memory_order_relaxed);
+                o.maxNs = max(o.maxNs, h->maxNs.load(memory_order_relaxed));
+            }
+        }
+        return snap;
+    }
+
+    // Prometheus text exposition format (version 0.0.4). Histogram buckets
+    // count samples whose HDR bucket lies wholly below the bound.
+    void appendPrometheus(string& out, const Snapshot& snap) {
+        static const double BOUNDS[] = {1e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3,
+                                        5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+        char num[64];
+        auto seconds = [&](uint64_t ns) {
+            snprintf(num, sizeof(num), "%.9g", double(ns) / 1e9);
+            return num;
+        };
+        out += "# HELP cloud_operation_duration_seconds Time spent in engine operations and persistence calls.\n"
+               "# TYPE cloud_operation_duration_seconds histogram\n";
+        for (size_t op = 0; op < OPS; ++op) {
+            const OpStats& o = snap.ops[op];
+            string labels = string("op=\"") + opName(Op(op)) + "\",layer=\"" +
+                            (isPersistence(Op(op)) ? "storage" : "engine") + "\"";
+            for (double bound : BOUNDS) {
+                snprintf(num, sizeof(num), "%g", bound);
+                out += "cloud_operation_duration_seconds_bucket{" + labels + ",le=\"" + num + "\"} " +
+                       to_string(o.countAtMost(uint64_t(bound * 1e9))) + "\n";
+            }
+            out += "cloud_operation_duration_seconds_bucket{" + labels + ",le=\"+Inf\"} " + to_string(o.count) + "\n";
+            out += "cloud_operation_duration_seconds_sum{" + labels + "} " + seconds(o.sumNs) + "\n";
+            out += "cloud_operation_duration_seconds_count{" + labels + "} " + to_string(o.count) + "\n";
+        }
+        out += "# HELP cloud_operation_duration_max_seconds Longest single call so far.\n"
+               "# TYPE cloud_operation_duration_max_seconds gauge\n";
+        for (size_t op = 0; op < OPS; ++op)
+            out += string("cloud_operation_duration_max_seconds{op=\"") + opName(Op(op)) + "\"} " +
+                   seconds(snap.ops[op].maxNs) + "\n";
+        out += "# HELP cloud_uploaded_bytes_total File content bytes stored.\n"
+               "# TYPE cloud_uploaded_bytes_total counter\n"
+               "cloud_uploaded_bytes_total " + to_string(snap.counters[(size_t)Counter::UPLOADED_BYTES]) + "\n";
+        out += "# HELP cloud_downloaded_bytes_total File content bytes read back.\n"
+               "# TYPE cloud_downloaded_bytes_total counter\n"
+               "cloud_downloaded_bytes_total " + to_string(snap.counters[(size_t)Counter::DOWNLOADED_BYTES]) + "\n";
+        out += "# HELP cloud_audit_write_errors_total Audit batches whose write or sync failed and was retried.\n"
+               "# TYPE cloud_audit_write_errors_total counter\n"
+               "cloud_audit_write_errors_total " +
+               to_string(snap.counters[(size_t)Counter::AUDIT_WRITE_ERRORS]) + "\n";
+    }
+
+    // ---------- Export ----------
+    // A Unix socket that answers every connection with one HTTP response,
+    // e.g. curl --unix-socket cloud_metrics.sock http://localhost/metrics
+
+    // Listening socket at path, or -1. A path left by a process that is
+    // gone is reused; one another process still serves is left alone.
+    int listenUnix(const string& path) {
+        sockaddr_un addr{};
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) return -1;
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe < 0) return -1;
+        setFdFlags(probe);
+        bool taken = ::connect(probe, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+        ::close(probe);
+        struct stat st;
+        if (taken || (::lstat(path.c_str(), &st) == 0 && !S_ISSOCK(st.st_mode))) return -1;
+        ::unlink(path.c_str());
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (!setFdFlags(fd, true) || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 16) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // Answers one pending connection, if any, with body.
+    void serveOne(int listenFd, const string& body) {
+        int fd = ::accept(listenFd, nullptr, nullptr);
+        if (fd < 0) return;
+        setFdFlags(fd);
+        // no SIGPIPE if the client left: SO_NOSIGPIPE on BSDs, MSG_NOSIGNAL below elsewhere
+#if defined(SO_NOSIGPIPE)
+        int one = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+        timeval tv{0, 200000};   // a client that never sends is not waited on for long
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        char req[1024];
+        (void)::recv(fd, req, sizeof(req), 0);   // the request line; every path gets the metrics
+        string resp = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                      to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        for (size_t off = 0; off < resp.size();) {
+#if defined(MSG_NOSIGNAL)
+            ssize_t n = ::send(fd, resp.data() + off, resp.size() - off, MSG_NOSIGNAL);
+#else
+            ssize_t n = ::send(fd, resp.data() + off, resp.size() - off, 0);
+#endif
+            if (n <= 0) break;
+            off += size_t(n);
+        }
+        ::close(fd);
+    }
+}
+
+// ================== KDF Pool ==================
+// Password hashes are computed here instead of on the calling thread:
+// KDF_THREADS workers, each keeping its own Argon2 memory, so at most
+// KDF_THREADS hashes run at once and KDF memory stays within KDF_THREADS x
+// ARGON2_MEMORY_KIB. Requests wait in a queue of at most KDF_QUEUE; one
+// that does not fit fails at once (BUSY), one whose deadline passes before
+// a worker takes it is dropped (TIMED_OUT). A caller blocks only on its
+// own requests, and holds no locks while it waits.
+class KdfPool {
+public:
+    using Clock = chrono::steady_clock;
+
+    enum class Outcome { DONE, BUSY, TIMED_OUT, FAILED };   // FAILED: bad parameters or out of memory
+
+    struct Request {
+        PasswordHash::Params params;
+        string  salt;
+        string  password;
+        uint8_t digest[SHA256::DIGEST_SIZE];
+        Outcome outcome{Outcome::BUSY};
+    };
+
+    explicit KdfPool(unsigned threads = Config::KDF_THREADS, size_t capacity = Config::KDF_QUEUE)
+        : capacity(capacity) {
+        for (unsigned i = 0; i < max(1u, threads); ++i) workers.emplace_back([this] { work(); });
+    }
+
+    ~KdfPool() {
+        {
+            lock_guard<mutex> lk(mtx);
+            stopping = true;
+        }
+        workCv.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    KdfPool(const KdfPool&) = delete;
+    KdfPool& operator=(const KdfPool&) = delete;
+
+    // Computes every request's digest and outcome. Returns when all are
+    // done or at the deadline, whichever comes first; requests still
+    // running then are reported TIMED_OUT and finish unobserved.
+    void run(vector<Request>& reqs, Clock::time_point deadline) {
+        if (reqs.empty()) return;
+        auto batch = make_shared<Batch>();
+        batch->reqs = std::move(reqs);
+        batch->deadline = deadline;
+        batch->finished.assign(batch->reqs.size(), false);
+        {
+            lock_guard<mutex> lk(mtx);
+            size_t room = capacity > queue.size() ? capacity - queue.size() : 0;
+            size_t n = min(room, batch->reqs.size());
+            batch->pending = n;
+            for (size_t i = 0; i < n; ++i) queue.push_back(Task{batch, i});
+            for (size_t i = n; i < batch->reqs.size(); ++i) batch->finished[i] = true;   // BUSY
+        }
+        workCv.notify_all();
+
+        unique_lock<mutex> lk(batch->mtx);
+        batch->doneCv.wait_until(lk, deadline, [&] { return batch->pending == 0; });
+        batch->abandoned = true;
+        reqs.resize(batch->reqs.size());
+        for (size_t i = 0; i < reqs.size(); ++i) {
+            Request& r = reqs[i];
+            r.params = batch->reqs[i].params;
+            if (!batch->finished[i]) {
+                r.outcome = Outcome::TIMED_OUT;
+            } else {
+                r.outcome = batch->reqs[i].outcome;
+                memcpy(r.digest, batch->reqs[i].digest, sizeof(r.digest));
+            }
+        }
+    }
+
+    // One request, for callers that hash a single password.
+    Outcome run(const PasswordHash::Params& params, const string& salt, const string& password,
+                uint8_t digest[SHA256::DIGEST_SIZE]) {
+        vector<Request> reqs(1);
+        reqs[0].params = params;
+        reqs[0].salt = salt;
+        reqs[0].password = password;
+        run(reqs, Clock::now() + chrono::milliseconds(Config::KDF_DEADLINE_MS));
+        memcpy(digest, reqs[0].digest, SHA256::DIGEST_SIZE);
+        return reqs[0].outcome;
+    }
+
+    size_t queued() const {
+        lock_guard<mutex> lk(mtx);
+        return queue.size();
+    }
+
+private:
+    struct Batch {
+        mutex mtx;                    // everything below
+        condition_variable doneCv;
+        vector<Request> reqs;
+        vector<bool> finished;
+        size_t pending{0};
+        bool abandoned{false};        // the caller has stopped waiting
+        Clock::time_point deadline;
+
+        ~Batch() {
+            for (auto& r : reqs) fill(r.password.begin(), r.password.end(), '\0');
+        }
+    };
+
+    struct Task {
+        shared_ptr<Batch> batch;
+        size_t index;
+    };
+
+    const size_t capacity;
+    mutable mutex mtx;                // queue, stopping
+    condition_variable workCv;
+    deque<Task> queue;
+    bool stopping{false};
+    vector<thread> workers;
+
+    void work() {
+        vector<argon2::Block> scratch;   // this worker's Argon2 memory
+        while (true) {
+            Task task;
+            {
+                unique_lock<mutex> lk(mtx);
+                workCv.wait(lk, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            Batch& b = *task.batch;
+            Request* r;
+            bool skip;
+            {
+                lock_guard<mutex> lk(b.mtx);
+                r = &b.reqs[task.index];
+                skip = b.abandoned || Clock::now() >= b.deadline;
+            }
+            Outcome outcome = Outcome::TIMED_OUT;
+            uint8_t digest[SHA256::DIGEST_SIZE] = {0};
+            if (!skip) {
+                // r's inputs are only written before the task is queued
+                Metrics::Timer timer(Metrics::Op::KDF);
+                bool ok;
+                try {
+                    ok = PasswordHash::derive(r->params, r->salt, r->password, digest, scratch);
+                } catch (const bad_alloc&) {
+                    ok = false;
+                    vector<argon2::Block>().swap(scratch);
+                }
+                outcome = ok ? Outcome::DONE : Outcome::FAILED;
+            }
+            lock_guard<mutex> lk(b.mtx);
+            fill(r->password.begin(), r->password.end(), '\0');
+            r->outcome = outcome;
+            memcpy(r->digest, digest, sizeof(digest));
+            b.finished[task.index] = true;
+            if (--b.pending == 0) b.doneCv.notify_all();
+        }
+    }
+};
+
+// ================== Audit Log Format ==================
+// Audit events are stored as compact binary records in rolling segments
+// under AUDIT_DIR. Usernames are interned per segment, so a segment is
+// self-contained; the free-form detail (file name, admin target) is inline:
+//
+//   header  : u32 magic "CAUD", u16 version, u16 reserved, i64 created
+//   STRING  : u8 kind=1, u16 len, u32 id, bytes          (first use only)
+//   EVENT   : u8 kind=2, u8 type, u8 reason, u8 detailLen, u32 user, i64 ts, detail
+//
+// A sealed segment gets a sidecar .idx holding its dictionary, one sparse
+// time entry per EVENTS_PER_BLOCK events and, per user, the blocks that
+// user appears in (delta-varint encoded). Integers are little-endian.
+namespace AuditFormat {
+    const uint32_t SEGMENT_MAGIC    = 0x44554143;  // "CAUD"
+    const uint32_t INDEX_MAGIC      = 0x58444943;  // "CIDX"
+    const uint16_t VERSION          = 1;
+    const size_t   HEADER_SIZE      = 16;
+    const uint8_t  REC_STRING       = 1;
+    const uint8_t  REC_EVENT        = 2;
+    const size_t   EVENT_SIZE       = 16;  // fixed part, detail follows
+    const uint32_t NO_STRING        = 0xFFFFFFFF;
+    const size_t   EVENTS_PER_BLOCK = 256;
+
+    inline void putU16(string& out, uint16_t v) { for (int i = 0; i < 2; ++i) out += char(v >> (8 * i)); }
+    inline void putU32(string& out, uint32_t v) { for (int i = 0; i < 4; ++i) out += char(v >> (8 * i)); }
+    inline void putU64(string& out, uint64_t v) { for (int i = 0; i < 8; ++i) out += char(v >> (8 * i)); }
+
+    inline uint16_t getU16(const uint8_t* p) { return uint16_t(p[0] | (p[1] << 8)); }
+    inline uint32_t getU32(const uint8_t* p) {
+        return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+    }
+    inline uint64_t getU64(const uint8_t* p) { return uint64_t(getU32(p)) | (uint64_t(getU32(p + 4)) << 32); }
+
+    inline void putVarint(string& out, uint32_t v) {
+        while (v >= 0x80) {
+            out += char((v & 0x7f) | 0x80);
+            v >>= 7;
+        }
+        out += char(v);
+    }
+
+    inline bool getVarint(const uint8_t* p, size_t end, size_t& off, uint32_t& v) {
+        v = 0;
+        for (int shift = 0; shift < 35 && off < end; shift += 7) {
+            uint8_t b = p[off++];
+            v |= uint32_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+
+    string segmentPath(uint64_t seq) {
+        char name[32];
+        snprintf(name, sizeof(name), "seg-%010llu.log", (unsigned long long)seq);
+        return Config::AUDIT_DIR + name;
+    }
+
+    string indexPath(const string& segment) {
+        return segment.substr(0, segment.size() - 4) + ".idx";
+    }
+
+    // Sequence numbers of all segments on disk, ascending.
+    vector<uint64_t> listSegments() {
+        vector<uint64_t> seqs;
+        error_code ec;
+        for (const auto& entry : fs::directory_iterator(Config::AUDIT_DIR, ec)) {
+            string name = entry.path().filename().string();
+            if (name.size() == 18 && name.compare(0, 4, "seg-") == 0 && name.compare(14, 4, ".log") == 0)
+                seqs.push_back(strtoull(name.c_str() + 4, nullptr, 10));
+        }
+        sort(seqs.begin(), seqs.end());
+        return seqs;
+    }
+
+    const char* typeTag(AuditEventType type) {
+        switch (type) {
+            case AuditEventType::SYSTEM:        return "SYSTEM";
+            case AuditEventType::REGISTER:      return "REGISTER";
+            case AuditEventType::LOGIN_SUCCESS: return "LOGIN_SUCCESS";
+            case AuditEventType::LOGIN_FAIL:    return "LOGIN_FAIL";
+            case AuditEventType::LOCKOUT:       return "LOCKOUT";
+            case AuditEventType::LOGOUT:        return "LOGOUT";
+            case AuditEventType::UPLOAD:        return "UPLOAD";
+            case AuditEventType::DELETE:        return "DELETE";
+            case AuditEventType::UPGRADE:       return "UPGRADE";
+            case AuditEventType::ADMIN_ACTION:  return "ADMIN";
+        }
+        return "UNKNOWN";
+    }
+
+    const char* reasonTag(AuditReason reason) {
+        switch (reason) {
+            case AuditReason::NONE:              return "";
+            case AuditReason::NOT_FOUND:         return "not_found";
+            case AuditReason::INACTIVE:          return "inactive";
+            case AuditReason::LOCKED:            return "locked";
+            case AuditReason::BAD_PASSWORD:      return "bad_password";
+            case AuditReason::MFA_FAILED:        return "mfa_failed";
+            case AuditReason::TOO_MANY_FAILURES: return "too_many_failures";
+            case AuditReason::UNLOCK_USER:       return "unlock_user";
+            case AuditReason::APP_START:         return "app_start";
+            case AuditReason::APP_CLOSE:         return "app_close";
+            case AuditReason::EVENTS_DROPPED:    return "events_dropped";
+            case AuditReason::QUOTA_DRIFT:       return "quota_drift";
+        }
+        return "unknown";
+    }
+
+    bool parseTypeTag(const string& tag, AuditEventType& out) {
+        for (int t = 0; t <= (int)AuditEventType::ADMIN_ACTION; ++t) {
+            if (tag == typeTag(static_cast<AuditEventType>(t))) {
+                out = static_cast<AuditEventType>(t);
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+// Query-side view of a segment's .idx (also rebuilt by scanning when a
+// segment was never sealed, e.g. after a crash).
+struct AuditSegmentIndex {
+    struct Block {
+        uint64_t offset{0};
+        int64_t  minTs{0};
+        int64_t  maxTs{0};
+    };
+
+    uint64_t events{0};
+    int64_t  minTs{numeric_limits<int64_t>::max()};
+    int64_t  maxTs{numeric_limits<int64_t>::min()};
+    uint64_t segmentBytes{0};
+    vector<string> dict;
+    vector<Block> blocks;
+    unordered_map<uint32_t, vector<uint32_t>> userBlocks;
+
+    // Walks the segment and builds the index; stops at a torn tail record.
+    bool buildFromSegment(const string& segPath) {
+        using namespace AuditFormat;
+        ifstream in(segPath, ios::binary);
+        if (!in.is_open()) return false;
+        string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+        if (data.size() < HEADER_SIZE || getU32(p) != SEGMENT_MAGIC) return false;
+
+        size_t off = HEADER_SIZE;
+        size_t blockStart = off;
+        while (off < data.size()) {
+            uint8_t kind = p[off];
+            if (kind == REC_STRING) {
+                if (off + 7 > data.size()) break;
+                uint16_t len = getU16(p + off + 1);
+                uint32_t id  = getU32(p + off + 3);
+                if (off + 7 + len > data.size()) break;
+                if (id >= dict.size()) dict.resize(id + 1);
+                dict[id].assign(data, off + 7, len);
+                off += 7 + len;
+            } else if (kind == REC_EVENT) {
+                if (off + EVENT_SIZE > data.size()) break;
+                size_t size = EVENT_SIZE + p[off + 3];
+                if (off + size > data.size()) break;
+                uint32_t user = getU32(p + off + 4);
+                int64_t  ts   = (int64_t)getU64(p + off + 8);
+                if (events % EVENTS_PER_BLOCK == 0) {
+                    blocks.push_back({blockStart, ts, ts});
+                }
+                Block& b = blocks.back();
+                b.minTs = min(b.minTs, ts);
+                b.maxTs = max(b.maxTs, ts);
+                minTs = min(minTs, ts);
+                maxTs = max(maxTs, ts);
+                if (user != NO_STRING) {
+                    auto& list = userBlocks[user];
+                    uint32_t blockNo = uint32_t(blocks.size() - 1);
+                    if (list.empty() || list.back() != blockNo) list.push_back(blockNo);
+                }
+                ++events;
+                off += size;
+                if (events % EVENTS_PER_BLOCK == 0) blockStart = off;
+            } else {
+                break;
+            }
+        }
+        segmentBytes = off;
+        return true;
+    }
+
+    bool save(const string& path) const {
+        using namespace AuditFormat;
+        string out;
+        putU32(out, INDEX_MAGIC);
+        putU16(out, VERSION);
+        putU16(out, 0);
+        putU64(out, events);
+        putU64(out, (uint64_t)minTs);
+        putU64(out, (uint64_t)maxTs);
+        putU64(out, segmentBytes);
+        putU32(out, (uint32_t)dict.size());
+        putU32(out, (uint32_t)blocks.size());
+        putU32(out, (uint32_t)userBlocks.size());
+        for (const auto& s : dict) {
+            putU16(out, (uint16_t)s.size());
+            out += s;
+        }
+        for (const auto& b : blocks) {
+            putU64(out, b.offset);
+            putU64(out, (uint64_t)b.minTs);
+            putU64(out, (uint64_t)b.maxTs);
+        }
+        for (const auto& [user, list] : userBlocks) {
+            putU32(out, user);
+            putU32(out, (uint32_t)list.size());
+            uint32_t prev = 0;
+            for (uint32_t blockNo : list) {
+                putVarint(out, blockNo - prev);
+                prev = blockNo;
+            }
+        }
+
+        string tmp = path + ".tmp";
+        {
+            ofstream f(tmp, ios::binary | ios::trunc);
+            if (!f.is_open()) return false;
+            f.write(out.data(), (streamsize)out.size());
+            if (!f) return false;
+        }
+        error_code ec;
+        fs::rename(tmp, path, ec);
+        return !ec;
+    }
+
+    // Header only: enough to decide whether the segment overlaps a query.
+    static const size_t FIXED_SIZE = 52;
+
+    bool load(const string& path, bool headerOnly) {
+        using namespace AuditFormat;
+        ifstream in(path, ios::binary);
+        if (!in.is_open()) return false;
+        string data;
+        if (headerOnly) {
+            data.resize(FIXED_SIZE);
+            in.read(&data[0], FIXED_SIZE);
+            if ((size_t)in.gcount() != FIXED_SIZE) return false;
+        } else {
+            data.assign((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+            if (data.size() < FIXED_SIZE) return false;
+        }
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+        if (getU32(p) != INDEX_MAGIC || getU16(p + 4) != VERSION) return false;
+        events       = getU64(p + 8);
+        minTs        = (int64_t)getU64(p + 16);
+        maxTs        = (int64_t)getU64(p + 24);
+        segmentBytes = getU64(p + 32);
+        if (headerOnly) return true;
+
+        uint32_t nDict = getU32(p + 40), nBlocks = getU32(p + 44), nUsers = getU32(p + 48);
+        size_t off = FIXED_SIZE;
+        auto need = [&](size_t n) { return off + n <= data.size(); };
+
+        dict.resize(nDict);
+        for (uint32_t i = 0; i < nDict; ++i) {
+            if (!need(2)) return false;
+            uint16_t len = getU16(p + off);
+            off += 2;
+            if (!need(len)) return false;
+            dict[i].assign(data, off, len);
+            off += len;
+        }
+        blocks.resize(nBlocks);
+        for (uint32_t i = 0; i < nBlocks; ++i) {
+            if (!need(24)) return false;
+            blocks[i] = { getU64(p + off), (int64_t)getU64(p + off + 8), (int64_t)getU64(p + off + 16) };
+            off += 24;
+        }
+        for (uint32_t i = 0; i < nUsers; ++i) {
+            if (!need(8)) return false;
+            uint32_t user = getU32(p + off), count = getU32(p + off + 4);
+            off += 8;
+            auto& list = userBlocks[user];
+            list.resize(count);
+            uint32_t prev = 0;
+            for (uint32_t k = 0; k < count; ++k) {
+                uint32_t delta;
+                if (!getVarint(p, data.size(), off, delta)) return false;
+                prev += delta;
+                list[k] = prev;
+            }
+        }
+        return true;
+    }
+};
+
+// ================== Logger ==================
+// Audit events go into a bounded lock-free multi-producer ring. A single
+// writer thread drains it in batches: one write() per batch and, depending
+// on the durability policy, one fsync per batch. Producers never touch the
+// file; they only stamp the event with time() and copy the fields.
+enum class LogDurability {
+    NONE,       // write() per batch, no fsync
+    PER_BATCH,  // fsync after each batch, log() does not wait
+    PER_EVENT   // log() returns only once its event has been fsynced
+};
+
+enum class LogBackpressure {
+    BLOCK,      // producer waits for the writer when the ring is full
+    DROP        // event is discarded and counted; memory stays bounded
+};
+
+class Logger {
+public:
+    static void log(AuditEventType type, const string& user,
+                    AuditReason reason = AuditReason::NONE, const string& detail = "") {
+        instance().enqueue(type, user, reason, detail);
+    }
+
+    static void configure(LogDurability durability, LogBackpressure backpressure) {
+        Logger& l = instance();
+        l.durability.store(durability);
+        l.backpressure.store(backpressure);
+    }
+
+    // Blocks until every event logged so far has been written (and synced
+    // unless the policy is NONE).
+    static void flush() {
+        Logger& l = instance();
+        size_t pos = l.enqueuePos.load(memory_order_acquire);
+        if (pos > 0) l.waitDurable(pos - 1);
+    }
+
+    static void shutdown() { instance().stop(); }
+
+    static uint64_t dropped() { return instance().droppedEvents.load(memory_order_relaxed); }
+
+    ~Logger() {
+        stop();
+        lock_guard<mutex> lk(directMtx);
+        closeSegment();   // the late-event segment, if any
+    }
+
+private:
+    static constexpr size_t USER_CAPACITY   = 64;
+    static constexpr size_t DETAIL_CAPACITY = 160;   // must fit the u8 length field
+
+    struct Slot {
+        atomic<size_t> seq{0};
+        AuditEventType type{AuditEventType::SYSTEM};
+        AuditReason    reason{AuditReason::NONE};
+        uint8_t  userLen{0};
+        uint8_t  detailLen{0};
+        time_t   when{0};
+        char     user[USER_CAPACITY];
+        char     detail[DETAIL_CAPACITY];
+    };
+
+    const size_t capacity = Config::LOG_RING_CAPACITY;
+    const size_t mask     = Config::LOG_RING_CAPACITY - 1;
+    unique_ptr<Slot[]> slots;
+
+    alignas(64) atomic<size_t> enqueuePos{0};
+    alignas(64) atomic<size_t> durablePos{0};     // events [0, durablePos) are on disk
+    size_t dequeuePos{0};                         // writer thread only
+
+    atomic<LogDurability>   durability{LogDurability::PER_BATCH};
+    atomic<LogBackpressure> backpressure{LogBackpressure::BLOCK};
+    atomic<uint64_t> droppedEvents{0};
+    uint64_t reportedDrops{0};
+
+    // Active segment, owned by the writer thread
+    int      fd{-1};
+    uint64_t segmentSeq{0};
+    uint64_t segmentBytes{0};     // up to the last complete record
+    unsigned failedWrites{0};     // in a row
+    unordered_map<string, uint32_t> interned;
+
+    thread writer;
+    atomic<bool> stopping{false};
+    atomic<bool> stopped{false};
+    atomic<int>  producers{0};   // enqueue() calls past the stopped check, not yet published
+
+    mutex directMtx;             // the segment, once the writer thread is gone
+
+    mutex wakeMtx;
+    condition_variable wakeCv;
+    bool urgent{false};
+
+    mutex durableMtx;
+    condition_variable durableCv;
+
+    Logger() : slots(new Slot[Config::LOG_RING_CAPACITY]) {
+        static_assert((Config::LOG_RING_CAPACITY & (Config::LOG_RING_CAPACITY - 1)) == 0,
+                      "LOG_RING_CAPACITY must be a power of two");
+        for (size_t i = 0; i < capacity; ++i) slots[i].seq.store(i, memory_order_relaxed);
+        writer = thread([this] { writerLoop(); });
+    }
+
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    void wakeWriter() {
+        {
+            lock_guard<mutex> lk(wakeMtx);
+            urgent = true;
+        }
+        wakeCv.notify_one();
+    }
+
+    // Claims a slot (Vyukov bounded queue); returns false when the ring is full.
+    bool tryClaim(size_t& pos) {
+        pos = enqueuePos.load(memory_order_relaxed);
+        while (true) {
+            Slot& s = slots[pos & mask];
+            size_t seq = s.seq.load(memory_order_acquire);
+            intptr_t dif = intptr_t(seq) - intptr_t(pos);
+            if (dif == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) return true;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = enqueuePos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    void enqueue(AuditEventType type, const string& user, AuditReason reason, const string& detail) {
+        producers.fetch_add(1);
+        if (stopped.load()) {
+            producers.fetch_sub(1);
+            writeDirect(type, user, reason, detail);
+            return;
+        }
+
+        size_t pos;
+        while (!tryClaim(pos)) {
+            if (backpressure.load(memory_order_relaxed) == LogBackpressure::DROP) {
+                droppedEvents.fetch_add(1, memory_order_relaxed);
+                producers.fetch_sub(1);
+                return;
+            }
+            wakeWriter();
+            this_thread::sleep_for(chrono::microseconds(100));
+        }
+
+        Slot& s = slots[pos & mask];
+        s.type      = type;
+        s.reason    = reason;
+        s.when      = time(nullptr);
+        s.userLen   = (uint8_t)min(user.size(), USER_CAPACITY);
+        s.detailLen = (uint8_t)min(detail.size(), DETAIL_CAPACITY);
+        memcpy(s.user, user.data(), s.userLen);
+        memcpy(s.detail, detail.data(), s.detailLen);
+        s.seq.store(pos + 1, memory_order_release);
+        producers.fetch_sub(1);
+
+        if (durability.load(memory_order_relaxed) == LogDurability::PER_EVENT) {
+            waitDurable(pos);
+        } else if (pos - durablePos.load(memory_order_relaxed) >= capacity / 2) {
+            wakeWriter();
+        }
+    }
+
+    void waitDurable(size_t pos) {
+        wakeWriter();
+        unique_lock<mutex> lk(durableMtx);
+        durableCv.wait(lk, [&] { return durablePos.load(memory_order_acquire) > pos; });
+    }
+
+    // Writer side: returns the segment-local id, emitting a STRING record
+    // the first time the value appears in this segment.
+    uint32_t intern(string& out, const char* text, size_t len) {
+        using namespace AuditFormat;
+        if (len == 0) return NO_STRING;
+        string key(text, len);
+        auto it = interned.find(key);
+        if (it != interned.end()) return it->second;
+
+        uint32_t id = (uint32_t)interned.size();
+        interned.emplace(move(key), id);
+        out += char(REC_STRING);
+        putU16(out, (uint16_t)len);
+        putU32(out, id);
+        out.append(text, len);
+        return id;
+    }
+
+    void appendEvent(string& out, AuditEventType type, AuditReason reason, time_t when,
+                     const char* user, size_t userLen, const char* detail, size_t detailLen) {
+        using namespace AuditFormat;
+        uint32_t userId = intern(out, user, userLen);
+        detailLen = min(detailLen, DETAIL_CAPACITY);
+        out += char(REC_EVENT);
+        out += char(type);
+        out += char(reason);
+        out += char(detailLen);
+        putU32(out, userId);
+        putU64(out, (uint64_t)(int64_t)when);
+        out.append(detail, detailLen);
+    }
+
+    bool writeAll(const string& buf) {
+        if (fd < 0) return false;
+        size_t off = 0;
+        while (off < buf.size()) {
+            ssize_t n = ::write(fd, buf.data() + off, buf.size() - off);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            off += size_t(n);
+        }
+        segmentBytes += buf.size();
+        return true;
+    }
+
+    void openSegment(uint64_t seq) {
+        using namespace AuditFormat;
+        segmentSeq = seq;
+        segmentBytes = 0;
+        interned.clear();
+        fd = ::open(segmentPath(seq).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        string header;
+        putU32(header, SEGMENT_MAGIC);
+        putU16(header, VERSION);
+        putU16(header, 0);
+        putU64(header, (uint64_t)(int64_t)time(nullptr));
+        if (fd >= 0 && !writeAll(header)) {
+            ::close(fd);
+            fd = -1;
+            ::unlink(segmentPath(seq).c_str());
+        }
+    }
+
+    static void sealSegment(const string& path) {
+        AuditSegmentIndex index;
+        if (index.buildFromSegment(path)) index.save(AuditFormat::indexPath(path));
+    }
+
+    void closeSegment() {
+        if (fd < 0) return;
+        syncFd(fd);
+        ::close(fd);
+        fd = -1;
+        string path = AuditFormat::segmentPath(segmentSeq);
+        if (segmentBytes <= AuditFormat::HEADER_SIZE) {
+            error_code ec;
+            fs::remove(path, ec);
+            return;
+        }
+        sealSegment(path);
+    }
+
+    // Seals segments left without an index by a crash, then starts a fresh one.
+    void openLog() {
+        error_code ec;
+        fs::create_directories(Config::AUDIT_DIR, ec);
+        vector<uint64_t> seqs = AuditFormat::listSegments();
+        for (uint64_t seq : seqs) {
+            string path = AuditFormat::segmentPath(seq);
+            if (!fs::exists(AuditFormat::indexPath(path))) sealSegment(path);
+        }
+        openSegment(seqs.empty() ? 1 : seqs.back() + 1);
+    }
+
+    // After a failed write or sync: cuts the segment back to its last
+    // complete record, seals it and continues in a fresh one. A segment
+    // that could not be opened is tried again under the same number.
+    void rollAfterFailure() {
+        Metrics::add(Metrics::Counter::AUDIT_WRITE_ERRORS, 1);
+        uint64_t next = segmentSeq;
+        if (fd >= 0) {
+            (void)!::ftruncate(fd, (off_t)segmentBytes);
+            closeSegment();
+            ++next;
+        }
+        openSegment(next);
+    }
+
+    // Releases the slots in [dequeuePos, end).
+    void release(size_t end) {
+        for (; dequeuePos != end; ++dequeuePos)
+            slots[dequeuePos & mask].seq.store(dequeuePos + capacity, memory_order_release);
+    }
+
+    // Drains whatever is published; returns false when the ring was empty
+    // or the write failed. Slots are released only once their events are
+    // written (and synced), so a failed batch is written again next time.
+    bool drainBatch(string& buf) {
+        buf.clear();
+        size_t start = dequeuePos, end = dequeuePos;
+        while (end - start < capacity) {
+            Slot& s = slots[end & mask];
+            if (s.seq.load(memory_order_acquire) != end + 1) break;
+            appendEvent(buf, s.type, s.reason, s.when, s.user, s.userLen, s.detail, s.detailLen);
+            ++end;
+        }
+
+        uint64_t drops = droppedEvents.load(memory_order_relaxed);
+        if (drops != reportedDrops) {
+            string count = to_string(drops - reportedDrops);
+            appendEvent(buf, AuditEventType::SYSTEM, AuditReason::EVENTS_DROPPED, time(nullptr),
+                        nullptr, 0, count.data(), count.size());
+        }
+
+        if (buf.empty()) return false;
+        bool ok;
+        {
+            Metrics::Timer timer(Metrics::Op::AUDIT_WRITE);
+            ok = writeAll(buf) &&
+                 (durability.load(memory_order_relaxed) == LogDurability::NONE || syncFd(fd) == 0);
+        }
+        if (!ok) {
+            rollAfterFailure();
+            // At shutdown nothing can wait for the disk to recover
+            if (!stopping.load() || ++failedWrites < Config::AUDIT_SHUTDOWN_RETRIES) return false;
+            droppedEvents.fetch_add(end - start, memory_order_relaxed);
+            drops = reportedDrops;
+        }
+        failedWrites = 0;
+        reportedDrops = drops;
+        release(end);
+
+        if (dequeuePos != start) {
+            {
+                lock_guard<mutex> lk(durableMtx);
+                durablePos.store(dequeuePos, memory_order_release);
+            }
+            durableCv.notify_all();
+        }
+
+        if (segmentBytes >= Config::AUDIT_SEGMENT_BYTES) {
+            closeSegment();
+            openSegment(segmentSeq + 1);
+        }
+        return true;
+    }
+
+    void writerLoop() {
+        openLog();
+        string buf;
+        buf.reserve(64 * 1024);
+        while (true) {
+            {
+                unique_lock<mutex> lk(wakeMtx);
+                wakeCv.wait_for(lk, chrono::milliseconds(Config::LOG_FLUSH_INTERVAL_MS),
+                                [&] { return urgent || stopping.load(); });
+                urgent = false;
+            }
+            while (drainBatch(buf)) {}
+            if (stopping.load()) {
+                // Producers that claimed a slot before stop() may still be copying
+                if (dequeuePos == enqueuePos.load(memory_order_acquire)) break;
+                this_thread::yield();
+            }
+        }
+    }
+
+    // New events wait for writeDirect() from here on. Producers that passed
+    // the stopped check just before it was set can publish after the
+    // writer's last drain; they are drained here, so every claimed slot is
+    // written before its waiter is released.
+    void stop() {
+        if (stopping.exchange(true)) return;
+        lock_guard<mutex> lk(directMtx);
+        stopped.store(true);
+        wakeCv.notify_one();
+        if (writer.joinable()) writer.join();
+        string buf;
+        while (drainBatch(buf) || producers.load() > 0 || dequeuePos != enqueuePos.load(memory_order_acquire))
+            this_thread::yield();
+        closeSegment();
+    }
+
+    // Late events (after shutdown) share one segment, opened by the first
+    // of them and synced per event; it is sealed at exit.
+    void writeDirect(AuditEventType type, const string& user, AuditReason reason, const string& detail) {
+        lock_guard<mutex> lk(directMtx);
+        if (fd < 0) {
+            vector<uint64_t> seqs = AuditFormat::listSegments();
+            openSegment(seqs.empty() ? 1 : seqs.back() + 1);
+        }
+        string buf;
+        appendEvent(buf, type, reason, time(nullptr), user.data(), user.size(), detail.data(), detail.size());
+        if (!writeAll(buf) || syncFd(fd) != 0) Metrics::add(Metrics::Counter::AUDIT_WRITE_ERRORS, 1);
+    }
+};
+
+// ================== Audit Query ==================
+struct AuditRecord {
+    time_t when{0};
+    AuditEventType type{AuditEventType::SYSTEM};
+    AuditReason reason{AuditReason::NONE};
+    string user;
+    string detail;
+
+    string toString() const {
+        char stamp[32];
+        tm local{};
+        localtime_r(&when, &local);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+        string line = string("[") + stamp + "][" + AuditFormat::typeTag(type) + "]";
+        if (!user.empty()) line += " User=" + user;
+        if (reason != AuditReason::NONE) line += string(" reason=") + AuditFormat::reasonTag(reason);
+        if (!detail.empty()) line += " " + detail;
+        return line;
+    }
+};
+
+struct AuditQuery {
+    time_t from{numeric_limits<time_t>::min()};
+    time_t to{numeric_limits<time_t>::max()};
+    string user;                // empty = any user
+    bool   filterType{false};
+    AuditEventType type{AuditEventType::SYSTEM};
+    size_t limit{0};            // 0 = unlimited
+};
+
+class AuditLogReader {
+public:
+    // Segments are skipped on their index header, blocks on the sparse time
+    // and user index; only matching blocks are read. Segments without an
+    // index (the one currently being written) are scanned.
+    static vector<AuditRecord> query(const AuditQuery& q) {
+        vector<AuditRecord> out;
+        for (uint64_t seq : AuditFormat::listSegments()) {
+            string path = AuditFormat::segmentPath(seq);
+            string idxPath = AuditFormat::indexPath(path);
+
+            AuditSegmentIndex header;
+            if (header.load(idxPath, true)) {
+                if (header.events == 0 || header.maxTs < (int64_t)q.from || header.minTs > (int64_t)q.to) continue;
+                AuditSegmentIndex index;
+                if (index.load(idxPath, false)) {
+                    if (!queryIndexed(path, index, q, out)) return out;
+                    continue;
+                }
+            }
+            if (!scanSegment(path, q, out)) return out;
+        }
+        return out;
+    }
+
+private:
+    // Appends matches from data[begin, end); false once the limit is reached.
+    static bool collect(const string& data, size_t begin, size_t end, vector<string>& dict,
+                        const AuditQuery& q, vector<AuditRecord>& out) {
+        using namespace AuditFormat;
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+        size_t off = begin;
+        while (off < end) {
+            if (p[off] == REC_STRING) {
+                if (off + 7 > end) break;
+                uint16_t len = getU16(p + off + 1);
+                uint32_t id  = getU32(p + off + 3);
+                if (off + 7 + len > end) break;
+                if (id >= dict.size()) dict.resize(id + 1);
+                dict[id].assign(data, off + 7, len);
+                off += 7 + len;
+            } else if (p[off] == REC_EVENT) {
+                if (off + EVENT_SIZE > end) break;
+                size_t detailLen = p[off + 3];
+                if (off + EVENT_SIZE + detailLen > end) break;
+                AuditRecord r;
+                r.type   = static_cast<AuditEventType>(p[off + 1]);
+                r.reason = static_cast<AuditReason>(p[off + 2]);
+                uint32_t user = getU32(p + off + 4);
+                r.when = (time_t)(int64_t)getU64(p + off + 8);
+                size_t detailOff = off + EVENT_SIZE;
+                off = detailOff + detailLen;
+
+                if (r.when < q.from || r.when > q.to) continue;
+                if (q.filterType && r.type != q.type) continue;
+                if (user != NO_STRING && user < dict.size()) r.user = dict[user];
+                if (!q.user.empty() && r.user != q.user) continue;
+                r.detail.assign(data, detailOff, detailLen);
+                out.push_back(move(r));
+                if (q.limit && out.size() >= q.limit) return false;
+            } else {
+                break;
+            }
+        }
+        return true;
+    }
+
+    static bool scanSegment(const string& path, const AuditQuery& q, vector<AuditRecord>& out) {
+        ifstream in(path, ios::binary);
+        if (!in.is_open()) return true;
+        string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        if (data.size() < AuditFormat::HEADER_SIZE) return true;
+        vector<string> dict;
+        return collect(data, AuditFormat::HEADER_SIZE, data.size(), dict, q, out);
+    }
+
+    static bool queryIndexed(const string& path, AuditSegmentIndex& index, const AuditQuery& q,
+                             vector<AuditRecord>& out) {
+        const auto& blocks = index.blocks;
+        if (blocks.empty()) return true;
+
+        // Timestamps are close to, but not strictly, monotonic: search on the
+        // running maximum and stop on the running minimum from the end.
+        vector<int64_t> prefixMax(blocks.size()), suffixMin(blocks.size());
+        for (size_t i = 0; i < blocks.size(); ++i)
+            prefixMax[i] = max(blocks[i].maxTs, i ? prefixMax[i - 1] : blocks[i].maxTs);
+        for (size_t i = blocks.size(); i-- > 0;)
+            suffixMin[i] = min(blocks[i].minTs, i + 1 < blocks.size() ? suffixMin[i + 1] : blocks[i].minTs);
+
+        size_t first = size_t(lower_bound(prefixMax.begin(), prefixMax.end(), (int64_t)q.from) - prefixMax.begin());
+        vector<uint32_t> candidates;
+        if (!q.user.empty()) {
+            auto d = find(index.dict.begin(), index.dict.end(), q.user);
+            if (d == index.dict.end()) return true;
+            auto it = index.userBlocks.find(uint32_t(d - index.dict.begin()));
+            if (it == index.userBlocks.end()) return true;
+            for (uint32_t b : it->second)
+                if (b >= first) candidates.push_back(b);
+        } else {
+            for (size_t b = first; b < blocks.size(); ++b) candidates.push_back(uint32_t(b));
+        }
+
+        ifstream in(path, ios::binary);
+        if (!in.is_open()) return true;
+        string data;
+        for (uint32_t b : candidates) {
+            if (suffixMin[b] > (int64_t)q.to) break;
+            if (blocks[b].maxTs < (int64_t)q.from || blocks[b].minTs > (int64_t)q.to) continue;
+
+            uint64_t begin = blocks[b].offset;
+            uint64_t end = b + 1 < blocks.size() ? blocks[b + 1].offset : index.segmentBytes;
+            data.resize(size_t(end - begin));
+            in.seekg((streamoff)begin);
+            in.read(&data[0], (streamsize)data.size());
+            data.resize(size_t(in.gcount()));
+            in.clear();
+            if (!collect(data, 0, data.size(), index.dict, q, out)) return false;
+        }
+        return true;
+    }
+};
+
+// ================== User Table (mmap) ==================
+// Versioned binary snapshot of all users, mapped read-only at startup so
+// nothing is parsed or copied until a user is actually looked up:
+//
+//   Header  (64 bytes)      counts and section offsets
+//   Records (80 bytes each) fixed-width numeric fields + StrRef offsets
+//   Slots   (8 bytes each)  open-addressing index on username:
+//                           {u32 hash tag, u32 record index + 1}, 0 = empty
+//   Strings                 heap referenced by the records' StrRefs
+//
+// A lookup touches one slot line, one record and its username bytes.
+// Integers are little-endian and read in place, so the layout assumes a
+// little-endian host.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The mmapped user table requires a little-endian host"
+#endif
+
+namespace UserTable {
+    const uint32_t MAGIC   = 0x42545543;  // "CUTB"
+    const uint16_t VERSION = 2;
+    const uint16_t VERSION_MB_USAGE = 1;      // usage stored as double MB; read and rewritten
+
+    struct StrRef {
+        uint32_t off;
+        uint32_t len;
+    };
+
+    struct Header {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t headerSize;
+        uint32_t recordSize;
+        uint32_t reserved;
+        uint64_t recordCount;
+        uint64_t slotCount;       // power of two, load factor <= 0.5
+        uint64_t recordsOffset;
+        uint64_t slotsOffset;
+        uint64_t stringsOffset;
+        uint64_t stringsSize;
+    };
+
+    enum : uint8_t { FLAG_ACTIVE = 1, FLAG_LOCKED = 2, FLAG_MFA = 4 };
+
+    struct Record {
+        StrRef   username, salt, passwordHash, fullName, gender;
+        int64_t  registrationDate;
+        int64_t  lastLoginTime;
+        int64_t  usedBytes;       // version 1: double megabytes in the same slot
+        int32_t  age;
+        int32_t  failedLogins;
+        uint8_t  role;
+        uint8_t  flags;
+        uint16_t reserved;
+        uint32_t reserved2;
+    };
+
+    struct Slot {
+        uint32_t tag;
+        uint32_t record;
+    };
+
+    static_assert(sizeof(Header) == 64, "UserTable::Header layout");
+    static_assert(sizeof(Record) == 80, "UserTable::Record layout");
+    static_assert(sizeof(Slot) == 8, "UserTable::Slot layout");
+
+    inline uint64_t hashName(string_view name) {
+        uint64_t h = 0xcbf29ce484222325ull;   // FNV-1a
+        for (unsigned char c : name) {
+            h ^= c;
+            h *= 0x100000001b3ull;
+        }
+        return h;
+    }
+
+    class MappedTable {
+    private:
+        const uint8_t* base{nullptr};
+        size_t bytes{0};
+        const Header* header{nullptr};
+        const Record* records{nullptr};
+        const Slot*   slots{nullptr};
+        const char*   strings{nullptr};
+
+    public:
+        MappedTable() = default;
+        MappedTable(const MappedTable&) = delete;
+        MappedTable& operator=(const MappedTable&) = delete;
+        ~MappedTable() { close(); }
+
+        // False if the file is missing; throws if it exists but is malformed.
+        bool open(const string& path) {
+            close();
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return false;
+            struct stat st{};
+            if (::fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+                ::close(fd);
+                throw runtime_error("user table " + path + " is truncated");
+            }
+            void* p = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (p == MAP_FAILED) throw runtime_error("cannot map user table " + path);
+            base  = static_cast<const uint8_t*>(p);
+            bytes = size_t(st.st_size);
+
+            header = reinterpret_cast<const Header*>(base);
+            const Header& h = *header;
+            bool ok = h.magic == MAGIC && (h.version == VERSION || h.version == VERSION_MB_USAGE) &&
+                      h.headerSize == sizeof(Header) && h.recordSize == sizeof(Record) &&
+                      h.slotCount > 0 && (h.slotCount & (h.slotCount - 1)) == 0 &&
+                      h.slotCount >= h.recordCount &&
+                      h.recordsOffset % 8 == 0 && h.slotsOffset % 8 == 0 &&
+                      h.recordsOffset + h.recordCount * sizeof(Record) <= bytes &&
+                      h.slotsOffset + h.slotCount * sizeof(Slot) <= bytes &&
+                      h.stringsOffset + h.stringsSize <= bytes;
+            if (!ok) {
+                close();
+                throw runtime_error("user table " + path + " is corrupt or from an unsupported version");
+            }
+            records = reinterpret_cast<const Record*>(base + h.recordsOffset);
+            slots   = reinterpret_cast<const Slot*>(base + h.slotsOffset);
+            strings = reinterpret_cast<const char*>(base + h.stringsOffset);
+            return true;
+        }
+
+        void close() {
+            if (base) ::munmap(const_cast<uint8_t*>(base), bytes);
+            base = nullptr;
+            bytes = 0;
+            header = nullptr;
+            records = nullptr;
+            slots = nullptr;
+            strings = nullptr;
+        }
+
+        size_t size() const { return header ? size_t(header->recordCount) : 0; }
+
+        const Record& record(size_t i) const { return records[i]; }
+
+        bool legacyUsage() const { return header && header->version == VERSION_MB_USAGE; }
+
+        int64_t usedBytes(const Record& r) const {
+            if (!legacyUsage()) return r.usedBytes;
+            double mb;
+            memcpy(&mb, &r.usedBytes, sizeof(mb));
+            return mbToBytes(mb);
+        }
+
+        size_t indexOf(const Record* r) const { return size_t(r - records); }
+
+        string_view str(const StrRef& r) const {
+            if (uint64_t(r.off) + r.len > header->stringsSize) return {};
+            return string_view(strings + r.off, r.len);
+        }
+
+        const Record* find(string_view name) const {
+            if (!header || header->recordCount == 0) return nullptr;
+            uint64_t h = hashName(name);
+            uint32_t tag = uint32_t(h >> 32);
+            uint64_t mask = header->slotCount - 1;
+            uint64_t i = h & mask;
+            for (uint64_t probes = 0; probes < header->slotCount; ++probes, i = (i + 1) & mask) {
+                const Slot& s = slots[i];
+                if (s.record == 0) return nullptr;
+                if (s.tag == tag && s.record <= header->recordCount) {
+                    const Record& r = records[s.record - 1];
+                    if (str(r.username) == name) return &r;
+                }
+            }
+            return nullptr;
+        }
+
+        User toUser(const Record& r) const {
+            User u;
+            u.username         = string(str(r.username));
+            u.salt             = string(str(r.salt));
+            u.passwordHash     = string(str(r.passwordHash));
+            u.fullName         = string(str(r.fullName));
+            u.gender           = string(str(r.gender));
+            u.age              = r.age;
+            u.role             = static_cast<UserRole>(r.role);
+            u.usedBytes        = usedBytes(r);
+            u.registrationDate = (time_t)r.registrationDate;
+            u.isActive         = (r.flags & FLAG_ACTIVE) != 0;
+            u.failedLogins     = r.failedLogins;
+            u.isLocked         = (r.flags & FLAG_LOCKED) != 0;
+            u.lastLoginTime    = (time_t)r.lastLoginTime;
+            u.mfaEnabled       = (r.flags & FLAG_MFA) != 0;
+            return u;
+        }
+    };
+
+    class Builder {
+    private:
+        vector<Record> records;
+        vector<uint64_t> hashes;
+        string heap;
+
+        StrRef put(string_view s) {
+            StrRef r{ (uint32_t)heap.size(), (uint32_t)s.size() };
+            heap.append(s.data(), s.size());
+            return r;
+        }
+
+        void push(const Record& r, string_view name) {
+            records.push_back(r);
+            hashes.push_back(hashName(name));
+        }
+
+    public:
+        void add(const User& u) {
+            Record r{};
+            r.username         = put(u.username);
+            r.salt             = put(u.salt);
+            r.passwordHash     = put(u.passwordHash);
+            r.fullName         = put(u.fullName);
+            r.gender           = put(u.gender);
+            r.registrationDate = (int64_t)u.registrationDate;
+            r.lastLoginTime    = (int64_t)u.lastLoginTime;
+            r.usedBytes        = u.usedBytes.load();
+            r.age              = u.age;
+            r.failedLogins     = u.failedLogins;
+            r.role             = (uint8_t)u.role;
+            r.flags            = uint8_t((u.isActive ? FLAG_ACTIVE : 0) | (u.isLocked ? FLAG_LOCKED : 0) |
+                                         (u.mfaEnabled ? FLAG_MFA : 0));
+            push(r, u.username);
+        }
+
+        // Copies a record from another table without materializing a User.
+        void add(const MappedTable& from, const Record& src) {
+            Record r = src;
+            r.usedBytes    = from.usedBytes(src);
+            r.username     = put(from.str(src.username));
+            r.salt         = put(from.str(src.salt));
+            r.passwordHash = put(from.str(src.passwordHash));
+            r.fullName     = put(from.str(src.fullName));
+            r.gender       = put(from.str(src.gender));
+            push(r, from.str(src.username));
+        }
+
+        string finish() const {
+            uint64_t slotCount = 16;
+            while (slotCount < records.size() * 2) slotCount <<= 1;
+            vector<Slot> slots(slotCount, Slot{0, 0});
+            for (size_t i = 0; i < records.size(); ++i) {
+                uint64_t h = hashes[i];
+                uint64_t j = h & (slotCount - 1);
+                while (slots[j].record != 0) j = (j + 1) & (slotCount - 1);
+                slots[j] = Slot{ uint32_t(h >> 32), uint32_t(i + 1) };
+            }
+
+            Header h{};
+            h.magic         = MAGIC;
+            h.version       = VERSION;
+            h.headerSize    = sizeof(Header);
+            h.recordSize    = sizeof(Record);
+            h.recordCount   = records.size();
+            h.slotCount     = slotCount;
+            h.recordsOffset = sizeof(Header);
+            h.slotsOffset   = h.recordsOffset + records.size() * sizeof(Record);
+            h.stringsOffset = h.slotsOffset + slotCount * sizeof(Slot);
+            h.stringsSize   = heap.size();
+
+            string out;
+            out.reserve(size_t(h.stringsOffset + heap.size()));
+            out.append(reinterpret_cast<const char*>(&h), sizeof(h));
+            out.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record));
+            out.append(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(Slot));
+            out += heap;
+            return out;
+        }
+    };
+}
+
+// ================== Locks ==================
+// Reader-writer lock split over cache-line sized shards. A reader locks
+// only its thread's shard, so readers on different cores don't bounce a
+// shared counter; a writer locks every shard in order. Meant for data that
+// is read far more often than its structure changes.
+class ShardedRWLock {
+private:
+    static constexpr size_t SHARDS = 16;
+    struct alignas(64) Shard { shared_mutex mtx; };
+    array<Shard, SHARDS> shards;
+
+    static size_t mine() {
+        static thread_local const size_t shard = hash<thread::id>()(this_thread::get_id()) % SHARDS;
+        return shard;
+    }
+
+public:
+    void lock() { for (auto& s : shards) s.mtx.lock(); }
+    void unlock() { for (auto it = shards.rbegin(); it != shards.rend(); ++it) it->mtx.unlock(); }
+    void lock_shared() { shards[mine()].mtx.lock_shared(); }
+    void unlock_shared() { shards[mine()].mtx.unlock_shared(); }
+};
+
+// Fixed pool of mutexes picked by key hash: per-key serialization without
+// a mutex per key. Hold at most one stripe at a time.
+class StripedMutex {
+private:
+    static constexpr size_t STRIPES = 256;
+    struct alignas(64) Stripe { mutex mtx; };
+    array<Stripe, STRIPES> stripes;
+
+public:
+    mutex& forKey(string_view key) { return stripes[hash<string_view>()(key) % STRIPES].mtx; }
+};
+
+// ================== User Columns ==================
+// Struct-of-arrays copy of the fields admin scans read, one row per user.
+// Rows [0, table size) mirror the mmapped table records in order; users
+// created since the table was written get rows after that. Aggregations
+// are straight passes over contiguous arrays (AVX2 when available).
+namespace columnsimpl {
+    size_t countMatchingScalar(const uint8_t* p, size_t n, uint8_t mask, uint8_t want) {
+        size_t count = 0;
+        for (size_t i = 0; i < n; ++i) count += (p[i] & mask) == want;
+        return count;
+    }
+
+    int64_t sumScalar(const int64_t* p, size_t n) {
+        int64_t acc[4] = {0, 0, 0, 0};
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            for (int k = 0; k < 4; ++k) acc[k] += p[i + k];
+        for (; i < n; ++i) acc[0] += p[i];
+        return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+    }
+
+#ifdef CLOUD_X86
+    __attribute__((target("avx2,popcnt")))
+    size_t countMatchingAvx2(const uint8_t* p, size_t n, uint8_t mask, uint8_t want) {
+        const __m256i vmask = _mm256_set1_epi8((char)mask);
+        const __m256i vwant = _mm256_set1_epi8((char)want);
+        size_t count = 0, i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(p + i)), vmask);
+            count += (size_t)_mm_popcnt_u32((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vwant)));
+        }
+        return count + countMatchingScalar(p + i, n - i, mask, want);
+    }
+
+    __attribute__((target("avx2")))
+    int64_t sumAvx2(const int64_t* p, size_t n) {
+        __m256i a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            a0 = _mm256_add_epi64(a0, _mm256_loadu_si256((const __m256i*)(p + i)));
+            a1 = _mm256_add_epi64(a1, _mm256_loadu_si256((const __m256i*)(p + i + 4)));
+        }
+        alignas(32) int64_t lanes[4];
+        _mm256_store_si256((__m256i*)lanes, _mm256_add_epi64(a0, a1));
+        return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + sumScalar(p + i, n - i);
+    }
+#endif
+
+    // Number of bytes with (p[i] & mask) == want.
+    size_t countMatching(const uint8_t* p, size_t n, uint8_t mask, uint8_t want) {
+#ifdef CLOUD_X86
+        static const bool avx2 = cpu::hasAvx2();
+        if (avx2) return countMatchingAvx2(p, n, mask, want);
+#endif
+        return countMatchingScalar(p, n, mask, want);
+    }
+
+    int64_t sum(const int64_t* p, size_t n) {
+#ifdef CLOUD_X86
+        static const bool avx2 = cpu::hasAvx2();
+        if (avx2) return sumAvx2(p, n);
+#endif
+        return sumScalar(p, n);
+    }
+}
+
+class UserColumns {
+public:
+    enum : uint8_t { FLAG_ACTIVE = 1, FLAG_LOCKED = 2, FLAG_MFA = 4 };
+
+    struct Stats {
+        size_t totalUsers{0};
+        size_t lockedUsers{0};
+        size_t premiumUsers{0};
+        size_t adminUsers{0};
+        size_t mfaUsers{0};
+        int64_t totalBytes{0};
+    };
+
+    vector<string_view> name;   // views into the mapped table or overlay keys
+    vector<uint8_t>     role;
+    vector<uint8_t>     flags;
+    vector<int64_t>     usedBytes;
+    vector<int32_t>     failedLogins;
+    vector<int64_t>     lastLoginTime;
+
+    size_t size() const { return role.size(); }
+
+    void clear() { resize(0); }
+
+    void resize(size_t n) {
+        name.resize(n);
+        role.resize(n);
+        flags.resize(n);
+        usedBytes.resize(n);
+        failedLogins.resize(n);
+        lastLoginTime.resize(n);
+    }
+
+    void set(size_t row, string_view userName, const User& u) {
+        name[row]          = userName;
+        role[row]          = (uint8_t)u.role;
+        flags[row]         = uint8_t((u.isActive ? FLAG_ACTIVE : 0) | (u.isLocked ? FLAG_LOCKED : 0) |
+                                     (u.mfaEnabled ? FLAG_MFA : 0));
+        usedBytes[row]     = u.usedBytes.load();
+        failedLogins[row]  = u.failedLogins;
+        lastLoginTime[row] = (int64_t)u.lastLoginTime;
+    }
+
+    void set(size_t row, const UserTable::MappedTable& table, const UserTable::Record& r) {
+        // The table stores the same flag bits
+        name[row]          = table.str(r.username);
+        role[row]          = r.role;
+        flags[row]         = r.flags;
+        usedBytes[row]     = table.usedBytes(r);
+        failedLogins[row]  = r.failedLogins;
+        lastLoginTime[row] = r.lastLoginTime;
+    }
+
+    Stats aggregate() const {
+        using namespace columnsimpl;
+        Stats s;
+        s.totalUsers   = size();
+        s.lockedUsers  = countMatching(flags.data(), size(), FLAG_LOCKED, FLAG_LOCKED);
+        s.mfaUsers     = countMatching(flags.data(), size(), FLAG_MFA, FLAG_MFA);
+        s.premiumUsers = countMatching(role.data(), size(), 0xFF, (uint8_t)UserRole::PREMIUM_USER);
+        s.adminUsers   = countMatching(role.data(), size(), 0xFF, (uint8_t)UserRole::ADMIN);
+        s.totalBytes   = sum(usedBytes.data(), size());
+        return s;
+    }
+};
+
+// ================== UserRepository ==================
+// Users live in the mmapped table (USERS_FILE) plus a write-ahead log of
+// per-user records. Startup maps the table and replays only the log tail;
+// a user is copied out of the table into the in-memory overlay the first
+// time it is looked up, and every changed user stays in the overlay.
+//
+// persist() appends the user's current row to the log; a committer thread
+// writes and fdatasyncs whatever has queued up in one go, so concurrent
+// callers share a single sync (group commit). Once the log passes
+// USER_WAL_COMPACT_BYTES it is sealed and a background compactor folds
+// table + sealed log into a new table (tmp + rename) without touching the
+// live state. The running process keeps its mapping of the old table,
+// which together with the overlay is still current.
+//
+// mapLock guards the table mapping and the overlay map; lookups share it
+// and only materializing a user or adding one takes it exclusively.
+// User objects handed out by find() stay put until save(); callers
+// serialize changes to one user themselves (CloudEngine's user locks).
+string serializeUser(const User& u) {
+    stringstream ss;
+    ss << u.username << "|"
+       << u.salt << "|"
+       << u.passwordHash << "|"
+       << u.fullName << "|"
+       << u.age << "|"
+       << u.gender << "|"
+       << static_cast<int>(u.role) << "|"
+       << u.usedBytes.load() << "|"
+       << u.registrationDate << "|"
+       << u.isActive << "|"
+       << u.failedLogins << "|"
+       << u.isLocked << "|"
+       << u.lastLoginTime << "|"
+       << u.mfaEnabled;
+    return ss.str();
+}
+
+// usageInMB: records written before byte accounting, usage as double MB.
+bool parseUser(const string& line, User& u, bool usageInMB) {
+    stringstream ss(line);
+    string token;
+    try {
+        getline(ss, u.username, '|');
+        getline(ss, u.salt, '|');
+        getline(ss, u.passwordHash, '|');
+        getline(ss, u.fullName, '|');
+        getline(ss, token, '|'); u.age = stoi(token);
+        getline(ss, u.gender, '|');
+        getline(ss, token, '|'); u.role = static_cast<UserRole>(stoi(token));
+        getline(ss, token, '|');
+        u.usedBytes = usageInMB ? mbToBytes(stod(token)) : (int64_t)stoll(token);
+        getline(ss, token, '|'); u.registrationDate = stol(token);
+        getline(ss, token, '|'); u.isActive = (token == "1");
+        getline(ss, token, '|'); u.failedLogins = stoi(token);
+        getline(ss, token, '|'); u.isLocked = (token == "1");
+        getline(ss, token, '|'); u.lastLoginTime = stol(token);
+        getline(ss, token, '|'); u.mfaEnabled = (token == "1");
+    } catch (...) {
+        return false;
+    }
+    return !u.username.empty();
+}
+
+class UserRepository {
+private:
+    static constexpr char REC_UPSERT_MB = 'U';   // legacy: usage in MB
+    static constexpr char REC_UPSERT    = 'B';
+
+    mutable ShardedRWLock mapLock;
+    UserTable::MappedTable table;
+    unordered_map<string, User> users;   // overlay: looked-up, changed and new users
+    size_t overlayOnly{0};               // overlay users that are not in the table
+
+    // Hot-field columns, built on first use and kept in sync by append()
+    mutable mutex hotMtx;
+    UserColumns hot;
+    bool hotBuilt{false};
+    unordered_map<string, uint32_t> extraRows;   // rows of users not in the table
+
+    // Active log, owned by the committer thread once running
+    int      walFd{-1};
+    uint64_t walBytes{0};
+
+    mutex walMtx;
+    condition_variable commitCv;    // wakes the committer
+    condition_variable durableCv;   // wakes callers waiting in commit()
+    string   pending;
+    uint64_t appendedLsn{0};
+    uint64_t durableLsn{0};
+    bool     walFailed{false};
+    bool     sealedPending{false};  // a sealed log is waiting for compaction
+    bool     stopping{false};
+    thread   committer;
+
+    mutex compactMtx;               // one table writer at a time
+    condition_variable compactCv;
+    bool   compactRequested{false};
+    thread compactor;
+
+    static string walPath()    { return Config::USERS_FILE + ".wal"; }
+    static string sealedPath() { return Config::USERS_FILE + ".wal.1"; }
+
+    // Applies a log to `into`; returns the length of its intact prefix.
+    static size_t replayWal(const string& path, unordered_map<string, User>& into) {
+        string data;
+        if (!readFile(path, data)) return 0;
+        return forEachFramed(data, [&](const string& payload) {
+            User u;
+            if (payload.empty() || (payload[0] != REC_UPSERT && payload[0] != REC_UPSERT_MB)) return;
+            if (parseUser(payload.substr(1), u, payload[0] == REC_UPSERT_MB)) into[u.username] = u;
+        });
+    }
+
+    // Table records not shadowed by `newer`, followed by everything in `newer`.
+    static bool writeTable(const UserTable::MappedTable& base, const unordered_map<string, User>& newer) {
+        UserTable::Builder builder;
+        for (size_t i = 0; i < base.size(); ++i) {
+            const auto& r = base.record(i);
+            if (newer.find(string(base.str(r.username))) == newer.end()) builder.add(base, r);
+        }
+        for (const auto& [name, u] : newer) builder.add(u);
+        return writeFileAtomic(Config::USERS_FILE, builder.finish());
+    }
+
+    // One-time import of the old text snapshot and its logs.
+    static void migrateLegacy() {
+        const string& legacy = Config::LEGACY_USERS_FILE;
+        if (fs::exists(Config::USERS_FILE) || !fs::exists(legacy)) return;
+
+        unordered_map<string, User> imported;
+        ifstream file(legacy);
+        string line;
+        while (getline(file, line)) {
+            User u;
+            if (parseUser(line, u, true)) imported[u.username] = u;
+        }
+        replayWal(legacy + ".wal.1", imported);
+        replayWal(legacy + ".wal", imported);
+
+        UserTable::MappedTable empty;
+        if (!writeTable(empty, imported)) throw runtime_error("cannot write " + Config::USERS_FILE);
+        for (const string& path : { legacy, legacy + ".wal.1", legacy + ".wal" }) {
+            error_code ec;
+            if (fs::exists(path)) fs::rename(path, path + ".migrated", ec);
+        }
+    }
+
+    void openWal() {
+        walFd = ::open(walPath().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        struct stat st{};
+        walBytes = (walFd >= 0 && ::fstat(walFd, &st) == 0) ? uint64_t(st.st_size) : 0;
+    }
+
+    // Called with walMtx held and no write in flight.
+    void sealWal() {
+        ::close(walFd);
+        ::rename(walPath().c_str(), sealedPath().c_str());
+        syncDir(parentDir(Config::USERS_FILE));
+        openWal();
+        sealedPending = true;
+        {
+            lock_guard<mutex> lk(compactMtx);
+            compactRequested = true;
+        }
+        compactCv.notify_one();
+    }
+
+    void commitLoop() {
+        unique_lock<mutex> lk(walMtx);
+        while (true) {
+            commitCv.wait(lk, [&] { return !pending.empty() || stopping; });
+            if (pending.empty()) break;
+
+            string batch;
+            batch.swap(pending);
+            uint64_t upto = appendedLsn;
+            lk.unlock();
+            bool ok = walFd >= 0 && writeAllFd(walFd, batch.data(), batch.size()) && syncFd(walFd) == 0;
+            lk.lock();
+
+            walBytes += batch.size();
+            if (!ok) walFailed = true;
+            durableLsn = upto;
+            durableCv.notify_all();
+
+            if (walBytes >= Config::USER_WAL_COMPACT_BYTES && !sealedPending) sealWal();
+        }
+    }
+
+    void compactLoop() {
+        unique_lock<mutex> lk(compactMtx);
+        while (true) {
+            compactCv.wait(lk, [&] { return compactRequested || stopping; });
+            if (!compactRequested) break;
+            compactRequested = false;
+
+            // Work from the files, not the live overlay
+            UserTable::MappedTable current;
+            unordered_map<string, User> delta;
+            try {
+                current.open(Config::USERS_FILE);
+            } catch (const exception&) {
+                continue;
+            }
+            replayWal(sealedPath(), delta);
+            if (writeTable(current, delta)) {
+                ::unlink(sealedPath().c_str());
+                syncDir(parentDir(Config::USERS_FILE));
+                lock_guard<mutex> wl(walMtx);
+                sealedPending = false;
+            }
+        }
+    }
+
+    // Writes u's hot fields into its row, allocating one for new users.
+    void syncHot(const User& u) {
+        auto node = users.find(u.username);
+        string_view key = node != users.end() ? string_view(node->first) : string_view();
+        size_t row;
+        if (const UserTable::Record* r = table.find(u.username)) {
+            row = table.indexOf(r);
+        } else {
+            auto it = extraRows.find(u.username);
+            if (it == extraRows.end()) {
+                it = extraRows.emplace(u.username, (uint32_t)hot.size()).first;
+                hot.resize(hot.size() + 1);
+            }
+            row = it->second;
+            if (key.empty()) key = it->first;
+        }
+        hot.set(row, key, u);
+    }
+
+    void addToOverlay(const User& u) {
+        auto it = users.find(u.username);
+        if (it == users.end()) {
+            if (!table.find(u.username)) ++overlayOnly;
+            users.emplace(u.username, u);
+        } else {
+            it->second = u;
+        }
+    }
+
+public:
+    UserRepository() {
+        load();
+        committer = thread([this] { commitLoop(); });
+        compactor = thread([this] { compactLoop(); });
+    }
+
+    ~UserRepository() {
+        {
+            lock_guard<mutex> wl(walMtx);
+            lock_guard<mutex> cl(compactMtx);
+            stopping = true;
+        }
+        commitCv.notify_one();
+        compactCv.notify_one();
+        if (committer.joinable()) committer.join();
+        if (compactor.joinable()) compactor.join();
+        if (walFd >= 0) ::close(walFd);
+    }
+
+    bool exists(const string& username) const {
+        shared_lock<ShardedRWLock> lk(mapLock);
+        return users.find(username) != users.end() || table.find(username) != nullptr;
+    }
+
+    User* find(const string& username) {
+        {
+            shared_lock<ShardedRWLock> lk(mapLock);
+            auto it = users.find(username);
+            if (it != users.end()) return &it->second;
+            if (!table.find(username)) return nullptr;
+        }
+        unique_lock<ShardedRWLock> lk(mapLock);
+        auto it = users.find(username);
+        if (it != users.end()) return &it->second;
+        const UserTable::Record* r = table.find(username);
+        if (!r) return nullptr;
+        return &users.emplace(username, table.toUser(*r)).first->second;
+    }
+
+    void add(const User& u) {
+        unique_lock<ShardedRWLock> lk(mapLock);
+        addToOverlay(u);
+    }
+
+    size_t size() const {
+        shared_lock<ShardedRWLock> lk(mapLock);
+        return table.size() + overlayOnly;
+    }
+
+    // Visits every user once; overlay entries shadow table records. fn runs
+    // under the shared lock and must not add users.
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        shared_lock<ShardedRWLock> lk(mapLock);
+        for (const auto& [name, u] : users) fn(u);
+        for (size_t i = 0; i < table.size(); ++i) {
+            const auto& r = table.record(i);
+            if (users.find(string(table.str(r.username))) == users.end()) fn(table.toUser(r));
+        }
+    }
+
+    // Runs fn on the hot-field columns, building them on first use.
+    template <typename Fn>
+    void withColumns(Fn fn) {
+        shared_lock<ShardedRWLock> lk(mapLock);
+        lock_guard<mutex> hl(hotMtx);
+        if (!hotBuilt) {
+            hot.clear();
+            extraRows.clear();
+            hot.resize(table.size());
+            for (size_t i = 0; i < table.size(); ++i) {
+                const auto& r = table.record(i);
+                hot.set(i, table, r);
+            }
+            for (const auto& [name, u] : users) syncHot(u);
+            hotBuilt = true;
+        }
+        fn(static_cast<const UserColumns&>(hot));
+    }
+
+    // Queues the user's current state for the log and returns its sequence
+    // number without waiting; pair with commit() to batch several users
+    // behind one sync.
+    uint64_t append(const User& u) {
+        {
+            shared_lock<ShardedRWLock> lk(mapLock);
+            lock_guard<mutex> hl(hotMtx);
+            if (hotBuilt) syncHot(u);
+        }
+        string record;
+        appendFramed(record, string(1, REC_UPSERT) + serializeUser(u));
+        uint64_t lsn;
+        {
+            lock_guard<mutex> lk(walMtx);
+            pending += record;
+            lsn = ++appendedLsn;
+        }
+        commitCv.notify_one();
+        return lsn;
+    }
+
+    // Waits until everything up to lsn is on disk.
+    bool commit(uint64_t lsn) {
+        Metrics::Timer timer(Metrics::Op::USER_COMMIT);
+        unique_lock<mutex> lk(walMtx);
+        durableCv.wait(lk, [&] { return durableLsn >= lsn; });
+        return !walFailed;
+    }
+
+    bool persist(const User& u) { return commit(append(u)); }
+
+    // Full checkpoint: writes table + overlay as the new table, empties the
+    // logs and remaps.
+    bool save() {
+        Metrics::Timer timer(Metrics::Op::USER_SAVE);
+        unique_lock<ShardedRWLock> ml(mapLock);
+        lock_guard<mutex> cl(compactMtx);
+        unique_lock<mutex> lk(walMtx);
+        durableCv.wait(lk, [&] { return durableLsn >= appendedLsn; });
+        if (!writeTable(table, users)) return false;
+        ::unlink(sealedPath().c_str());
+        sealedPending = false;
+        if (walFd >= 0 && ::ftruncate(walFd, 0) == 0) walBytes = 0;
+        syncFd(walFd);
+
+        table.open(Config::USERS_FILE);
+        users.clear();
+        overlayOnly = 0;
+        hotBuilt = false;
+        return true;
+    }
+
+    bool load() {
+        migrateLegacy();
+        users.clear();
+        overlayOnly = 0;
+        hotBuilt = false;
+        table.open(Config::USERS_FILE);
+
+        unordered_map<string, User> tail;
+        if (fs::exists(sealedPath())) {
+            replayWal(sealedPath(), tail);
+            sealedPending = true;
+            compactRequested = true;
+        }
+        size_t intact = replayWal(walPath(), tail);
+        for (const auto& [name, u] : tail) addToOverlay(u);
+
+        openWal();
+        if (walFd >= 0 && walBytes > intact) {
+            // Drop a record torn by a crash so new appends stay readable
+            if (::ftruncate(walFd, (off_t)intact) == 0) walBytes = intact;
+        }
+        return true;
+    }
+};
+
+// ================== File Catalog Log ==================
+// DATA_DIR/<region>/<user>.dat is an append-only log, one entry per line:
+//   id|name|owner|region|type|uploaded|size|description|isPublic|encrypted
+//   -|id                                   (tombstone)
+// A record line upserts by id and a tombstone removes the id, so replaying
+// a line twice is harmless. Catalogs written before the log are plain
+// record lines and load unchanged. The upload time is written as epoch
+// seconds; older lines carry it formatted and still parse. The size is
+// bytes with a 'b' suffix; a bare number is megabytes from older logs. A final line
+// without '\n' is a torn append and is ignored.
+namespace FileCatalog {
+    inline string_view nextField(string_view& line) {
+        size_t bar = line.find('|');
+        string_view field = line.substr(0, bar);
+        line = bar == string_view::npos ? string_view() : line.substr(bar + 1);
+        return field;
+    }
+
+    template <typename T>
+    inline bool parseNumber(string_view s, T& out) {
+        auto res = from_chars(s.data(), s.data() + s.size(), out);
+        return res.ec == errc() && res.ptr == s.data() + s.size();
+    }
+
+    // Epoch seconds, or a formatTime() string from older logs
+    bool parseTime(string_view s, time_t& out) {
+        int64_t v;
+        if (parseNumber(s, v)) {
+            out = (time_t)v;
+            return true;
+        }
+        return parseLocalTime(s, out);
+    }
+
+    // "<bytes>b", or a megabyte figure from older logs
+    bool parseSize(string_view s, int64_t& out) {
+        if (!s.empty() && s.back() == 'b') return parseNumber(s.substr(0, s.size() - 1), out);
+        double mb;
+        if (!parseNumber(s, mb) || !(mb >= 0) || mb > 1e12) return false;
+        out = mbToBytes(mb);
+        return true;
+    }
+
+    bool parseLine(string_view line, FileRecord& fr) {
+        string_view f[10];
+        for (int i = 0; i < 10; ++i) {
+            if (i > 0 && line.data() == nullptr) return false;
+            f[i] = nextField(line);
+        }
+        int region, type;
+        if (!FileId::parse(f[0], fr.id) || !parseNumber(f[3], region) || !parseNumber(f[4], type) ||
+            !parseTime(f[5], fr.uploaded) || !parseSize(f[6], fr.sizeBytes))
+            return false;
+        if (region < 0 || region > (int)Region::GLOBAL || type < 0 || type > (int)FileType::OTHER) return false;
+        fr.name.assign(f[1]);
+        fr.owner.assign(f[2]);
+        fr.region = static_cast<Region>(region);
+        fr.type   = static_cast<FileType>(type);
+        fr.description.assign(f[7]);
+        fr.isPublic        = f[8] == "1";
+        fr.encryptedAtRest = f[9] == "1";
+        return true;
+    }
+
+    void appendRecord(string& out, const FileRecord& fr) {
+        fr.id.appendTo(out); out += '|';
+        out += fr.name; out += '|';
+        out += fr.owner; out += '|';
+        out += to_string(static_cast<int>(fr.region)); out += '|';
+        out += to_string(static_cast<int>(fr.type));   out += '|';
+        out += to_string((int64_t)fr.uploaded); out += '|';
+        out += to_string(fr.sizeBytes); out += "b|";
+        out += fr.description; out += '|';
+        out += fr.isPublic ? '1' : '0'; out += '|';
+        out += fr.encryptedAtRest ? '1' : '0';
+        out += '\n';
+    }
+
+    void appendTombstone(string& out, const FileId& id) {
+        out += "-|";
+        id.appendTo(out);
+        out += '\n';
+    }
+
+    struct ReplayResult {
+        size_t bytes{0};   // length of the intact prefix
+        size_t lines{0};   // entries in that prefix, live or dead
+    };
+
+    ReplayResult parse(string_view data, vector<FileRecord>& out) {
+        ReplayResult res;
+        unordered_map<FileId, size_t> byId;
+        vector<bool> removed;
+        for (size_t i = 0; i < out.size(); ++i) byId.emplace(out[i].id, i);
+        removed.assign(out.size(), false);
+
+        size_t pos = 0;
+        while (pos < data.size()) {
+            size_t nl = data.find('\n', pos);
+            if (nl == string_view::npos) break;
+            string_view line = data.substr(pos, nl - pos);
+            pos = nl + 1;
+            res.bytes = pos;
+            if (line.empty()) continue;
+            ++res.lines;
+
+            if (line.size() > 2 && line[0] == '-' && line[1] == '|') {
+                FileId id;
+                auto it = FileId::parse(line.substr(2), id) ? byId.find(id) : byId.end();
+                if (it != byId.end()) {
+                    removed[it->second] = true;
+                    byId.erase(it);
+                }
+                continue;
+            }
+            FileRecord fr;
+            if (!parseLine(line, fr)) continue;
+            auto [it, fresh] = byId.emplace(fr.id, out.size());
+            if (fresh) {
+                out.push_back(std::move(fr));
+                removed.push_back(false);
+            } else {
+                out[it->second] = std::move(fr);
+            }
+        }
+
+        size_t keep = 0;
+        for (size_t i = 0; i < out.size(); ++i)
+            if (!removed[i]) {
+                if (keep != i) out[keep] = std::move(out[i]);
+                ++keep;
+            }
+        out.resize(keep);
+        return res;
+    }
+}
+
+// ================== Search Index ==================
+// Case-insensitive substring search over file name and description.
+// Each indexed file gets a document id in insertion order, so posting
+// lists (trigram -> doc ids) stay sorted without extra work. A query
+// intersects the postings of its trigrams and confirms each candidate
+// against the stored lowercase text. Deleted documents are only marked;
+// the index rebuilds once they outnumber live ones.
+namespace searchimpl {
+    inline char lower(char c) {
+        return (c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c;
+    }
+
+    inline uint32_t trigram(const char* p) {
+        return uint32_t(uint8_t(p[0])) | uint32_t(uint8_t(p[1])) << 8 | uint32_t(uint8_t(p[2])) << 16;
+    }
+
+    bool containsScalar(string_view hay, string_view needle) {
+        return hay.find(needle) != string_view::npos;
+    }
+
+#ifdef CLOUD_X86
+    // Compares the needle's first and last bytes at 32 positions at once and
+    // checks the middle only where both match.
+    __attribute__((target("avx2")))
+    bool containsAvx2(string_view hay, string_view needle) {
+        const size_t n = hay.size(), k = needle.size();
+        const __m256i first = _mm256_set1_epi8(needle[0]);
+        const __m256i last  = _mm256_set1_epi8(needle[k - 1]);
+        size_t i = 0;
+        for (; i + k - 1 + 32 <= n; i += 32) {
+            __m256i f = _mm256_loadu_si256((const __m256i*)(hay.data() + i));
+            __m256i l = _mm256_loadu_si256((const __m256i*)(hay.data() + i + k - 1));
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(f, first), _mm256_cmpeq_epi8(l, last)));
+            while (mask) {
+                unsigned bit = (unsigned)__builtin_ctz(mask);
+                if (memcmp(hay.data() + i + bit + 1, needle.data() + 1, k - 2) == 0) return true;
+                mask &= mask - 1;
+            }
+        }
+        return containsScalar(hay.substr(i), needle);
+    }
+#endif
+
+    bool contains(string_view hay, string_view needle) {
+        if (needle.size() > hay.size()) return false;
+#ifdef CLOUD_X86
+        static const bool avx2 = cpu::hasAvx2();
+        if (avx2 && needle.size() >= 2) return containsAvx2(hay, needle);
+#endif
+        return containsScalar(hay, needle);
+    }
+}
+
+class TrigramIndex {
+private:
+    struct Doc {
+        FileId fileId;
+        string text;   // lowercase name + '\n' + description
+        bool   live;
+    };
+    vector<Doc> docs;
+    unordered_map<FileId, uint32_t> docOf;   // file id -> doc
+    unordered_map<uint32_t, vector<uint32_t>> postings;
+    size_t dead{0};
+
+    void indexDoc(uint32_t d) {
+        const string& t = docs[d].text;
+        for (size_t i = 0; i + 3 <= t.size(); ++i) {
+            auto& list = postings[searchimpl::trigram(&t[i])];
+            if (list.empty() || list.back() != d) list.push_back(d);
+        }
+    }
+
+    void rebuild() {
+        vector<Doc> old;
+        old.swap(docs);
+        docOf.clear();
+        postings.clear();
+        dead = 0;
+        for (auto& doc : old)
+            if (doc.live) add(doc.fileId, std::move(doc.text));
+    }
+
+    void add(const FileId& fileId, string text) {
+        uint32_t d = (uint32_t)docs.size();
+        docs.push_back(Doc{fileId, std::move(text), true});
+        docOf[fileId] = d;
+        indexDoc(d);
+    }
+
+public:
+    static string foldText(string_view name, string_view description) {
+        string t;
+        t.reserve(name.size() + 1 + description.size());
+        for (char c : name) t += searchimpl::lower(c);
+        t += '\n';
+        for (char c : description) t += searchimpl::lower(c);
+        return t;
+    }
+
+    size_t size() const { return docOf.size(); }
+
+    void clear() {
+        docs.clear();
+        docOf.clear();
+        postings.clear();
+        dead = 0;
+    }
+
+    void insert(const FileId& id, string_view name, string_view description) {
+        erase(id);
+        add(id, foldText(name, description));
+    }
+
+    void insert(const FileRecord& fr) { insert(fr.id, fr.name, fr.description); }
+
+    void erase(const FileId& fileId) {
+        auto it = docOf.find(fileId);
+        if (it == docOf.end()) return;
+        Doc& doc = docs[it->second];
+        doc.live = false;
+        string().swap(doc.text);
+        docOf.erase(it);
+        if (++dead > 1024 && dead > docOf.size()) rebuild();
+    }
+
+    // Ids of files whose name or description contains term, in insertion
+    // order.
+    vector<FileId> search(const string& term) const {
+        string needle;
+        needle.reserve(term.size());
+        for (char c : term) needle += searchimpl::lower(c);
+
+        vector<FileId> out;
+        auto confirm = [&](uint32_t d) {
+            const Doc& doc = docs[d];
+            if (doc.live && searchimpl::contains(doc.text, needle)) out.push_back(doc.fileId);
+        };
+
+        if (needle.size() < 3) {
+            for (uint32_t d = 0; d < docs.size(); ++d) confirm(d);
+            return out;
+        }
+
+        vector<uint32_t> grams;
+        for (size_t i = 0; i + 3 <= needle.size(); ++i) grams.push_back(searchimpl::trigram(&needle[i]));
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+
+        vector<const vector<uint32_t>*> lists;
+        for (uint32_t g : grams) {
+            auto it = postings.find(g);
+            if (it == postings.end()) return out;
+            lists.push_back(&it->second);
+        }
+        sort(lists.begin(), lists.end(), [](auto* a, auto* b) { return a->size() < b->size(); });
+
+        vector<uint32_t> candidates = *lists[0], next;
+        for (size_t l = 1; l < lists.size() && !candidates.empty(); ++l) {
+            next.clear();
+            set_intersection(candidates.begin(), candidates.end(), lists[l]->begin(), lists[l]->end(),
+                             back_inserter(next));
+            candidates.swap(next);
+        }
+        for (uint32_t d : candidates) confirm(d);
+        return out;
+    }
+};
+
+// ================== Public Catalog ==================
+// Every public file, kept in three ordered sets so that a page of results
+// costs O(log n + page size). Persisted as an append-only log next to the
+// user catalogs, one entry per line:
+//   +|id|owner|type|region|uploaded|name
+//   -|id
+// It is rewritten at open once dead lines outnumber live ones.
+class PublicCatalog {
+public:
+    enum class Order { DATE, TYPE, REGION };
+
+    struct Entry {
+        FileId   id;
+        string   owner;
+        string   name;
+        time_t   uploaded{0};
+        FileType type{FileType::OTHER};
+        Region   region{Region::GLOBAL};
+
+        string regionString() const { return regionName(region); }
+        string typeString() const { return fileTypeName(type); }
+        string dateString() const { return formatTime(uploaded); }
+    };
+
+    // Position after the last entry of a page; a default cursor starts at the top.
+    struct Cursor {
+        bool    valid{false};
+        uint8_t group{0};
+        time_t  uploaded{0};
+        FileId  id;
+    };
+
+    struct Page {
+        vector<Entry> entries;
+        Cursor next;
+        bool   more{false};
+    };
+
+private:
+    // Groups ascend, newest first within a group
+    struct KeyLess {
+        bool operator()(const Cursor& a, const Cursor& b) const {
+            if (a.group != b.group) return a.group < b.group;
+            if (a.uploaded != b.uploaded) return a.uploaded > b.uploaded;
+            return a.id < b.id;
+        }
+    };
+    using OrderedSet = set<Cursor, KeyLess>;
+
+    string path;
+    unordered_map<FileId, Entry> entries;
+    OrderedSet byDate, byType, byRegion;
+    size_t logLines{0};
+    bool deferSync{false};
+    bool unsynced{false};
+
+    static Cursor keyOf(const Entry& e, Order order) {
+        Cursor k;
+        k.valid = true;
+        k.group = order == Order::TYPE ? (uint8_t)e.type : order == Order::REGION ? (uint8_t)e.region : 0;
+        k.uploaded = e.uploaded;
+        k.id = e.id;
+        return k;
+    }
+
+    OrderedSet& setFor(Order order) {
+        return order == Order::TYPE ? byType : order == Order::REGION ? byRegion : byDate;
+    }
+    const OrderedSet& setFor(Order order) const {
+        return order == Order::TYPE ? byType : order == Order::REGION ? byRegion : byDate;
+    }
+
+    void link(Entry e) {
+        unlink(e.id);
+        for (Order o : {Order::DATE, Order::TYPE, Order::REGION}) setFor(o).insert(keyOf(e, o));
+        FileId id = e.id;
+        entries.emplace(id, std::move(e));
+    }
+
+    bool unlink(const FileId& id) {
+        auto it = entries.find(id);
+        if (it == entries.end()) return false;
+        for (Order o : {Order::DATE, Order::TYPE, Order::REGION}) setFor(o).erase(keyOf(it->second, o));
+        entries.erase(it);
+        return true;
+    }
+
+    static void appendEntry(string& out, const Entry& e) {
+        out += "+|"; e.id.appendTo(out);
+        out += '|';  out += e.owner;
+        out += '|';  out += to_string((int)e.type);
+        out += '|';  out += to_string((int)e.region);
+        out += '|';  out += to_string((int64_t)e.uploaded);
+        out += '|';  out += e.name;
+        out += '\n';
+    }
+
+    static bool parseEntry(string_view line, Entry& e) {
+        string_view f[6];
+        for (int i = 0; i < 5; ++i) {
+            if (line.data() == nullptr) return false;
+            f[i] = FileCatalog::nextField(line);
+        }
+        if (line.data() == nullptr) return false;
+        f[5] = line;   // the name may itself contain '|'
+        int type, region;
+        if (!FileId::parse(f[0], e.id) || !FileCatalog::parseNumber(f[2], type) ||
+            !FileCatalog::parseNumber(f[3], region) || !FileCatalog::parseTime(f[4], e.uploaded))
+            return false;
+        if (region < 0 || region > (int)Region::GLOBAL || type < 0 || type > (int)FileType::OTHER) return false;
+        e.owner.assign(f[1]);
+        e.type = static_cast<FileType>(type);
+        e.region = static_cast<Region>(region);
+        e.name.assign(f[5]);
+        return true;
+    }
+
+    bool appendLine(const string& line) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        bool ok = writeAllFd(fd, line.data(), line.size()) && (deferSync || syncFd(fd) == 0);
+        ::close(fd);
+        if (ok) ++logLines;
+        if (ok && deferSync) unsynced = true;
+        return ok;
+    }
+
+public:
+    static Entry entryOf(const FileRecord& fr) {
+        Entry e;
+        e.id = fr.id;
+        e.owner = fr.owner;
+        e.name = fr.name;
+        e.uploaded = fr.uploaded;
+        e.type = fr.type;
+        e.region = fr.region;
+        return e;
+    }
+
+    size_t size() const { return entries.size(); }
+
+    // While deferred, appends skip the sync until flush().
+    void setDeferredSync(bool on) { deferSync = on; }
+
+    bool flush() {
+        if (!unsynced) return true;
+        int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        bool ok = syncFd(fd) == 0;
+        ::close(fd);
+        if (ok) unsynced = false;
+        return ok;
+    }
+
+    // Loads the catalog; false when there is no catalog file yet.
+    bool open(const string& file) {
+        path = file;
+        entries.clear();
+        byDate.clear(); byType.clear(); byRegion.clear();
+        logLines = 0;
+
+        string data;
+        if (!readFile(path, data)) return false;
+        size_t pos = 0, intact = 0;
+        while (pos < data.size()) {
+            size_t nl = data.find('\n', pos);
+            if (nl == string::npos) break;
+            string_view line(data.data() + pos, nl - pos);
+            pos = intact = nl + 1;
+            if (line.size() < 2 || line[1] != '|') continue;
+            ++logLines;
+            if (line[0] == '-') {
+                FileId id;
+                if (FileId::parse(line.substr(2), id)) unlink(id);
+            } else if (line[0] == '+') {
+                Entry e;
+                if (parseEntry(line.substr(2), e)) link(std::move(e));
+            }
+        }
+        if (logLines > 2 * entries.size() + 1024) {
+            string all;
+            for (const auto& [id, e] : entries) appendEntry(all, e);
+            if (writeFileAtomic(path, all)) logLines = entries.size();
+        } else if (intact < data.size()) {
+            (void)::truncate(path.c_str(), (off_t)intact);
+        }
+        return true;
+    }
+
+    // Replaces the catalog with the public files in files.
+    bool rebuild(const unordered_map<string, vector<FileRecord>>& files) {
+        entries.clear();
+        byDate.clear(); byType.clear(); byRegion.clear();
+        string all;
+        for (const auto& [owner, vec] : files)
+            for (const auto& fr : vec)
+                if (fr.isPublic) {
+                    Entry e = entryOf(fr);
+                    appendEntry(all, e);
+                    link(std::move(e));
+                }
+        logLines = entries.size();
+        return writeFileAtomic(path, all);
+    }
+
+    // True when the catalog holds exactly the public files in files.
+    bool matches(const unordered_map<string, vector<FileRecord>>& files) const {
+        size_t n = 0;
+        for (const auto& [owner, vec] : files)
+            for (const auto& fr : vec) {
+                if (!fr.isPublic) continue;
+                auto it = entries.find(fr.id);
+                if (it == entries.end() || it->second.owner != fr.owner || it->second.region != fr.region) return false;
+                ++n;
+            }
+        return n == entries.size();
+    }
+
+    // put() and remove() always update the in-memory catalog; false means
+    // the log missed the change, which the next open() repairs.
+    bool put(const FileRecord& fr) {
+        Entry e = entryOf(fr);
+        string line;
+        appendEntry(line, e);
+        bool ok = appendLine(line);
+        link(std::move(e));
+        return ok;
+    }
+
+    bool remove(const FileId& id) {
+        if (!entries.count(id)) return true;
+        string line = "-|";
+        id.appendTo(line);
+        line += '\n';
+        bool ok = appendLine(line);
+        unlink(id);
+        return ok;
+    }
+
+    Page page(Order order, const Cursor& after, size_t limit) const {
+        const OrderedSet& s = setFor(order);
+        Page p;
+        auto it = after.valid ? s.upper_bound(after) : s.begin();
+        for (; it != s.end() && p.entries.size() < limit; ++it) {
+            p.entries.push_back(entries.find(it->id)->second);
+            p.next = *it;
+        }
+        p.more = it != s.end();
+        return p;
+    }
+};
+
+// ================== File Store ==================
+// Resident form of a user's catalog. FileRecord stays the exchange type;
+// in memory each file is a fixed 40-byte PackedFile whose name and
+// description live in the user's string arena, with region, type and
+// flags packed into one byte. The owner is implied by the list and
+// interned where the id index needs it.
+
+// Interned usernames. Ids are never reused and names never move.
+class OwnerNames {
+private:
+    mutable shared_mutex mtx;
+    unordered_map<string_view, uint32_t> ids;   // views into names
+    deque<string> names;
+
+public:
+    uint32_t intern(const string& name) {
+        {
+            shared_lock<shared_mutex> lk(mtx);
+            auto it = ids.find(name);
+            if (it != ids.end()) return it->second;
+        }
+        lock_guard<shared_mutex> lk(mtx);
+        auto it = ids.find(name);
+        if (it != ids.end()) return it->second;
+        uint32_t id = (uint32_t)names.size();
+        names.push_back(name);
+        ids.emplace(names.back(), id);
+        return id;
+    }
+
+    const string& name(uint32_t id) const {
+        shared_lock<shared_mutex> lk(mtx);
+        return names[id];
+    }
+};
+
+struct PackedFile {
+    FileId   id;
+    int64_t  sizeBytes;
+    uint32_t uploaded;    // epoch seconds, unsigned: good until 2106
+    uint32_t text;        // arena offset: name, then description
+    uint32_t descLen;
+    uint16_t nameLen;
+    uint8_t  region    : 2;
+    uint8_t  type      : 3;
+    uint8_t  isPublic  : 1;
+    uint8_t  encrypted : 1;
+};
+static_assert(sizeof(PackedFile) == 40, "PackedFile should stay one 40-byte slot");
+
+class UserFiles {
+private:
+    string arena;
+    size_t garbage{0};   // arena bytes of removed files
+    vector<PackedFile> files;
+
+    // Copies live text to a fresh arena once most of it is garbage.
+    void maybeShrink() {
+        if (garbage < 4096 || garbage * 2 < arena.size()) return;
+        string fresh;
+        fresh.reserve(arena.size() - garbage);
+        for (auto& pf : files) {
+            uint32_t at = (uint32_t)fresh.size();
+            fresh.append(arena, pf.text, size_t(pf.nameLen) + pf.descLen);
+            pf.text = at;
+        }
+        arena.swap(fresh);
+        garbage = 0;
+    }
+
+public:
+    static constexpr size_t MAX_NAME = numeric_limits<uint16_t>::max();
+
+    size_t size() const { return files.size(); }
+    bool empty() const { return files.empty(); }
+    void reserve(size_t count, size_t textBytes) {
+        files.reserve(count);
+        arena.reserve(textBytes);
+    }
+    const PackedFile& at(size_t i) const { return files[i]; }
+    PackedFile& at(size_t i) { return files[i]; }
+
+    int64_t totalBytes() const {
+        int64_t total = 0;
+        for (const auto& pf : files) total += pf.sizeBytes;
+        return total;
+    }
+
+    string_view name(const PackedFile& pf) const { return string_view(arena).substr(pf.text, pf.nameLen); }
+    string_view description(const PackedFile& pf) const {
+        return string_view(arena).substr(pf.text + pf.nameLen, pf.descLen);
+    }
+
+    // Names are capped at MAX_NAME bytes and the arena at 4 GiB.
+    bool fits(const FileRecord& fr) const {
+        return fr.name.size() <= MAX_NAME &&
+               arena.size() + fr.name.size() + fr.description.size() <= numeric_limits<uint32_t>::max();
+    }
+
+    // Requires fits(fr).
+    void push(const FileRecord& fr) {
+        PackedFile pf{};
+        pf.id = fr.id;
+        pf.uploaded = (uint32_t)clamp<int64_t>(fr.uploaded, 0, numeric_limits<uint32_t>::max());
+        pf.sizeBytes = fr.sizeBytes;
+        pf.text = (uint32_t)arena.size();
+        pf.nameLen = (uint16_t)fr.name.size();
+        pf.descLen = (uint32_t)fr.description.size();
+        pf.region = (uint8_t)fr.region;
+        pf.type = (uint8_t)fr.type;
+        pf.isPublic = fr.isPublic;
+        pf.encrypted = fr.encryptedAtRest;
+        arena += fr.name;
+        arena += fr.description;
+        files.push_back(pf);
+    }
+
+    void unpack(size_t i, const string& owner, FileRecord& out) const {
+        const PackedFile& pf = files[i];
+        out.id = pf.id;
+        out.name.assign(name(pf));
+        out.owner = owner;
+        out.region = static_cast<Region>(pf.region);
+        out.type = static_cast<FileType>(pf.type);
+        out.uploaded = (time_t)pf.uploaded;
+        out.sizeBytes = pf.sizeBytes;
+        out.description.assign(description(pf));
+        out.isPublic = pf.isPublic;
+        out.encryptedAtRest = pf.encrypted;
+    }
+
+    FileRecord unpack(size_t i, const string& owner) const {
+        FileRecord fr;
+        unpack(i, owner, fr);
+        return fr;
+    }
+
+    // Swap-and-pop; returns true when the last file moved into slot i.
+    bool erase(size_t i) {
+        garbage += size_t(files[i].nameLen) + files[i].descLen;
+        bool moved = i + 1 != files.size();
+        if (moved) files[i] = files.back();
+        files.pop_back();
+        if (files.empty()) {
+            string().swap(arena);
+            garbage = 0;
+        } else {
+            maybeShrink();
+        }
+        return moved;
+    }
+};
+
+// ================== FileRepository ==================
+// Files are partitioned by region. Each region shard has its own directory,
+// DATA_DIR/<region>/, with one log per user who has files there, its own
+// owner shards and search indexes, and one I/O thread that performs every
+// write to that directory (see RegionLog). A busy or slow region never
+// holds up writers in another, and regions on separate disks sync in
+// parallel. Changes route by FileRecord::region, which never changes;
+// lookups by id go through the id index, which records the region.
+//
+// Within a region, lists are split over owner shards and the id index
+// over id shards, each behind a shared_mutex. Reads take shared locks and
+// return copies. A change to a user's files is appended to their log
+// first and then applied under that user's owner shard (in the file's
+// region), held exclusively only for the in-memory update, so readers
+// never wait on a sync. Memory and log see one file's changes in the same
+// order because the engine's per-user lock serializes them; addFile runs
+// outside that lock, which is safe because its id is brand new and no
+// other change can name it until it is applied. Index entries of a user's
+// files only change under that owner shard; an id shard's own lock covers
+// just its map.
+// Lock order: global search / public catalog, then owner shard, then id
+// shard. Writers release the owner shard before touching the first two.
+//
+// Queries over one user's files visit the regions in turn: the lists are
+// small and waking threads would cost more than the scan. Whole-repository
+// scans (loading, usage totals, catalog rebuilds) run one thread per region.
+
+// A region's log directory and the thread that writes it. Callers queue
+// appends and wait; whatever queued up while the thread was busy goes out
+// as one batch with one sync (fdatasync for a single log, syncfs for
+// several), so concurrent writers in a region share the cost. Log
+// compaction and whole-log rewrites run on the same thread.
+class RegionLog {
+public:
+    // Per-user log size. Its mutex covers reads and rewrites of the file.
+    struct LogState {
+        mutex    mtx;
+        uint64_t bytes{0};
+        size_t   entries{0};   // lines in the log
+        size_t   live{0};      // records they resolve to
+        bool     compacting{false};
+    };
+
+private:
+    enum class Kind { APPEND, REPLACE };
+
+    struct Done {
+        bool finished{false};
+        bool ok{false};
+    };
+
+    struct Task {
+        Kind   kind;
+        string username;
+        string data;        // entry to append, or the whole new log
+        long   live;        // APPEND: change in live records; REPLACE: live records
+        Done*  done;
+    };
+
+    string dir;
+
+    mutex statesMtx;
+    unordered_map<string, unique_ptr<LogState>> states;
+
+    mutex mtx;                      // everything below
+    condition_variable workCv;      // wakes the I/O thread
+    condition_variable doneCv;      // wakes waiting callers
+    vector<Task> pending;
+    deque<string> compactQueue;
+    uint64_t syncsWanted{0};
+    uint64_t syncsDone{0};
+    bool     syncOk{true};
+    bool     stopping{false};
+    atomic<bool> deferSync{false};
+    unordered_set<string> unsynced; // I/O thread only
+    thread   worker;
+
+    bool run(Task task) {
+        Done done;
+        task.done = &done;
+        unique_lock<mutex> lk(mtx);
+        pending.push_back(std::move(task));
+        workCv.notify_one();
+        doneCv.wait(lk, [&] { return done.finished; });
+        return done.ok;
+    }
+
+    // Writes a batch, then syncs what it appended once.
+    void writeBatch(vector<Task>& batch, vector<char>& results) {
+        Metrics::Timer timer(Metrics::Op::REGION_LOG_BATCH);
+        bool deferred = deferSync.load(memory_order_relaxed);
+        vector<string> appended;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            Task& t = batch[i];
+            LogState& st = stateOf(t.username);
+            lock_guard<mutex> lk(st.mtx);
+            if (t.kind == Kind::REPLACE) {
+                results[i] = writeFileAtomic(path(t.username), t.data);
+                if (results[i]) {
+                    st.bytes = t.data.size();
+                    st.entries = st.live = size_t(t.live);
+                }
+                continue;
+            }
+            int fd = ::open(path(t.username).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            results[i] = fd >= 0 && writeAllFd(fd, t.data.data(), t.data.size());
+            if (fd >= 0) ::close(fd);
+            if (!results[i]) continue;
+            st.bytes += t.data.size();
+            st.entries += 1;
+            st.live = size_t(long(st.live) + t.live);
+            if (deferred) unsynced.insert(t.username);
+            else appended.push_back(t.username);
+        }
+        if (!appended.empty() && !syncLogs(appended))
+            for (size_t i = 0; i < batch.size(); ++i)
+                if (batch[i].kind == Kind::APPEND) results[i] = false;
+    }
+
+    template <typename Names>
+    bool syncLogs(const Names& names) {
+        if (names.size() != 1) return syncFileSystem(dir);
+        int fd = ::open(path(*names.begin()).c_str(), O_WRONLY | O_CLOEXEC);
+        bool ok = fd >= 0 && syncFd(fd) == 0;
+        if (fd >= 0) ::close(fd);
+        return ok;
+    }
+
+    // Rewrites the log as its live records. This thread is the only
+    // writer, so nothing can be appended meanwhile.
+    bool compactOne(const string& username) {
+        string p = path(username);
+        LogState& st = stateOf(username);
+        lock_guard<mutex> lk(st.mtx);
+        string data;
+        if (!readFile(p, data)) return false;
+        vector<FileRecord> live;
+        auto res = FileCatalog::parse(data, live);
+        string snapshot;
+        for (const auto& fr : live) FileCatalog::appendRecord(snapshot, fr);
+        snapshot.append(data, res.bytes, string::npos);   // torn tail, if any, stays torn
+        if (!writeFileAtomic(p, snapshot)) return false;
+        st.bytes = snapshot.size();
+        st.entries = st.live = live.size();
+        return true;
+    }
+
+    void loop() {
+        vector<Task> batch;
+        vector<char> results;
+        unique_lock<mutex> lk(mtx);
+        while (true) {
+            workCv.wait(lk, [&] {
+                return stopping || !pending.empty() || !compactQueue.empty() || syncsWanted > syncsDone;
+            });
+            if (!pending.empty()) {
+                batch.swap(pending);
+                lk.unlock();
+                results.assign(batch.size(), false);
+                writeBatch(batch, results);
+                lk.lock();
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    batch[i].done->ok = results[i];
+                    batch[i].done->finished = true;
+                }
+                batch.clear();
+                doneCv.notify_all();
+            } else if (syncsWanted > syncsDone) {
+                uint64_t wanted = syncsWanted;
+                unordered_set<string> names;
+                names.swap(unsynced);
+                lk.unlock();
+                bool ok = names.empty() || syncLogs(names);
+                lk.lock();
+                syncsDone = wanted;
+                syncOk = ok;
+                doneCv.notify_all();
+            } else if (!compactQueue.empty()) {
+                string username = std::move(compactQueue.front());
+                compactQueue.pop_front();
+                lk.unlock();
+                compactOne(username);
+                {
+                    LogState& st = stateOf(username);
+                    lock_guard<mutex> sl(st.mtx);
+                    st.compacting = false;
+                }
+                lk.lock();
+            } else {
+                break;   // stopping, and nothing left to do
+            }
+        }
+    }
+
+public:
+    explicit RegionLog(string directory) : dir(std::move(directory)) {
+        fs::create_directories(dir);
+        worker = thread([this] { loop(); });
+    }
+
+    RegionLog(const RegionLog&) = delete;
+    RegionLog& operator=(const RegionLog&) = delete;
+
+    // Finishes queued writes; pending compactions are dropped.
+    ~RegionLog() {
+        {
+            lock_guard<mutex> lk(mtx);
+            stopping = true;
+            compactQueue.clear();
+        }
+        workCv.notify_one();
+        worker.join();
+    }
+
+    const string& directory() const { return dir; }
+    string path(const string& username) const { return dir + username + ".dat"; }
+
+    LogState& stateOf(const string& username) {
+        lock_guard<mutex> lk(statesMtx);
+        auto& st = states[username];
+        if (!st) st = make_unique<LogState>();
+        return *st;
+    }
+
+    void trackLoaded(const string& username, const FileCatalog::ReplayResult& res, size_t live) {
+        LogState& st = stateOf(username);
+        lock_guard<mutex> lk(st.mtx);
+        st.bytes = res.bytes;
+        st.entries = res.lines;
+        st.live = live;
+    }
+
+    // Appends entry to the user's log; returns once it is written (and,
+    // unless deferred, synced).
+    bool append(const string& username, string entry, long liveDelta) {
+        return run(Task{Kind::APPEND, username, std::move(entry), liveDelta, nullptr});
+    }
+
+    // Replaces the user's log with data, holding `live` records.
+    bool replace(const string& username, string data, size_t live) {
+        return run(Task{Kind::REPLACE, username, std::move(data), long(live), nullptr});
+    }
+
+    // Queues a compaction once enough of the user's log is dead.
+    void maybeCompact(const string& username) {
+        LogState& st = stateOf(username);
+        {
+            lock_guard<mutex> lk(st.mtx);
+            if (st.compacting || st.entries < Config::FILE_LOG_COMPACT_MIN_ENTRIES) return;
+            if (double(st.entries - st.live) < Config::FILE_LOG_COMPACT_DEAD_RATIO * st.entries) return;
+            st.compacting = true;
+        }
+        lock_guard<mutex> lk(mtx);
+        compactQueue.push_back(username);
+        workCv.notify_one();
+    }
+
+    // While deferred, appends skip the sync until flush.
+    void setDeferredSync(bool on) { deferSync = on; }
+
+    // Asks the I/O thread to sync the logs appended to since the last
+    // flush; waitFlush() returns its result. Split so that all regions
+    // can flush at once.
+    uint64_t requestFlush() {
+        lock_guard<mutex> lk(mtx);
+        workCv.notify_one();
+        return ++syncsWanted;
+    }
+
+    bool waitFlush(uint64_t ticket) {
+        unique_lock<mutex> lk(mtx);
+        doneCv.wait(lk, [&] { return syncsDone >= ticket; });
+        return syncOk;
+    }
+};
+
+class FileRepository {
+private:
+    static constexpr size_t REGIONS      = (size_t)Region::GLOBAL + 1;
+    static constexpr size_t OWNER_SHARDS = 16;   // per region
+    static constexpr size_t ID_SHARDS    = 64;
+
+    struct alignas(64) OwnerShard {
+        mutable shared_mutex mtx;
+        unordered_map<string, UserFiles> files;
+        // Search indexes, built on a user's first search and kept up to date after
+        unordered_map<string, TrigramIndex> search;
+    };
+
+    struct RegionShard {
+        array<OwnerShard, OWNER_SHARDS> lists;
+        RegionLog log;
+
+        explicit RegionShard(Region r) : log(regionDir(r)) {}
+    };
+
+    // File id -> region, owner's list there and position in it. Deletes
+    // move the last file into the freed slot, so list order is not preserved.
+    struct FileLoc {
+        uint32_t owner;        // OwnerNames id
+        uint32_t slot   : 30;
+        uint32_t region : 2;
+    };
+    struct alignas(64) IdShard {
+        mutable shared_mutex mtx;
+        unordered_map<FileId, FileLoc> locs;
+    };
+
+    array<unique_ptr<RegionShard>, REGIONS> regions;
+    array<IdShard, ID_SHARDS> idShards;
+    OwnerNames owners;
+
+    mutable mutex globalMtx;
+    TrigramIndex globalSearch;
+    bool globalSearchBuilt{false};
+
+    mutable shared_mutex publicMtx;
+    PublicCatalog publicCatalog;
+
+    static string regionDir(Region r) { return Config::DATA_DIR + regionSlug(r) + "/"; }
+
+    RegionShard& region(Region r) { return *regions[(size_t)r]; }
+    const RegionShard& region(Region r) const { return *regions[(size_t)r]; }
+
+    OwnerShard& ownerShard(Region r, const string& username) {
+        return region(r).lists[hash<string>()(username) % OWNER_SHARDS];
+    }
+    const OwnerShard& ownerShard(Region r, const string& username) const {
+        return region(r).lists[hash<string>()(username) % OWNER_SHARDS];
+    }
+    IdShard& idShard(const FileId& id) {
+        return idShards[hash<FileId>()(id) % ID_SHARDS];
+    }
+    const IdShard& idShard(const FileId& id) const {
+        return idShards[hash<FileId>()(id) % ID_SHARDS];
+    }
+
+    // Runs fn(region) for every region, one thread each.
+    template <typename Fn>
+    static void fanOut(Fn fn) {
+        vector<thread> helpers;
+        for (size_t r = 1; r < REGIONS; ++r) helpers.emplace_back([&fn, r] { fn(static_cast<Region>(r)); });
+        fn(static_cast<Region>(0));
+        for (auto& t : helpers) t.join();
+    }
+
+    bool findLoc(const FileId& id, FileLoc& out) const {
+        const IdShard& s = idShard(id);
+        shared_lock<shared_mutex> lk(s.mtx);
+        auto it = s.locs.find(id);
+        if (it == s.locs.end()) return false;
+        out = it->second;
+        return true;
+    }
+
+    void setLoc(const FileId& id, FileLoc loc) {
+        IdShard& s = idShard(id);
+        lock_guard<shared_mutex> lk(s.mtx);
+        s.locs[id] = loc;
+    }
+
+    void eraseLoc(const FileId& id) {
+        IdShard& s = idShard(id);
+        lock_guard<shared_mutex> lk(s.mtx);
+        s.locs.erase(id);
+    }
+
+    // The list holding the file and its slot there. Callers hold the owner shard.
+    const UserFiles* listAt(const OwnerShard& shard, const FileId& id, uint32_t& slot) const {
+        FileLoc loc;
+        if (!findLoc(id, loc)) return nullptr;
+        auto it = shard.files.find(owners.name(loc.owner));
+        if (it == shard.files.end() || loc.slot >= it->second.size()) return nullptr;
+        slot = loc.slot;
+        return &it->second;
+    }
+
+    void indexList(Region r, uint32_t owner, const UserFiles& list) {
+        for (size_t i = 0; i < list.size(); ++i) setLoc(list.at(i).id, FileLoc{owner, (uint32_t)i, (uint32_t)r});
+    }
+
+    void unindexList(const UserFiles& list) {
+        for (size_t i = 0; i < list.size(); ++i) eraseLoc(list.at(i).id);
+    }
+
+    static void indexText(TrigramIndex& index, const UserFiles& list, size_t i) {
+        const PackedFile& pf = list.at(i);
+        index.insert(pf.id, list.name(pf), list.description(pf));
+    }
+
+    // Packs freshly parsed records; names past the 64 KiB cap are cut.
+    static UserFiles packAll(vector<FileRecord>& records) {
+        size_t text = 0;
+        for (auto& fr : records) {
+            if (fr.name.size() > UserFiles::MAX_NAME) fr.name.resize(UserFiles::MAX_NAME);
+            text += fr.name.size() + fr.description.size();
+        }
+        UserFiles list;
+        list.reserve(records.size(), text);
+        for (const auto& fr : records)
+            if (list.fits(fr)) list.push(fr);
+        return list;
+    }
+
+    // Visits every list in one region under its shard's shared lock.
+    template <typename Fn>
+    void forEachListIn(Region r, Fn fn) const {
+        for (const auto& shard : region(r).lists) {
+            shared_lock<shared_mutex> lk(shard.mtx);
+            for (const auto& [user, list] : shard.files) fn(user, list);
+        }
+    }
+
+    template <typename Fn>
+    void forEachList(Fn fn) const {
+        for (size_t r = 0; r < REGIONS; ++r) forEachListIn(static_cast<Region>(r), fn);
+    }
+
+    // Splits catalogs from before region shards (DATA_DIR/<user>.dat) into
+    // the region directories, then renames them *.dat.migrated. A crash
+    // midway repeats the split from the untouched originals.
+    void migrateLegacyLogs() {
+        error_code ec;
+        for (const auto& entry : fs::directory_iterator(Config::DATA_DIR, ec)) {
+            if (!entry.is_regular_file() || entry.path().extension() != ".dat") continue;
+            string path = entry.path().string(), user = entry.path().stem().string(), data;
+            if (!readFile(path, data)) continue;
+            vector<FileRecord> records;
+            FileCatalog::parse(data, records);
+            array<string, REGIONS> split;
+            for (const auto& fr : records) FileCatalog::appendRecord(split[(size_t)fr.region], fr);
+            bool ok = true;
+            for (size_t r = 0; r < REGIONS && ok; ++r)
+                if (!split[r].empty()) ok = writeFileAtomic(region(static_cast<Region>(r)).log.path(user), split[r]);
+            if (ok) fs::rename(path, path + ".migrated", ec);
+        }
+    }
+
+    void globalAdded(const FileRecord& fr) {
+        lock_guard<mutex> lk(globalMtx);
+        if (globalSearchBuilt) globalSearch.insert(fr);
+    }
+
+    void globalRemoved(const FileId& id) {
+        lock_guard<mutex> lk(globalMtx);
+        if (globalSearchBuilt) globalSearch.erase(id);
+    }
+
+public:
+    FileRepository() {
+        fs::create_directories(Config::DATA_DIR);
+        for (size_t r = 0; r < REGIONS; ++r) regions[r] = make_unique<RegionShard>(static_cast<Region>(r));
+        migrateLegacyLogs();
+    }
+
+    // Lets a batch of changes share one sync per region.
+    void setDeferredSync(bool on) {
+        for (auto& r : regions) r->log.setDeferredSync(on);
+        lock_guard<shared_mutex> lk(publicMtx);
+        publicCatalog.setDeferredSync(on);
+    }
+
+    // Syncs every log appended to since the last flush, all regions at once.
+    bool flush() {
+        array<uint64_t, REGIONS> tickets;
+        for (size_t r = 0; r < REGIONS; ++r) tickets[r] = regions[r]->log.requestFlush();
+        bool ok = true;
+        for (size_t r = 0; r < REGIONS; ++r) ok = regions[r]->log.waitFlush(tickets[r]) && ok;
+        lock_guard<shared_mutex> lk(publicMtx);
+        return publicCatalog.flush() && ok;
+    }
+
+    // Copy of the user's files, region by region.
+    vector<FileRecord> filesOf(const string& username) const {
+        vector<FileRecord> out;
+        for (size_t r = 0; r < REGIONS; ++r) {
+            const OwnerShard& shard = ownerShard(static_cast<Region>(r), username);
+            shared_lock<shared_mutex> lk(shard.mtx);
+            auto it = shard.files.find(username);
+            if (it == shard.files.end()) continue;
+            size_t at = out.size();
+            out.resize(at + it->second.size());
+            for (size_t i = 0; i < it->second.size(); ++i) it->second.unpack(i, username, out[at + i]);
+        }
+        return out;
+    }
+
+    // Calls fn(owner, total bytes) for every owner with files; the regions
+    // are summed in parallel.
+    template <typename Fn>
+    void forEachOwnerBytes(Fn fn) const {
+        array<unordered_map<string, int64_t>, REGIONS> partial;
+        fanOut([&](Region r) {
+            forEachListIn(r, [&](const string& owner, const UserFiles& list) {
+                partial[(size_t)r][owner] += list.totalBytes();
+            });
+        });
+        for (size_t r = 1; r < REGIONS; ++r)
+            for (const auto& [owner, bytes] : partial[r]) partial[0][owner] += bytes;
+        for (const auto& [owner, bytes] : partial[0]) fn(owner, bytes);
+    }
+
+    // Calls fn(record) for every file in region r, one owner shard at a time.
+    template <typename Fn>
+    void forEachFileIn(Region r, Fn fn) const {
+        FileRecord fr;
+        forEachListIn(r, [&](const string& owner, const UserFiles& list) {
+            for (size_t i = 0; i < list.size(); ++i) {
+                list.unpack(i, owner, fr);
+                fn(fr);
+            }
+        });
+    }
+
+    int64_t bytesOf(const string& username) const {
+        int64_t total = 0;
+        for (size_t r = 0; r < REGIONS; ++r) {
+            const OwnerShard& shard = ownerShard(static_cast<Region>(r), username);
+            shared_lock<shared_mutex> lk(shard.mtx);
+            auto it = shard.files.find(username);
+            if (it != shard.files.end()) total += it->second.totalBytes();
+        }
+        return total;
+    }
+
+    bool contains(const FileId& id) const {
+        FileLoc loc;
+        return findLoc(id, loc);
+    }
+
+    size_t fileCount(const string& username) const {
+        size_t n = 0;
+        for (size_t r = 0; r < REGIONS; ++r) {
+            const OwnerShard& shard = ownerShard(static_cast<Region>(r), username);
+            shared_lock<shared_mutex> lk(shard.mtx);
+            auto it = shard.files.find(username);
+            if (it != shard.files.end()) n += it->second.size();
+        }
+        return n;
+    }
+
+    optional<FileRecord> getFile(const FileId& id) const {
+        FileLoc loc;
+        if (!findLoc(id, loc)) return nullopt;
+        const string& owner = owners.name(loc.owner);
+        const OwnerShard& shard = ownerShard(static_cast<Region>(loc.region), owner);
+        shared_lock<shared_mutex> lk(shard.mtx);
+        uint32_t slot;
+        const UserFiles* list = listAt(shard, id, slot);
+        if (!list) return nullopt;
+        return list->unpack(slot, owner);
+    }
+
+    // Adds a file to the user's list in its region and appends it to their
+    // log there.
+    bool addFile(const string& username, const FileRecord& fr) {
+        Metrics::Timer timer(Metrics::Op::FILE_ADD);
+        FileLoc existing;
+        if (findLoc(fr.id, existing)) return false;
+        uint32_t owner = owners.intern(username);
+        OwnerShard& shard = ownerShard(fr.region, username);
+        RegionLog& log = region(fr.region).log;
+        {
+            shared_lock<shared_mutex> lk(shard.mtx);
+            auto it = shard.files.find(username);
+            if (it != shard.files.end() && !it->second.fits(fr)) return false;
+        }
+        string entry;
+        FileCatalog::appendRecord(entry, fr);
+        if (!log.append(username, std::move(entry), +1)) return false;
+        bool fits;
+        {
+            lock_guard<shared_mutex> lk(shard.mtx);
+            auto& list = shard.files[username];
+            fits = list.fits(fr);   // a concurrent add may have filled it
+            if (fits) {
+                setLoc(fr.id, FileLoc{owner, (uint32_t)list.size(), (uint32_t)fr.region});
+                list.push(fr);
+                auto idx = shard.search.find(username);
+                if (idx != shard.search.end()) idx->second.insert(fr);
+            }
+        }
+        if (!fits) {
+            string undo;
+            FileCatalog::appendTombstone(undo, fr.id);
+            log.append(username, std::move(undo), -1);
+            return false;
+        }
+        globalAdded(fr);
+        if (fr.isPublic) {
+            lock_guard<shared_mutex> lk(publicMtx);
+            (void)publicCatalog.put(fr);   // a missed line is repaired at open
+        }
+        return true;
+    }
+
+    // Changes a file's visibility and records the updated file in the log.
+    bool setPublic(const FileId& id, bool isPublic) {
+        Metrics::Timer timer(Metrics::Op::FILE_SET_PUBLIC);
+        FileLoc loc;
+        if (!findLoc(id, loc)) return false;
+        const string& owner = owners.name(loc.owner);
+        RegionShard& rs = region(static_cast<Region>(loc.region));
+        OwnerShard& shard = ownerShard(static_cast<Region>(loc.region), owner);
+        FileRecord updated;
+        uint32_t slot;
+        {
+            shared_lock<shared_mutex> lk(shard.mtx);
+            const UserFiles* list = listAt(shard, id, slot);
+            if (!list) return false;
+            if (list->at(slot).isPublic == isPublic) return true;
+            list->unpack(slot, owner, updated);
+        }
+        updated.isPublic = isPublic;
+        string entry;
+        FileCatalog::appendRecord(entry, updated);
+        if (!rs.log.append(owner, std::move(entry), 0)) return false;
+        {
+            lock_guard<shared_mutex> lk(shard.mtx);
+            UserFiles* list = const_cast<UserFiles*>(listAt(shard, id, slot));
+            if (list) list->at(slot).isPublic = isPublic;
+        }
+        {
+            lock_guard<shared_mutex> lk(publicMtx);
+            (void)(isPublic ? publicCatalog.put(updated) : publicCatalog.remove(id));
+        }
+        rs.log.maybeCompact(owner);
+        return true;
+    }
+
+    // Loads the public catalog and checks it against the loaded files; it
+    // is rebuilt when missing or when a crash left it behind the user logs.
+    bool openPublicCatalog() {
+        lock_guard<shared_mutex> lk(publicMtx);
+        bool opened = publicCatalog.open(Config::PUBLIC_CATALOG_FILE);
+        array<unordered_map<string, vector<FileRecord>>, REGIONS> found;
+        fanOut([&](Region r) {
+            forEachListIn(r, [&](const string& user, const UserFiles& list) {
+                for (size_t i = 0; i < list.size(); ++i)
+                    if (list.at(i).isPublic) found[(size_t)r][user].push_back(list.unpack(i, user));
+            });
+        });
+        unordered_map<string, vector<FileRecord>> publicFiles = std::move(found[0]);
+        for (size_t r = 1; r < REGIONS; ++r)
+            for (auto& [user, files] : found[r]) {
+                auto& into = publicFiles[user];
+                into.insert(into.end(), make_move_iterator(files.begin()), make_move_iterator(files.end()));
+            }
+        if (opened && publicCatalog.matches(publicFiles)) return true;
+        return publicCatalog.rebuild(publicFiles);
+    }
+
+    PublicCatalog::Page publicPage(PublicCatalog::Order order, const PublicCatalog::Cursor& after,
+                                   size_t limit) const {
+        Metrics::Timer timer(Metrics::Op::PUBLIC_PAGE);
+        shared_lock<shared_mutex> lk(publicMtx);
+        return publicCatalog.page(order, after, limit);
+    }
+
+    size_t publicCount() const {
+        shared_lock<shared_mutex> lk(publicMtx);
+        return publicCatalog.size();
+    }
+
+    // The user's files whose name or description contains term (any case).
+    vector<FileRecord> search(const string& username, const string& term) {
+        vector<FileRecord> out;
+        for (size_t r = 0; r < REGIONS; ++r) {
+            OwnerShard& shard = ownerShard(static_cast<Region>(r), username);
+            auto collect = [&](const TrigramIndex& index) {
+                uint32_t slot;
+                for (const FileId& id : index.search(term))
+                    if (const UserFiles* list = listAt(shard, id, slot)) out.push_back(list->unpack(slot, username));
+            };
+            {
+                shared_lock<shared_mutex> lk(shard.mtx);
+                auto it = shard.search.find(username);
+                if (it != shard.search.end()) {
+                    collect(it->second);
+                    continue;
+                }
+                if (shard.files.find(username) == shard.files.end()) continue;
+            }
+            lock_guard<shared_mutex> lk(shard.mtx);
+            auto [it, fresh] = shard.search.try_emplace(username);
+            if (fresh) {
+                auto files = shard.files.find(username);
+                if (files != shard.files.end())
+                    for (size_t i = 0; i < files->second.size(); ++i) indexText(it->second, files->second, i);
+            }
+            collect(it->second);
+        }
+        return out;
+    }
+
+    // Same over every user's files; only with SEARCH_GLOBAL_INDEX.
+    vector<FileRecord> searchAll(const string& term) {
+        if (!Config::SEARCH_GLOBAL_INDEX) return {};
+        lock_guard<mutex> lk(globalMtx);
+        if (!globalSearchBuilt) {
+            forEachList([&](const string&, const UserFiles& list) {
+                for (size_t i = 0; i < list.size(); ++i) indexText(globalSearch, list, i);
+            });
+            globalSearchBuilt = true;
+        }
+        vector<FileRecord> out;
+        for (const FileId& id : globalSearch.search(term))
+            if (auto fr = getFile(id)) out.push_back(std::move(*fr));
+        return out;
+    }
+
+    // Removes the file from its owner's list and appends a tombstone for it.
+    bool deleteFile(const FileId& id) {
+        Metrics::Timer timer(Metrics::Op::FILE_DELETE);
+        FileLoc loc;
+        if (!findLoc(id, loc)) return false;
+        const string& owner = owners.name(loc.owner);
+        Region r = static_cast<Region>(loc.region);
+        string entry;
+        FileCatalog::appendTombstone(entry, id);
+        if (!region(r).log.append(owner, std::move(entry), -1)) return false;
+        {
+            OwnerShard& shard = ownerShard(r, owner);
+            lock_guard<shared_mutex> lk(shard.mtx);
+            if (!findLoc(id, loc)) return false;   // deleted meanwhile
+
+            auto& list = shard.files.find(owner)->second;
+            if (list.erase(loc.slot)) setLoc(list.at(loc.slot).id, FileLoc{loc.owner, loc.slot, loc.region});
+            eraseLoc(id);
+            auto idx = shard.search.find(owner);
+            if (idx != shard.search.end()) idx->second.erase(id);
+        }
+        globalRemoved(id);
+        {
+            lock_guard<shared_mutex> lk(publicMtx);
+            (void)publicCatalog.remove(id);
+        }
+        region(r).log.maybeCompact(owner);
+        return true;
+    }
+
+    // Rewrites the user's logs as just their live records. Not safe
+    // alongside changes to the user's files.
+    bool saveUserFiles(const string& username) {
+        Metrics::Timer timer(Metrics::Op::FILE_SAVE);
+        bool ok = true;
+        for (size_t r = 0; r < REGIONS; ++r) {
+            RegionShard& rs = *regions[r];
+            OwnerShard& shard = ownerShard(static_cast<Region>(r), username);
+            lock_guard<shared_mutex> lk(shard.mtx);
+            auto it = shard.files.find(username);
+            if (it == shard.files.end()) continue;
+            string data;
+            FileRecord fr;
+            for (size_t i = 0; i < it->second.size(); ++i) {
+                it->second.unpack(i, username, fr);
+                FileCatalog::appendRecord(data, fr);
+            }
+            ok = rs.log.replace(username, std::move(data), it->second.size()) && ok;
+        }
+        return ok;
+    }
+
+    // Reloads the user's lists from their logs. Each region's list is
+    // replaced under its owner shard, so no change can slip in between
+    // reading the log and installing what it holds.
+    bool loadUserFiles(const string& username) {
+        Metrics::Timer timer(Metrics::Op::FILE_LOAD);
+        uint32_t owner = owners.intern(username);
+        bool ok = true, changed = false;
+        for (size_t r = 0; r < REGIONS; ++r) {
+            Region reg = static_cast<Region>(r);
+            RegionLog& log = region(reg).log;
+            string path = log.path(username);
+            OwnerShard& shard = ownerShard(reg, username);
+            lock_guard<shared_mutex> lk(shard.mtx);
+            string data;
+            vector<FileRecord> loaded;
+            FileCatalog::ReplayResult res;
+            {
+                RegionLog::LogState& st = log.stateOf(username);
+                lock_guard<mutex> sl(st.mtx);
+                if (!readFile(path, data)) continue;
+                res = FileCatalog::parse(data, loaded);
+                if (res.bytes < data.size() && ::truncate(path.c_str(), (off_t)res.bytes) != 0) ok = false;
+            }
+            auto it = shard.files.try_emplace(username).first;
+            unindexList(it->second);
+            it->second = packAll(loaded);
+            indexList(reg, owner, it->second);
+            shard.search.erase(username);
+            log.trackLoaded(username, res, it->second.size());
+            changed = true;
+        }
+        if (changed) {
+            lock_guard<mutex> lk(globalMtx);
+            globalSearchBuilt = false;
+            globalSearch.clear();
+        }
+        return ok;
+    }
+
+    // Loads every region's catalogs on a pool of worker threads. Lists
+    // already in memory are kept. Returns the number of users added.
+    size_t loadAll(unsigned threads = Config::FILE_LOADER_THREADS) {
+        struct Pending {
+            Region r;
+            fs::path path;
+        };
+        vector<Pending> paths;
+        for (size_t r = 0; r < REGIONS; ++r) {
+            Region reg = static_cast<Region>(r);
+            error_code ec;
+            for (const auto& entry : fs::directory_iterator(region(reg).log.directory(), ec)) {
+                if (entry.path().extension() != ".dat") continue;
+                string user = entry.path().stem().string();
+                const OwnerShard& shard = ownerShard(reg, user);
+                shared_lock<shared_mutex> lk(shard.mtx);
+                if (shard.files.count(user)) continue;
+                paths.push_back(Pending{reg, entry.path()});
+            }
+        }
+        if (paths.empty()) return 0;
+
+        if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+        threads = (unsigned)min<size_t>(threads, paths.size());
+
+        vector<UserFiles> loaded(paths.size());
+        vector<uint32_t> ownerIds(paths.size());
+        vector<FileCatalog::ReplayResult> replay(paths.size());
+        atomic<size_t> next{0};
+        auto worker = [&] {
+            string buf;                 // reused across files
+            vector<FileRecord> records;
+            for (size_t i; (i = next.fetch_add(1, memory_order_relaxed)) < paths.size();) {
+                string path = paths[i].path.string();
+                if (!readFile(path, buf)) continue;
+                records.clear();
+                replay[i] = FileCatalog::parse(buf, records);
+                if (replay[i].bytes < buf.size()) (void)::truncate(path.c_str(), (off_t)replay[i].bytes);
+                ownerIds[i] = owners.intern(paths[i].path.stem().string());
+                loaded[i] = packAll(records);
+            }
+        };
+        vector<thread> pool;
+        for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+        worker();
+        for (auto& t : pool) t.join();
+
+        unordered_set<string> added;
+        bool global;
+        {
+            lock_guard<mutex> lk(globalMtx);
+            global = globalSearchBuilt;
+        }
+        for (size_t i = 0; i < paths.size(); ++i) {
+            Region reg = paths[i].r;
+            string username = paths[i].path.stem().string();
+            vector<FileRecord> forGlobal;
+            {
+                OwnerShard& shard = ownerShard(reg, username);
+                lock_guard<shared_mutex> lk(shard.mtx);
+                auto [it, fresh] = shard.files.try_emplace(username);
+                if (!fresh) continue;   // loaded by someone else meanwhile
+                it->second = std::move(loaded[i]);
+                indexList(reg, ownerIds[i], it->second);
+                region(reg).log.trackLoaded(it->first, replay[i], it->second.size());
+                if (global)
+                    for (size_t f = 0; f < it->second.size(); ++f) forGlobal.push_back(it->second.unpack(f, it->first));
+                added.insert(std::move(username));
+            }
+            for (const auto& fr : forGlobal) globalAdded(fr);
+        }
+        return added.size();
+    }
+};
+
+// ================== Encryption Keys ==================
+// Encrypted files get a random 256-bit data key each. It is stored wrapped
+// (AES-256-GCM, bound to the file id) under the owner's key-encryption key,
+// HMAC-SHA256(master key, "kek|" + username). The master key is created on
+// first start in MASTER_KEY_FILE, readable by the owner only; without it no
+// encrypted file can be read back.
+class KeyRing {
+public:
+    static constexpr size_t KEY_SIZE     = Aes256Gcm::KEY_SIZE;
+    static constexpr size_t WRAPPED_SIZE = Aes256Gcm::NONCE_SIZE + KEY_SIZE + Aes256Gcm::TAG_SIZE;
+
+    KeyRing() = default;
+    KeyRing(const KeyRing&) = delete;
+    KeyRing& operator=(const KeyRing&) = delete;
+    ~KeyRing() { wipe(master, sizeof(master)); }
+
+    static void wipe(void* p, size_t len) {
+        volatile uint8_t* v = static_cast<volatile uint8_t*>(p);
+        while (len--) *v++ = 0;
+    }
+
+    // Loads the master key, creating it if the file does not exist.
+    bool open(const string& path) {
+        string data;
+        if (readFile(path, data)) {
+            bool ok = data.size() == KEY_SIZE;
+            if (ok) memcpy(master, data.data(), KEY_SIZE);
+            wipe(&data[0], data.size());
+            return ok;
+        }
+        SecureRandom::local().fill(master, sizeof(master));
+        string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) return false;
+        bool ok = writeAllFd(fd, reinterpret_cast<const char*>(master), sizeof(master)) && ::fsync(fd) == 0;
+        ::close(fd);
+        // link() fails if another process created the key in the meantime
+        ok = ok && ::link(tmp.c_str(), path.c_str()) == 0;
+        ::unlink(tmp.c_str());
+        if (!ok) return false;
+        syncDir(parentDir(path));
+        return true;
+    }
+
+    // A key for another purpose (e.g. "session"), bound to the master key.
+    void derive(const string& label, uint8_t out[KEY_SIZE]) const {
+        string msg = "derive|" + label;
+        hmacSha256(master, sizeof(master), msg.data(), msg.size(), out);
+    }
+
+    static void newDataKey(uint8_t dek[KEY_SIZE]) { SecureRandom::local().fill(dek, KEY_SIZE); }
+
+    // nonce | encrypted key | tag
+    string wrap(const string& owner, const FileId& id, const uint8_t dek[KEY_SIZE]) const {
+        string out(WRAPPED_SIZE, '\0');
+        uint8_t* p = reinterpret_cast<uint8_t*>(&out[0]);
+        SecureRandom::local().fill(p, Aes256Gcm::NONCE_SIZE);
+        string aad = id.str();
+        Aes256Gcm kek(KekBytes(*this, owner).key);
+        kek.encrypt(p, reinterpret_cast<const uint8_t*>(aad.data()), aad.size(), dek, KEY_SIZE,
+                    p + Aes256Gcm::NONCE_SIZE, p + Aes256Gcm::NONCE_SIZE + KEY_SIZE);
+        return out;
+    }
+
+    bool unwrap(const string& owner, const FileId& id, const string& wrapped, uint8_t dek[KEY_SIZE]) const {
+        if (wrapped.size() != WRAPPED_SIZE) return false;
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(wrapped.data());
+        string aad = id.str();
+        Aes256Gcm kek(KekBytes(*this, owner).key);
+        return kek.decrypt(p, reinterpret_cast<const uint8_t*>(aad.data()), aad.size(),
+                           p + Aes256Gcm::NONCE_SIZE, KEY_SIZE, p + Aes256Gcm::NONCE_SIZE + KEY_SIZE, dek);
+    }
+
+private:
+    uint8_t master[KEY_SIZE]{};
+
+    // The owner's key-encryption key, wiped when it goes out of scope
+    struct KekBytes {
+        uint8_t key[KEY_SIZE];
+        KekBytes(const KeyRing& ring, const string& owner) {
+            string label = "kek|" + owner;
+            hmacSha256(ring.master, sizeof(ring.master), label.data(), label.size(), key);
+        }
+        ~KekBytes() { wipe(key, sizeof(key)); }
+    };
+};
+
+// ================== Chunk Store ==================
+// File contents, cut into content-defined chunks and stored once per
+// distinct chunk as CHUNK_DIR/<first byte>/<sha256 hex>. Cut points depend
+// only on nearby bytes, so identical content in different files, from any
+// user, produces the same chunks and an edit only changes the chunks
+// around it.
+//
+// CHUNK_DIR/manifests.log maps file ids to their chunks, one line each:
+//   +|id|<sha256 hex>:<len>,<sha256 hex>:<len>,...[|<wrapped key hex>]
+//   -|id
+// Files with a wrapped key are encrypted: each chunk is cut from the
+// plaintext, then sealed with AES-256-GCM under the file's data key (nonce =
+// chunk index, AAD = "last chunk" flag) and stored by the digest of the
+// sealed bytes. Encrypted files therefore only share chunks with themselves.
+// Reference counts are not stored: open() rebuilds them from the live
+// manifests. A new chunk file is written before any manifest names it and
+// is deleted when its count drops to zero, so a crash can only leave
+// unreferenced chunk files behind, which sweep() removes.
+using ChunkDigest = array<uint8_t, SHA256::DIGEST_SIZE>;
+
+struct ChunkDigestHash {
+    size_t operator()(const ChunkDigest& d) const {
+        uint64_t h;
+        memcpy(&h, d.data(), sizeof(h));   // already uniformly distributed
+        return size_t(h);
+    }
+};
+
+struct ChunkRef {
+    ChunkDigest digest;
+    uint32_t    len;
+};
+
+// Gear rolling hash cut points (FastCDC). Cutting needs more zero bits
+// before the average size and fewer after it, which keeps chunk sizes
+// close to the average.
+namespace cdc {
+    constexpr array<uint64_t, 256> makeGear() {
+        array<uint64_t, 256> g{};
+        uint64_t s = 0x6a09e667f3bcc908ull;
+        for (auto& v : g) {            // splitmix64
+            uint64_t z = (s += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            v = z ^ (z >> 31);
+        }
+        return g;
+    }
+    constexpr array<uint64_t, 256> GEAR = makeGear();
+
+    constexpr int log2(size_t v) { return v <= 1 ? 0 : 1 + log2(v >> 1); }
+
+    constexpr size_t MIN = Config::CHUNK_MIN_BYTES;
+    constexpr size_t AVG = Config::CHUNK_AVG_BYTES;
+    constexpr size_t MAX = Config::CHUNK_MAX_BYTES;
+    static_assert((AVG & (AVG - 1)) == 0 && MIN < AVG && AVG < MAX, "chunk size limits");
+
+    // The hash shifts left, so its top bits cover the last 64 bytes.
+    constexpr uint64_t MASK_SMALL = ~0ull << (64 - (log2(AVG) + 2));
+    constexpr uint64_t MASK_LARGE = ~0ull << (64 - (log2(AVG) - 2));
+
+    // Length of the first chunk of p[0, n). Unless p ends the stream, n
+    // must be at least MAX so that every cut point is visible.
+    size_t cut(const uint8_t* p, size_t n) {
+        if (n <= MIN) return n;
+        if (n > MAX) n = MAX;
+        size_t normal = min(AVG, n), i = MIN;
+        uint64_t h = 0;
+        for (; i < normal; ++i) {
+            h = (h << 1) + GEAR[p[i]];
+            if (!(h & MASK_SMALL)) return i + 1;
+        }
+        for (; i < n; ++i) {
+            h = (h << 1) + GEAR[p[i]];
+            if (!(h & MASK_LARGE)) return i + 1;
+        }
+        return n;
+    }
+}
+
+class ChunkStore {
+public:
+    struct Stats {
+        size_t   files{0};
+        size_t   chunks{0};
+        uint64_t storedBytes{0};    // distinct chunks on disk
+        uint64_t logicalBytes{0};   // sum of the files' chunks, before dedup
+    };
+
+    // One upload in progress. write() cuts chunks as data arrives and stores
+    // each one straight away; the chunks stay referenced until the upload is
+    // committed under a file id or dropped.
+    class Upload {
+        friend class ChunkStore;
+        ChunkStore* store;
+        vector<uint8_t> buf;        // bytes past the last cut
+        vector<ChunkRef> chunks;
+        uint64_t total{0};
+        bool needsSync{false};      // holds a chunk no sync has covered yet
+        bool failed{false};
+        unique_ptr<Aes256Gcm> cipher;
+        vector<uint8_t> sealed;
+
+        bool cutChunks(bool final) {
+            size_t off = 0;
+            while (!failed && buf.size() - off >= (final ? 1 : cdc::MAX)) {
+                size_t len = cdc::cut(buf.data() + off, buf.size() - off);
+                const uint8_t* data = buf.data() + off;
+                size_t stored = len;
+                if (cipher) {
+                    uint8_t nonce[Aes256Gcm::NONCE_SIZE];
+                    chunkNonce(chunks.size(), nonce);
+                    uint8_t last = final && off + len == buf.size();
+                    sealed.resize(len + Aes256Gcm::TAG_SIZE);
+                    cipher->encrypt(nonce, &last, 1, data, len, sealed.data(), sealed.data() + len);
+                    data = sealed.data();
+                    stored = sealed.size();
+                }
+                ChunkRef ref;
+                if (!store->acquire(data, stored, ref, needsSync)) failed = true;
+                else chunks.push_back(ref);
+                off += len;
+            }
+            buf.erase(buf.begin(), buf.begin() + off);
+            return !failed;
+        }
+
+    public:
+        explicit Upload(ChunkStore& s) : store(&s) {}
+        Upload(const Upload&) = delete;
+        Upload& operator=(const Upload&) = delete;
+        ~Upload() { abort(); }
+
+        bool write(const void* data, size_t len) {
+            if (failed) return false;
+            const uint8_t* p = static_cast<const uint8_t*>(data);
+            buf.insert(buf.end(), p, p + len);
+            total += len;
+            return buf.size() < cdc::MAX || cutChunks(false);
+        }
+
+        uint64_t size() const { return total; }
+
+        // Encrypts the content under key; call before the first write().
+        void encryptWith(const uint8_t key[Aes256Gcm::KEY_SIZE]) { cipher = make_unique<Aes256Gcm>(key); }
+
+        // Drops the chunks stored so far.
+        void abort() {
+            for (const auto& c : chunks) store->release(c);
+            chunks.clear();
+            buf.clear();
+        }
+    };
+
+private:
+    struct Ref {
+        uint32_t count;
+        uint32_t len;
+        uint64_t written;   // write ticket; 0 for chunks found at open
+    };
+
+    struct Manifest {
+        vector<ChunkRef> chunks;
+        string key;          // wrapped data key; empty if not encrypted
+    };
+
+    string dir;
+    string logPath;
+
+    mutable mutex mtx;   // everything below
+    unordered_map<ChunkDigest, Ref, ChunkDigestHash> refs;
+    unordered_map<FileId, Manifest> manifests;
+    uint64_t storedBytes{0};
+    uint64_t logicalBytes{0};
+    uint64_t chunkWrites{0};    // tickets handed to new chunk files
+    uint64_t syncedUpTo{0};     // chunks with tickets up to this are durable
+    size_t logLines{0};
+    bool deferSync{false};
+    bool unsynced{false};
+
+    // Held while a chunk file is written or removed, by first digest byte
+    array<mutex, 256> chunkLocks;
+
+    string chunkPath(const ChunkDigest& d) const {
+        string p = dir;
+        p.append(HEX_PAIRS.pairs + 2 * d[0], 2);
+        p += '/';
+        p += toHex(d.data(), d.size());
+        return p;
+    }
+
+    static bool parseHex(string_view s, uint8_t* out, size_t len) {
+        if (s.size() != 2 * len) return false;
+        auto nibble = [](char c) {
+            return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        };
+        for (size_t i = 0; i < len; ++i) {
+            int hi = nibble(s[2 * i]), lo = nibble(s[2 * i + 1]);
+            if (hi < 0 || lo < 0) return false;
+            out[i] = uint8_t(hi << 4 | lo);
+        }
+        return true;
+    }
+
+    static bool parseDigest(string_view s, ChunkDigest& out) { return parseHex(s, out.data(), out.size()); }
+
+    static void chunkNonce(uint64_t index, uint8_t nonce[Aes256Gcm::NONCE_SIZE]) {
+        memset(nonce, 0, 4);
+        aesimpl::store64be(nonce + 4, index);
+    }
+
+    static void appendManifest(string& out, const FileId& id, const Manifest& m) {
+        const vector<ChunkRef>& chunks = m.chunks;
+        out += "+|";
+        id.appendTo(out);
+        out += '|';
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            if (i) out += ',';
+            size_t at = out.size();
+            out.resize(at + 2 * chunks[i].digest.size());
+            hexEncode(chunks[i].digest.data(), chunks[i].digest.size(), &out[at]);
+            out += ':';
+            out += to_string(chunks[i].len);
+        }
+        if (!m.key.empty()) {
+            out += '|';
+            out += toHex(reinterpret_cast<const uint8_t*>(m.key.data()), m.key.size());
+        }
+        out += '\n';
+    }
+
+    static bool parseManifest(string_view line, FileId& id, Manifest& m) {
+        string_view idField = FileCatalog::nextField(line);
+        if (line.data() == nullptr || !FileId::parse(idField, id)) return false;
+        string_view keyField = line;
+        line = FileCatalog::nextField(keyField);
+        m.key.assign(keyField.size() / 2, '\0');
+        if (!keyField.empty() && !parseHex(keyField, reinterpret_cast<uint8_t*>(&m.key[0]), m.key.size()))
+            return false;
+        vector<ChunkRef>& chunks = m.chunks;
+        chunks.clear();
+        while (!line.empty()) {
+            size_t comma = line.find(',');
+            string_view item = line.substr(0, comma);
+            line = comma == string_view::npos ? string_view() : line.substr(comma + 1);
+            size_t colon = item.find(':');
+            ChunkRef c;
+            if (colon == string_view::npos || !parseDigest(item.substr(0, colon), c.digest) ||
+                !FileCatalog::parseNumber(item.substr(colon + 1), c.len))
+                return false;
+            chunks.push_back(c);
+        }
+        return true;
+    }
+
+    // Syncs the file system holding the store: every chunk file written
+    // so far, and the manifest log, in one call.
+    bool syncAll() { return syncFileSystem(dir); }
+
+    // Requires mtx.
+    bool appendLine(const string& line) {
+        int fd = ::open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        bool ok = writeAllFd(fd, line.data(), line.size()) && (deferSync || syncFd(fd) == 0);
+        ::close(fd);
+        if (ok) ++logLines;
+        if (ok && deferSync) unsynced = true;
+        return ok;
+    }
+
+    // Hashes a chunk and takes a reference, writing the chunk file if it is
+    // new. Sets unsynced when the chunk is not yet durable, including one
+    // another upload wrote and has not synced.
+    bool acquire(const uint8_t* data, size_t len, ChunkRef& out, bool& unsynced) {
+        SHA256 sha;
+        sha.update(data, len);
+        sha.final(out.digest.data());
+        out.len = (uint32_t)len;
+
+        lock_guard<mutex> cl(chunkLocks[out.digest[0]]);
+        {
+            lock_guard<mutex> lk(mtx);
+            auto it = refs.find(out.digest);
+            if (it != refs.end()) {
+                ++it->second.count;
+                if (it->second.written > syncedUpTo) unsynced = true;
+                return true;
+            }
+        }
+        string path = chunkPath(out.digest), tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        bool ok = writeAllFd(fd, reinterpret_cast<const char*>(data), len);
+        ::close(fd);
+        if (!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+            ::unlink(tmp.c_str());
+            return false;
+        }
+        lock_guard<mutex> lk(mtx);
+        refs.emplace(out.digest, Ref{1, out.len, ++chunkWrites});
+        storedBytes += len;
+        unsynced = true;
+        return true;
+    }
+
+    void release(const ChunkRef& c) {
+        lock_guard<mutex> cl(chunkLocks[c.digest[0]]);
+        {
+            lock_guard<mutex> lk(mtx);
+            auto it = refs.find(c.digest);
+            if (it == refs.end() || --it->second.count > 0) return;
+            storedBytes -= it->second.len;
+            refs.erase(it);
+        }
+        ::unlink(chunkPath(c.digest).c_str());
+    }
+
+    // Requires mtx.
+    bool allDurable(const vector<ChunkRef>& chunks) const {
+        for (const auto& c : chunks) {
+            auto it = refs.find(c.digest);
+            if (it != refs.end() && it->second.written > syncedUpTo) return false;
+        }
+        return true;
+    }
+
+    // Syncs without holding mtx, so lookups and other uploads go on
+    // meanwhile. Chunks written before the call are durable once it
+    // succeeds.
+    bool syncChunks() {
+        uint64_t ticket;
+        {
+            lock_guard<mutex> lk(mtx);
+            ticket = chunkWrites;
+        }
+        if (!syncAll()) return false;
+        lock_guard<mutex> lk(mtx);
+        syncedUpTo = max(syncedUpTo, ticket);
+        return true;
+    }
+
+    static uint64_t totalOf(const vector<ChunkRef>& chunks) {
+        uint64_t n = 0;
+        for (const auto& c : chunks) n += c.len;
+        return n;
+    }
+
+public:
+    // Loads the manifests and counts references; false if the directory
+    // cannot be created.
+    bool open(const string& directory) {
+        dir = directory;
+        logPath = dir + "manifests.log";
+        error_code ec;
+        for (int b = 0; b < 256; ++b) fs::create_directories(dir + string(HEX_PAIRS.pairs + 2 * b, 2), ec);
+        if (ec) return false;
+
+        lock_guard<mutex> lk(mtx);
+        manifests.clear();
+        refs.clear();
+        storedBytes = logicalBytes = 0;
+        chunkWrites = syncedUpTo = 0;
+        logLines = 0;
+
+        string data;
+        size_t intact = 0;
+        if (readFile(logPath, data)) {
+            size_t pos = 0;
+            Manifest m;
+            while (pos < data.size()) {
+                size_t nl = data.find('\n', pos);
+                if (nl == string::npos) break;
+                string_view line(data.data() + pos, nl - pos);
+                pos = intact = nl + 1;
+                if (line.size() < 2 || line[1] != '|') continue;
+                ++logLines;
+                FileId id;
+                if (line[0] == '-') {
+                    if (FileId::parse(line.substr(2), id)) manifests.erase(id);
+                } else if (line[0] == '+' && parseManifest(line.substr(2), id, m)) {
+                    manifests[id] = m;
+                }
+            }
+        }
+        for (const auto& [id, m] : manifests) {
+            logicalBytes += totalOf(m.chunks);
+            for (const auto& c : m.chunks) {
+                auto [it, fresh] = refs.try_emplace(c.digest, Ref{0, c.len, 0});
+                ++it->second.count;
+                if (fresh) storedBytes += c.len;
+            }
+        }
+
+        if (logLines > 2 * manifests.size() + 1024) {
+            string all;
+            for (const auto& [id, m] : manifests) appendManifest(all, id, m);
+            if (writeFileAtomic(logPath, all)) logLines = manifests.size();
+        } else if (intact < data.size()) {
+            (void)::truncate(logPath.c_str(), (off_t)intact);
+        }
+        return true;
+    }
+
+    // While deferred, commits skip the sync until flush().
+    void setDeferredSync(bool on) {
+        lock_guard<mutex> lk(mtx);
+        deferSync = on;
+    }
+
+    bool flush() {
+        {
+            lock_guard<mutex> lk(mtx);
+            if (!unsynced) return true;
+            unsynced = false;
+        }
+        if (syncChunks()) return true;
+        lock_guard<mutex> lk(mtx);
+        unsynced = true;
+        return false;
+    }
+
+    // Stores what is left of the upload and records its chunks under id,
+    // with the wrapped data key if it was encrypted. The upload is empty
+    // afterwards, whether or not this succeeds.
+    bool commit(const FileId& id, Upload& up, const string& wrappedKey = string()) {
+        Metrics::Timer timer(Metrics::Op::CHUNK_COMMIT);
+        bool ok = up.cutChunks(true);
+        if (ok && up.needsSync) {
+            bool sync;
+            {
+                lock_guard<mutex> lk(mtx);
+                if (deferSync) unsynced = true;
+                sync = !deferSync && !allDurable(up.chunks);   // another commit's sync may have covered them
+            }
+            if (sync) ok = syncChunks();
+        }
+        if (ok) {
+            Manifest m{std::move(up.chunks), wrappedKey};
+            up.chunks.clear();
+            string line;
+            appendManifest(line, id, m);
+            lock_guard<mutex> lk(mtx);
+            ok = !manifests.count(id) && appendLine(line);
+            if (ok) {
+                logicalBytes += totalOf(m.chunks);
+                manifests[id] = std::move(m);
+            } else {
+                up.chunks = std::move(m.chunks);   // released below
+            }
+        }
+        up.abort();
+        return ok;
+    }
+
+    // Copies a file's content from another store as stored there: chunk by
+    // chunk, each checked against its digest, with the same wrapped key, so
+    // encrypted files stay encrypted. Chunks this store already has are
+    // shared, not copied. True if id is already here; false if src has no
+    // content for it or a chunk is missing or damaged.
+    bool copyFrom(const ChunkStore& src, const FileId& id) {
+        string wrappedKey;
+        vector<ChunkRef> wanted;
+        {
+            lock_guard<mutex> lk(src.mtx);
+            auto it = src.manifests.find(id);
+            if (it == src.manifests.end()) return false;
+            wanted = it->second.chunks;
+            wrappedKey = it->second.key;
+        }
+        if (has(id)) return true;
+        Upload up(*this);
+        string data;
+        for (const auto& c : wanted) {
+            ChunkRef ref;
+            if (!readFile(src.chunkPath(c.digest), data) ||
+                !acquire(reinterpret_cast<const uint8_t*>(data.data()), data.size(), ref, up.needsSync))
+                return false;
+            up.chunks.push_back(ref);   // released by up if anything fails
+            if (ref.digest != c.digest) return false;
+        }
+        return commit(id, up, wrappedKey) || has(id);
+    }
+
+    // Forgets the file's content; chunks no other file uses are deleted.
+    bool remove(const FileId& id) {
+        vector<ChunkRef> chunks;
+        {
+            lock_guard<mutex> lk(mtx);
+            auto it = manifests.find(id);
+            if (it == manifests.end()) return true;
+            string line = "-|";
+            id.appendTo(line);
+            line += '\n';
+            if (!appendLine(line)) return false;
+            chunks = std::move(it->second.chunks);
+            manifests.erase(it);
+            logicalBytes -= totalOf(chunks);
+        }
+        for (const auto& c : chunks) release(c);
+        return true;
+    }
+
+    bool has(const FileId& id) const {
+        lock_guard<mutex> lk(mtx);
+        return manifests.count(id) != 0;
+    }
+
+    // The file's wrapped data key (empty if stored in the clear); false if
+    // the file has no stored content.
+    bool keyOf(const FileId& id, string& wrappedKey) const {
+        lock_guard<mutex> lk(mtx);
+        auto it = manifests.find(id);
+        if (it == manifests.end()) return false;
+        wrappedKey = it->second.key;
+        return true;
+    }
+
+    // Streams the file's bytes to sink(data, len), checking each chunk
+    // against its digest and, for encrypted files, decrypting it with key.
+    // The next chunk file is read while the current one is processed.
+    // False if the file has no stored content, a chunk is missing or
+    // damaged, or key is missing or wrong.
+    template <typename Sink>
+    bool read(const FileId& id, Sink sink, const uint8_t* key = nullptr) const {
+        vector<ChunkRef> chunks;
+        unique_ptr<Aes256Gcm> cipher;
+        {
+            lock_guard<mutex> lk(mtx);
+            auto it = manifests.find(id);
+            if (it == manifests.end()) return false;
+            if (!it->second.key.empty()) {
+                if (!key) return false;
+                cipher = make_unique<Aes256Gcm>(key);
+            }
+            chunks = it->second.chunks;
+        }
+        size_t fetched = 0;
+        ReadAhead files([&](string& data) {
+            if (fetched == chunks.size()) return false;
+            if (!readFile(chunkPath(chunks[fetched].digest), data)) data.clear();
+            ++fetched;
+            return true;
+        });
+        string data;
+        vector<uint8_t> plain;
+        SHA256 sha;
+        ChunkDigest digest;
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            const ChunkRef& c = chunks[i];
+            if (!files.next(data) || data.size() != c.len) return false;
+            sha.update(data);
+            sha.final(digest.data());
+            if (digest != c.digest) return false;
+            if (!cipher) {
+                sink(data.data(), data.size());
+                continue;
+            }
+            if (c.len < Aes256Gcm::TAG_SIZE) return false;
+            size_t len = c.len - Aes256Gcm::TAG_SIZE;
+            const uint8_t* in = reinterpret_cast<const uint8_t*>(data.data());
+            uint8_t nonce[Aes256Gcm::NONCE_SIZE];
+            chunkNonce(i, nonce);
+            uint8_t last = i + 1 == chunks.size();
+            plain.resize(len);
+            if (!cipher->decrypt(nonce, &last, 1, in, len, in + len, plain.data())) return false;
+            sink(reinterpret_cast<const char*>(plain.data()), len);
+        }
+        return true;
+    }
+
+    // Drops manifests of files that keep(id) says no longer exist, e.g.
+    // after a crash between a catalog change and the manifest log.
+    template <typename Keep>
+    size_t retainOnly(Keep keep) {
+        vector<FileId> gone;
+        {
+            lock_guard<mutex> lk(mtx);
+            for (const auto& [id, m] : manifests)
+                if (!keep(id)) gone.push_back(id);
+        }
+        for (const auto& id : gone) remove(id);
+        return gone.size();
+    }
+
+    // Deletes chunk files nothing references and stray temporaries.
+    size_t sweep() {
+        size_t removed = 0;
+        error_code ec;
+        for (int b = 0; b < 256; ++b) {
+            for (const auto& entry : fs::directory_iterator(dir + string(HEX_PAIRS.pairs + 2 * b, 2), ec)) {
+                string name = entry.path().filename().string();
+                bool tmp = name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0;
+                ChunkDigest d;
+                if (!parseDigest(string_view(name).substr(0, tmp ? name.size() - 4 : name.size()), d)) continue;
+                lock_guard<mutex> cl(chunkLocks[d[0]]);
+                {
+                    lock_guard<mutex> lk(mtx);
+                    if (!tmp && refs.count(d)) continue;
+                }
+                if (::unlink(entry.path().c_str()) == 0) ++removed;
+            }
+        }
+        return removed;
+    }
+
+    Stats stats() const {
+        lock_guard<mutex> lk(mtx);
+        return Stats{manifests.size(), refs.size(), storedBytes, logicalBytes};
+    }
+};
+
+// ================== Replication ==================
+// Files in Region::GLOBAL are copied to a stand-in store for every other
+// region, REPLICA_DIR/<region>/, each playing a remote data centre. Every
+// change to a GLOBAL file (upload, visibility, delete) queues the file's id
+// under the next log sequence number (lsn), in memory and in
+// REPLICATION_LOG, one line per job:
+//   <lsn>|<file id>
+// Jobs name files, not changes: a replica reads the file's current record
+// and content from the primary when it applies the job. Jobs for one file
+// can therefore be grouped freely, and a replica always converges on the
+// primary's latest state.
+//
+// Each replica has its own worker, so a slow or offline replica never holds
+// up the others. A worker takes up to REPLICATION_BATCH queued jobs, applies
+// them, syncs its store once and then records the batch's last lsn in its
+// applied file. After a restart, or when brought back online, a replica
+// resumes after that lsn. Jobs stay queued until every replica has applied
+// them; the log is emptied whenever the queue is.
+//
+// Queueing appends to the log without a sync and never waits for a
+// replica. A crash can lose the last queued jobs, so open() also compares
+// each replica with the primary's GLOBAL files and queues every difference.
+// With sync acknowledgement the caller then waits, outside any lock, until
+// the online replicas have applied its job, for up to
+// REPLICATION_ACK_TIMEOUT_MS.
+
+// One replica's directory:
+//   catalog.dat   its copies of the records, in the file catalog log format
+//   chunks/       their contents, in a chunk store of its own
+//   applied       lsn of the last job reflected in both
+// Used by one thread at a time: open() at startup, then the worker.
+class ReplicaStore {
+public:
+    struct Change {
+        FileId id;
+        optional<FileRecord> record;   // nullopt: no longer a GLOBAL file
+    };
+
+private:
+    string dir;
+    ChunkStore chunks;
+    unordered_map<FileId, string> records;   // id -> catalog line
+    size_t   logLines{0};
+    uint64_t appliedLsn{0};
+
+    string catalogPath() const { return dir + "catalog.dat"; }
+    string appliedPath() const { return dir + "applied"; }
+
+public:
+    // Loads the catalog and applied lsn and drops content the catalog does
+    // not name; false if the directory cannot be created.
+    bool open(const string& directory) {
+        dir = directory;
+        records.clear();
+        logLines = 0;
+        appliedLsn = 0;
+        if (!chunks.open(dir + "chunks/")) return false;
+        chunks.setDeferredSync(true);   // apply() syncs the whole directory per batch
+
+        string data;
+        if (readFile(appliedPath(), data)) {
+            while (!data.empty() && data.back() == '\n') data.pop_back();
+            if (!FileCatalog::parseNumber(data, appliedLsn)) appliedLsn = 0;
+        }
+        vector<FileRecord> live;
+        if (readFile(catalogPath(), data)) {
+            auto res = FileCatalog::parse(data, live);
+            logLines = res.lines;
+            if (res.bytes < data.size()) (void)::truncate(catalogPath().c_str(), (off_t)res.bytes);
+        }
+        string all;
+        for (const auto& fr : live) {
+            size_t at = all.size();
+            FileCatalog::appendRecord(all, fr);
+            records.emplace(fr.id, all.substr(at));
+        }
+        if (logLines > 2 * records.size() + 1024 && writeFileAtomic(catalogPath(), all)) logLines = records.size();
+
+        chunks.retainOnly([&](const FileId& id) { return records.count(id) != 0; });
+        chunks.sweep();
+        return true;
+    }
+
+    uint64_t applied() const { return appliedLsn; }
+    size_t size() const { return records.size(); }
+    uint64_t storedBytes() const { return chunks.stats().storedBytes; }
+
+    // True if the replica has this catalog line for id and, when withContent,
+    // the file's content.
+    bool holds(const FileId& id, const string& line, bool withContent) const {
+        auto it = records.find(id);
+        return it != records.end() && it->second == line && (!withContent || chunks.has(id));
+    }
+
+    template <typename Fn>
+    void forEachId(Fn fn) const {
+        for (const auto& [id, line] : records) fn(id);
+    }
+
+    // Brings the replica's copy of each file in line with its change,
+    // copying missing content from source, then syncs once and records lsn
+    // as applied. On failure the store reloads from disk, so the batch can
+    // simply be retried.
+    bool apply(const vector<Change>& changes, const ChunkStore& source, uint64_t lsn) {
+        Metrics::Timer timer(Metrics::Op::REPLICA_BATCH);
+        string lines, line;
+        vector<FileId> dropped;
+        bool ok = true;
+        for (const auto& c : changes) {
+            if (!c.record) {
+                if (records.erase(c.id)) {
+                    FileCatalog::appendTombstone(lines, c.id);
+                    dropped.push_back(c.id);
+                }
+                continue;
+            }
+            if (source.has(c.id) && !chunks.copyFrom(source, c.id)) {
+                ok = false;
+                break;
+            }
+            line.clear();
+            FileCatalog::appendRecord(line, *c.record);
+            string& have = records[c.id];
+            if (have == line) continue;
+            have = line;
+            lines += line;
+        }
+        if (ok && !lines.empty()) {
+            int fd = ::open(catalogPath().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            ok = fd >= 0 && writeAllFd(fd, lines.data(), lines.size());
+            if (fd >= 0) ::close(fd);
+            logLines += (size_t)count(lines.begin(), lines.end(), '\n');
+        }
+        ok = ok && syncFileSystem(dir) && writeFileAtomic(appliedPath(), to_string(lsn) + "\n");
+        if (!ok) {
+            open(dir);
+            return false;
+        }
+        for (const auto& id : dropped) chunks.remove(id);   // tombstones are durable now
+        appliedLsn = lsn;
+        return true;
+    }
+};
+
+class Replicator {
+public:
+    enum class Ack { ASYNC, SYNC };
+
+    struct ReplicaStatus {
+        Region   region;
+        bool     online;
+        uint64_t appliedLsn;
+        uint64_t lagJobs;       // queued jobs it has not applied
+        double   lagSeconds;    // age of the oldest of them (jobs loaded at startup count from then)
+        size_t   files;
+        uint64_t storedBytes;
+        uint64_t batches;
+        uint64_t failures;      // batches that failed and were retried
+    };
+
+    struct Status {
+        Ack      ack;
+        uint64_t headLsn;       // last queued job
+        size_t   queued;        // jobs some replica still needs
+        uint64_t ackTimeouts;   // sync acks that gave up waiting
+        vector<ReplicaStatus> replicas;
+    };
+
+private:
+    using Clock = chrono::steady_clock;
+
+    static constexpr size_t REPLICAS = (size_t)Region::GLOBAL;   // every region but GLOBAL
+
+    struct Job {
+        uint64_t lsn;
+        FileId   id;
+        Clock::time_point queued;
+    };
+
+    struct Replica {
+        Region       region{Region::ASIA};
+        ReplicaStore store;
+        uint64_t     applied{0};
+        bool         online{true};
+        bool         reload{false};   // reopen the store before the next batch
+        size_t       files{0};
+        uint64_t     storedBytes{0};
+        uint64_t     batches{0};
+        uint64_t     failures{0};
+        thread       worker;
+    };
+
+    const FileRepository& files;
+    const ChunkStore& source;
+
+    mutable mutex mtx;              // everything below
+    condition_variable workCv;      // wakes the workers
+    condition_variable appliedCv;   // wakes callers waiting for replicas
+    deque<Job> queue;               // lsn order; not yet applied by every replica
+    uint64_t nextLsn{1};
+    int      logFd{-1};
+    uint64_t logBytes{0};
+    Ack      ackMode{Config::REPLICATION_SYNC_ACK ? Ack::SYNC : Ack::ASYNC};
+    uint64_t ackTimeouts{0};
+    bool     stopping{false};
+    array<Replica, REPLICAS> replicas;
+
+    static string replicaDir(Region r) { return Config::REPLICA_DIR + regionSlug(r) + "/"; }
+
+    // First queued job the replica has not applied. Requires mtx.
+    deque<Job>::const_iterator pendingFor(const Replica& r) const {
+        return partition_point(queue.begin(), queue.end(), [&](const Job& j) { return j.lsn <= r.applied; });
+    }
+
+    // Requires mtx.
+    bool caughtUp(uint64_t lsn) const {
+        for (const auto& r : replicas)
+            if (r.online && r.applied < lsn) return false;
+        return true;
+    }
+
+    // Drops jobs every replica has applied. Requires mtx.
+    void trim() {
+        uint64_t low = replicas[0].applied;
+        for (const auto& r : replicas) low = min(low, r.applied);
+        while (!queue.empty() && queue.front().lsn <= low) queue.pop_front();
+        if (queue.empty() && logBytes > 0 && logFd >= 0 && ::ftruncate(logFd, 0) == 0) logBytes = 0;
+    }
+
+    // Requires mtx.
+    uint64_t push(const FileId& id) {
+        uint64_t lsn = nextLsn++;
+        string line = to_string(lsn);
+        line += '|';
+        id.appendTo(line);
+        line += '\n';
+        // A failed write only costs the job after a crash; open() requeues it then.
+        if (logFd >= 0 && writeAllFd(logFd, line.data(), line.size())) logBytes += line.size();
+        queue.push_back(Job{lsn, id, Clock::now()});
+        workCv.notify_all();
+        return lsn;
+    }
+
+    void loop(Replica& r) {
+        vector<Job> batch;
+        vector<ReplicaStore::Change> changes;
+        unordered_set<FileId> seen;
+        unique_lock<mutex> lk(mtx);
+        while (true) {
+            workCv.wait(lk, [&] { return stopping || (r.online && r.applied + 1 < nextLsn); });
+            if (stopping) return;
+
+            bool ok = true;
+            if (r.reload) {
+                lk.unlock();
+                ok = r.store.open(replicaDir(r.region));
+                lk.lock();
+                if (ok) {
+                    r.reload = false;
+                    r.applied = max(r.applied, r.store.applied());
+                }
+            }
+            auto it = pendingFor(r);
+            if (ok && it == queue.end()) {
+                // Jobs lost with the log's unsynced tail; open() requeued their files.
+                r.applied = nextLsn - 1;
+                trim();
+                appliedCv.notify_all();
+                continue;
+            }
+            if (ok) {
+                batch.assign(it, it + (ptrdiff_t)min<size_t>(queue.end() - it, Config::REPLICATION_BATCH));
+                lk.unlock();
+                changes.clear();
+                seen.clear();
+                for (const Job& j : batch) {
+                    if (!seen.insert(j.id).second) continue;
+                    auto fr = files.getFile(j.id);
+                    if (fr && fr->region != Region::GLOBAL) fr.reset();
+                    changes.push_back(ReplicaStore::Change{j.id, std::move(fr)});
+                }
+                ok = r.store.apply(changes, source, batch.back().lsn);
+                size_t count = r.store.size();
+                uint64_t stored = r.store.storedBytes();
+                lk.lock();
+                if (ok) {
+                    r.applied = batch.back().lsn;
+                    r.files = count;
+                    r.storedBytes = stored;
+                    ++r.batches;
+                    trim();
+                    appliedCv.notify_all();
+                }
+            }
+            if (!ok) {
+                ++r.failures;
+                workCv.wait_for(lk, chrono::milliseconds(Config::REPLICATION_RETRY_MS), [&] { return stopping; });
+            }
+        }
+    }
+
+public:
+    Replicator(const FileRepository& f, const ChunkStore& s) : files(f), source(s) {}
+    Replicator(const Replicator&) = delete;
+    Replicator& operator=(const Replicator&) = delete;
+
+    ~Replicator() {
+        {
+            lock_guard<mutex> lk(mtx);
+            stopping = true;
+        }
+        workCv.notify_all();
+        appliedCv.notify_all();
+        for (auto& r : replicas)
+            if (r.worker.joinable()) r.worker.join();
+        if (logFd >= 0) ::close(logFd);
+    }
+
+    // Loads the replicas and the jobs they still need, queues every GLOBAL
+    // file a replica does not match, and starts the workers. Call once, with
+    // the file catalog and chunk store loaded.
+    bool open() {
+        for (size_t i = 0; i < REPLICAS; ++i) {
+            Replica& r = replicas[i];
+            r.region = static_cast<Region>(i);
+            if (!r.store.open(replicaDir(r.region))) return false;
+            r.applied = r.store.applied();
+            r.files = r.store.size();
+            r.storedBytes = r.store.storedBytes();
+        }
+        uint64_t low = replicas[0].applied, high = 0;
+        for (const auto& r : replicas) {
+            low = min(low, r.applied);
+            high = max(high, r.applied);
+        }
+
+        string data;
+        auto now = Clock::now();
+        unordered_set<FileId> queued;
+        if (readFile(Config::REPLICATION_LOG, data)) {
+            size_t pos = 0;
+            while (pos < data.size()) {
+                size_t nl = data.find('\n', pos);
+                if (nl == string::npos) break;   // torn append
+                string_view line(data.data() + pos, nl - pos);
+                pos = nl + 1;
+                string_view lsnField = FileCatalog::nextField(line);
+                uint64_t lsn;
+                FileId id;
+                if (line.data() == nullptr || !FileCatalog::parseNumber(lsnField, lsn) ||
+                    !FileId::parse(line, id) || lsn <= low || (!queue.empty() && lsn <= queue.back().lsn))
+                    continue;
+                queue.push_back(Job{lsn, id, now});
+                queued.insert(id);
+            }
+        }
+        if (!queue.empty()) high = max(high, queue.back().lsn);
+        nextLsn = high + 1;
+
+        // What the replicas should hold, against what they hold or will
+        // once their queued jobs are applied
+        unordered_map<FileId, string> primary;
+        string line;
+        files.forEachFileIn(Region::GLOBAL, [&](const FileRecord& fr) {
+            line.clear();
+            FileCatalog::appendRecord(line, fr);
+            primary.emplace(fr.id, line);
+        });
+        unordered_set<FileId> stale;
+        for (const auto& r : replicas) {
+            for (const auto& [id, expected] : primary)
+                if (!queued.count(id) && !r.store.holds(id, expected, source.has(id))) stale.insert(id);
+            r.store.forEachId([&](const FileId& id) {
+                if (!queued.count(id) && !primary.count(id)) stale.insert(id);
+            });
+        }
+
+        string log;
+        for (const auto& j : queue) {
+            log += to_string(j.lsn);
+            log += '|';
+            j.id.appendTo(log);
+            log += '\n';
+        }
+        if (!writeFileAtomic(Config::REPLICATION_LOG, log)) return false;
+        logFd = ::open(Config::REPLICATION_LOG.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (logFd < 0) return false;
+        logBytes = log.size();
+        {
+            lock_guard<mutex> lk(mtx);
+            for (const auto& id : stale) push(id);
+        }
+        for (auto& r : replicas) r.worker = thread([this, &r] { loop(r); });
+        return true;
+    }
+
+    // Queues a change to a GLOBAL file for every replica and returns its
+    // lsn. Never waits for a replica.
+    uint64_t enqueue(const FileId& id) {
+        lock_guard<mutex> lk(mtx);
+        return push(id);
+    }
+
+    // With sync acknowledgement, waits until every online replica has
+    // applied lsn; false if that took longer than REPLICATION_ACK_TIMEOUT_MS
+    // (the replicas still apply it later). Returns at once in async mode.
+    bool settle(uint64_t lsn) {
+        unique_lock<mutex> lk(mtx);
+        if (ackMode == Ack::ASYNC) return true;
+        bool ok = appliedCv.wait_for(lk, chrono::milliseconds(Config::REPLICATION_ACK_TIMEOUT_MS),
+                                     [&] { return stopping || caughtUp(lsn); });
+        if (!ok) ++ackTimeouts;
+        return ok;
+    }
+
+    // Waits until every online replica has applied every queued job;
+    // false on timeout.
+    bool drain(chrono::milliseconds timeout) {
+        unique_lock<mutex> lk(mtx);
+        return appliedCv.wait_for(lk, timeout, [&] { return stopping || caughtUp(nextLsn - 1); });
+    }
+
+    void setAck(Ack a) {
+        lock_guard<mutex> lk(mtx);
+        ackMode = a;
+    }
+
+    // Takes a replica down or brings it back. A replica coming back reloads
+    // its store, as after a restart, and catches up from its applied lsn.
+    bool setOnline(Region region, bool online) {
+        if (region == Region::GLOBAL) return false;
+        lock_guard<mutex> lk(mtx);
+        Replica& r = replicas[(size_t)region];
+        if (r.online && !online) r.reload = true;
+        r.online = online;
+        workCv.notify_all();
+        appliedCv.notify_all();   // sync waiters stop waiting for it
+        return true;
+    }
+
+    Status status() const {
+        lock_guard<mutex> lk(mtx);
+        Status s{ackMode, nextLsn - 1, queue.size(), ackTimeouts, {}};
+        auto now = Clock::now();
+        for (const auto& r : replicas) {
+            auto it = pendingFor(r);
+            double age = it == queue.end() ? 0.0 : chrono::duration<double>(now - it->queued).count();
+            s.replicas.push_back(ReplicaStatus{r.region, r.online, r.applied, uint64_t(queue.end() - it), age,
+                                               r.files, r.storedBytes, r.batches, r.failures});
+        }
+        return s;
+    }
+};
+
+// ================== API Types ==================
+// Request and reply structs for driving CloudEngine without the console
+// (tests, front ends, --batch). Every call returns an ApiStatus.
+enum class ApiStatus {
+    OK, BAD_REQUEST, NO_SESSION, NOT_FOUND, ALREADY_EXISTS, FORBIDDEN,
+    QUOTA_EXCEEDED, BAD_CREDENTIALS, LOCKED, INACTIVE, MFA_REQUIRED, IO_ERROR, BUSY
+};
+
+const char* apiStatusName(ApiStatus s) {
+    switch (s) {
+        case ApiStatus::OK:              return "OK";
+        case ApiStatus::BAD_REQUEST:     return "BAD_REQUEST";
+        case ApiStatus::NO_SESSION:      return "NO_SESSION";
+        case ApiStatus::NOT_FOUND:       return "NOT_FOUND";
+        case ApiStatus::ALREADY_EXISTS:  return "ALREADY_EXISTS";
+        case ApiStatus::FORBIDDEN:       return "FORBIDDEN";
+        case ApiStatus::QUOTA_EXCEEDED:  return "QUOTA_EXCEEDED";
+        case ApiStatus::BAD_CREDENTIALS: return "BAD_CREDENTIALS";
+        case ApiStatus::LOCKED:          return "LOCKED";
+        case ApiStatus::INACTIVE:        return "INACTIVE";
+        case ApiStatus::MFA_REQUIRED:    return "MFA_REQUIRED";
+        case ApiStatus::IO_ERROR:        return "IO_ERROR";
+        case ApiStatus::BUSY:            return "BUSY";
+    }
+    return "UNKNOWN";
+}
+
+struct RegisterRequest {
+    string username;
+    string password;
+    string fullName;
+    int    age{0};
+    string gender;          // "M" or "F"
+};
+
+struct LoginRequest {
+    string username;
+    string password;
+};
+
+// OK: token authenticates later calls until expiresAt. MFA_REQUIRED:
+// answer mfaChallenge with verifyMfa() before it expires; mfaCode is the
+// simulated delivery of the code to the user's device.
+struct LoginReply {
+    ApiStatus status{ApiStatus::BAD_CREDENTIALS};
+    string    token;
+    time_t    expiresAt{0};
+    int       failedLogins{0};
+    string    mfaChallenge;
+    string    mfaCode;
+};
+
+struct MfaRequest {
+    string challenge;
+    string code;
+};
+
+struct UploadRequest {
+    string   token;
+    string   name;
+    string   sourcePath;    // local file whose bytes are stored; empty: metadata only
+    int64_t  sizeBytes{0};  // metadata-only uploads
+    Region   region{Region::GLOBAL};
+    string   description;
+    bool     isPublic{false};
+    bool     encryptedAtRest{false};
+};
+
+struct UploadReply {
+    ApiStatus status{ApiStatus::BAD_REQUEST};
+    FileId    fileId;
+};
+
+// get, delete
+struct FileRequest {
+    string   token;
+    FileId   fileId;
+};
+
+struct VisibilityRequest {
+    string   token;
+    FileId   fileId;
+    bool     isPublic{false};
+};
+
+struct SearchRequest {
+    string   token;
+    string   term;
+};
+
+struct FilesReply {
+    ApiStatus status{ApiStatus::OK};
+    vector<FileRecord> files;
+};
+
+struct PublicRequest {
+    PublicCatalog::Order  order{PublicCatalog::Order::DATE};
+    PublicCatalog::Cursor after;
+    size_t                limit{20};
+};
+
+// ================== Sessions ==================
+// Signed session tokens. login() hands the caller a token, and later calls
+// present it instead of the password. Checking a token costs one HMAC over
+// a few dozen bytes and a lookup in the revocation set: no password hash,
+// no disk access, no allocation. A token carries its user and expiry, so
+// the server keeps no state per session; it only remembers tokens revoked
+// before they expire (logout), in REVOKED_TOKENS_FILE.
+//
+// Token text is the hex of
+//   version(1) | kind(1) | expires(8) | id(8) | name length(1) | name | tag(32)
+// (integers little endian), where tag is HMAC-SHA256 over everything before
+// it under a key derived from the master key. Tokens therefore outlive a
+// restart, and all of them stop working if the master key changes.
+//
+// MFA users get an MFA challenge instead: a token of its own kind, whose
+// 6-digit code is an HMAC of its claims under a second key. Answering it
+// needs nothing stored between the two steps; a challenge is revoked on
+// its first answer, right or wrong.
+
+// One per logged-in caller: the console UI holds one, API calls rebuild
+// theirs from the token on every call.
+struct Session {
+    static constexpr size_t MAX_NAME = 63;   // usernameProblem's limit
+
+    uint64_t id{0};          // token id
+    time_t   expiresAt{0};
+    uint8_t  nameLen{0};
+    char     name[MAX_NAME]; // inline, so rebuilding a session never allocates
+
+    string_view username() const { return string_view(name, nameLen); }
+    void setUsername(string_view u) {
+        nameLen = (uint8_t)min(u.size(), MAX_NAME);
+        memcpy(name, u.data(), nameLen);
+    }
+};
+
+// Token ids revoked before their expiry, persisted one per line as
+//   <id>|<expires>
+// Entries are dropped once the token they name has expired: in memory when
+// the set doubles, on disk when the file is reopened.
+class RevocationSet {
+public:
+    enum class Result { REVOKED, ALREADY, NOT_DURABLE };
+
+    RevocationSet() = default;
+    RevocationSet(const RevocationSet&) = delete;
+    RevocationSet& operator=(const RevocationSet&) = delete;
+    ~RevocationSet() { if (fd >= 0) ::close(fd); }
+
+    bool open(const string& filePath) {
+        time_t now = time(nullptr);
+        string data, kept;
+        if (readFile(filePath, data)) {
+            size_t pos = 0;
+            while (pos < data.size()) {
+                size_t nl = data.find('\n', pos);
+                if (nl == string::npos) break;   // torn append
+                string_view line(data.data() + pos, nl - pos);
+                pos = nl + 1;
+                string_view rest = line;
+                uint64_t id;
+                int64_t expires;
+                if (!FileCatalog::parseNumber(FileCatalog::nextField(rest), id) || rest.data() == nullptr ||
+                    !FileCatalog::parseNumber(rest, expires) || expires <= now)
+                    continue;
+                if (revoked.emplace(id, (time_t)expires).second) kept.append(line.data(), line.size()) += '\n';
+            }
+        }
+        if (!writeFileAtomic(filePath, kept)) return false;
+        fd = ::open(filePath.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        pruneAt = max<size_t>(64, 2 * revoked.size());
+        count.store(revoked.size(), memory_order_release);
+        return fd >= 0;
+    }
+
+    bool contains(uint64_t id) const {
+        if (count.load(memory_order_acquire) == 0) return false;
+        shared_lock<shared_mutex> lk(mtx);
+        return revoked.count(id) != 0;
+    }
+
+    // Revokes the token until it expires. Memory first, so the token stops
+    // working even if the append fails; the append is synced before
+    // returning.
+    Result revoke(uint64_t id, time_t expires) {
+        {
+            lock_guard<shared_mutex> lk(mtx);
+            if (!revoked.emplace(id, expires).second) return Result::ALREADY;
+            if (revoked.size() >= pruneAt) {
+                time_t now = time(nullptr);
+                for (auto it = revoked.begin(); it != revoked.end();)
+                    it = it->second <= now ? revoked.erase(it) : next(it);
+                pruneAt = max<size_t>(64, 2 * revoked.size());
+            }
+            count.store(revoked.size(), memory_order_release);
+        }
+        string line = to_string(id) + "|" + to_string((int64_t)expires) + "\n";
+        Metrics::Timer timer(Metrics::Op::REVOCATION_WRITE);
+        lock_guard<mutex> lk(fileMtx);
+        bool ok = fd >= 0 && writeAllFd(fd, line.data(), line.size()) && syncFd(fd) == 0;
+        return ok ? Result::REVOKED : Result::NOT_DURABLE;
+    }
+
+    size_t size() const { return count.load(memory_order_relaxed); }
+
+private:
+    mutable shared_mutex mtx;                 // revoked, pruneAt
+    unordered_map<uint64_t, time_t> revoked;  // id -> token expiry
+    size_t pruneAt{64};
+    atomic<size_t> count{0};                  // lets lookups skip the lock while empty
+    mutex fileMtx;
+    int fd{-1};
+};
+
+class SessionTokens {
+public:
+    enum class Kind : uint8_t { SESSION = 1, MFA_CHALLENGE = 2 };
+
+    static constexpr uint8_t VERSION  = 1;
+    static constexpr size_t  HEADER   = 1 + 1 + 8 + 8 + 1;
+    static constexpr size_t  MAX_NAME = Session::MAX_NAME;
+    static constexpr size_t  TAG      = SHA256::DIGEST_SIZE;
+    static constexpr size_t  MAX_BYTES = HEADER + MAX_NAME + TAG;
+
+    // What a valid token says, decoded without allocating.
+    struct Claims {
+        Kind     kind{Kind::SESSION};
+        time_t   expires{0};
+        uint64_t id{0};
+        uint8_t  nameLen{0};
+        char     name[MAX_NAME];
+
+        string_view username() const { return string_view(name, nameLen); }
+    };
+
+    // Loads the revocation set and takes the signing keys from the key ring.
+    bool open(const KeyRing& keys, const string& revokedPath) {
+        uint8_t key[KeyRing::KEY_SIZE];
+        keys.derive("session", key);
+        signer.setKey(key, sizeof(key));
+        keys.derive("session-mfa", key);
+        mfaSigner.setKey(key, sizeof(key));
+        KeyRing::wipe(key, sizeof(key));
+        return revoked.open(revokedPath);
+    }
+
+    // A new token for username, valid for ttl seconds; out gets its claims.
+    string issue(Kind kind, const string& username, int ttl, Claims& out) const {
+        out.kind = kind;
+        out.expires = time(nullptr) + ttl;
+        out.id = SecureRandom::local().next64();
+        out.nameLen = (uint8_t)min(username.size(), MAX_NAME);
+        memcpy(out.name, username.data(), out.nameLen);
+
+        uint8_t buf[MAX_BYTES];
+        size_t len = encode(out, buf);
+        signer.mac(buf, len, buf + len);
+        return toHex(buf, len + TAG);
+    }
+
+    // Checks the signature, kind, expiry and revocation set. Constant work
+    // for a given length; nothing is allocated.
+    bool verify(string_view text, Kind kind, Claims& out) const {
+        size_t len = text.size() / 2;
+        if (text.size() % 2 != 0 || len < HEADER + TAG || len > MAX_BYTES) return false;
+        uint8_t buf[MAX_BYTES];
+        if (!fromHex(text, buf, len)) return false;
+        if (buf[0] != VERSION || buf[1] != (uint8_t)kind || HEADER + buf[HEADER - 1] + TAG != len) return false;
+        uint8_t tag[TAG];
+        signer.mac(buf, len - TAG, tag);
+        if (!constantTimeEqual(tag, buf + len - TAG, TAG)) return false;
+
+        out.kind = kind;
+        out.expires = (time_t)load64(buf + 2);
+        out.id = load64(buf + 10);
+        out.nameLen = buf[HEADER - 1];
+        memcpy(out.name, buf + HEADER, out.nameLen);
+        return out.expires > time(nullptr) && !revoked.contains(out.id);
+    }
+
+    // The code that answers an MFA challenge.
+    string mfaCode(const Claims& challenge) const {
+        uint8_t buf[MAX_BYTES], mac[TAG];
+        mfaSigner.mac(buf, encode(challenge, buf), mac);
+        uint32_t v = (uint32_t)mac[0] << 24 | (uint32_t)mac[1] << 16 | (uint32_t)mac[2] << 8 | mac[3];
+        v %= 1000000;
+        char code[6];
+        for (int i = 5; i >= 0; --i, v /= 10) code[i] = char('0' + v % 10);
+        return string(code, sizeof(code));
+    }
+
+    RevocationSet::Result revoke(uint64_t id, time_t expires) { return revoked.revoke(id, expires); }
+    size_t revokedCount() const { return revoked.size(); }
+
+private:
+    HmacSha256 signer, mfaSigner;
+    RevocationSet revoked;
+
+    static uint64_t load64(const uint8_t* p) {
+        uint64_t v = 0;
+        for (int i = 7; i >= 0; --i) v = v << 8 | p[i];
+        return v;
+    }
 
-// ================== Self-contained SHA256 (non-Apple) ==================
-#ifndef __APPLE__
-// Source: http://www.zedwood.com/article/cpp-sha256-function
-// (Full class implementation – included in the downloadable file)
-class SHA256 {
-    // ... (implementation omitted here for space, but will be present in final)
+    static void store64(uint8_t* p, uint64_t v) {
+        for (int i = 0; i < 8; ++i) p[i] = uint8_t(v >> (8 * i));
+    }
+
+    // Everything the tag covers; returns its length.
+    static size_t encode(const Claims& c, uint8_t* buf) {
+        buf[0] = VERSION;
+        buf[1] = (uint8_t)c.kind;
+        store64(buf + 2, (uint64_t)c.expires);
+        store64(buf + 10, c.id);
+        buf[HEADER - 1] = c.nameLen;
+        memcpy(buf + HEADER, c.name, c.nameLen);
+        return HEADER + c.nameLen;
+    }
 };
-#endif
 
-// ================== Enums ==================
-enum class UserRole { FREE_USER, PREMIUM_USER, ADMIN };
-enum class Region   { ASIA, EUROPE, AMERICA, GLOBAL };
-enum class FileType { DOCUMENT, IMAGE, VIDEO, AUDIO, OTHER };
-enum class AuditEventType {
-    SYSTEM, REGISTER, LOGIN_SUCCESS, LOGIN_FAIL, LOCKOUT,
-    LOGOUT, UPLOAD, DELETE, UPGRADE, ADMIN_ACTION
+// Outcome of one CloudEngine::reconcileUsage pass.
+struct UsageReport {
+    time_t  ranAt{0};
+    size_t  usersChecked{0};
+    size_t  usersCorrected{0};
+    int64_t driftBytes{0};     // sum of |recorded - actual| over corrected users
 };
 
-// ================== Helpers ==================
-string getCurrentTime() {
-    time_t now = time(nullptr);
-    tm *ltm = localtime(&now);
-    char buffer[32];
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", ltm);
-    return string(buffer);
-}
+// ================== CloudEngine ==================
+class CloudEngine {
+private:
+    UserRepository userRepo;
+    FileRepository fileRepo;
+    ChunkStore chunks;
+    KeyRing keys;
+    Replicator replication{fileRepo, chunks};
+    SessionTokens sessions;
+    StripedMutex userLocks;   // serializes changes to one user's account and files
+    KdfPool kdf;              // password hashing, off the calling thread
+
+    // The console UI's session, and its token for API clients
+    Session console;
+    string  consoleToken;
+    User* currentUser{nullptr};
 
-string formatFileSize(double sizeMB) {
-    stringstream ss;
-    if (sizeMB < 1.0) {
-        double kb = sizeMB * 1024.0;
-        ss << fixed << setprecision( (abs(kb - round(kb)) < 1e-6) ? 0 : 1 ) << kb << " KB";
-    } else if (sizeMB < 1024.0) {
-        ss << fixed << setprecision( (abs(sizeMB - round(sizeMB)) < 1e-6) ? 0 : 1 ) << sizeMB << " MB";
-    } else {
-        double gb = sizeMB / 1024.0;
-        ss << fixed << setprecision( (abs(gb*10 - round(gb*10)) < 1e-6) ? 1 : 2 ) << gb << " GB";
+    // Batch mode (beginBatch): highest user log lsn not yet committed
+    atomic<bool> batching{false};
+    atomic<uint64_t> batchLsn{0};
+
+    // Usage reconciliation, every QUOTA_RECONCILE_INTERVAL_S in the background
+    mutable mutex reconcileMtx;
+    condition_variable reconcileCv;
+    UsageReport lastReconcile;
+    bool   stopping{false};
+    thread reconciler;
+
+    // Metrics export: METRICS_FILE every METRICS_EXPORT_INTERVAL_S and at
+    // shutdown, METRICS_SOCKET whenever asked. A byte on the wake pipe
+    // stops the exporter.
+    int    metricsSocket{-1};
+    int    metricsWake[2]{-1, -1};
+    thread exporter;
+
+    void exportLoop() {
+        auto interval = chrono::seconds(Config::METRICS_EXPORT_INTERVAL_S);
+        auto next = chrono::steady_clock::now();
+        while (true) {
+            auto now = chrono::steady_clock::now();
+            if (now >= next) {
+                writeFileAtomic(Config::METRICS_FILE, metricsText());
+                next = now + interval;
+            }
+            pollfd fds[2] = {{metricsWake[0], POLLIN, 0}, {metricsSocket, POLLIN, 0}};
+            int wait = (int)chrono::duration_cast<chrono::milliseconds>(next - now).count() + 1;
+            int n = ::poll(fds, metricsSocket >= 0 ? 2 : 1, wait);
+            if (n > 0 && fds[0].revents) break;
+            if (n > 0 && (fds[1].revents & POLLIN)) Metrics::serveOne(metricsSocket, metricsText());
+        }
+        writeFileAtomic(Config::METRICS_FILE, metricsText());
     }
-    return ss.str();
-}
-
-FileType detectFileType(const string& filename) {
-    size_t pos = filename.find_last_of('.');
-    if (pos == string::npos) return FileType::OTHER;
-    string ext = filename.substr(pos + 1);
-    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
 
-    if (ext == "txt" || ext == "pdf" || ext == "doc" || ext == "docx" || ext == "xlsx" || ext == "pptx")
-        return FileType::DOCUMENT;
-    if (ext == "jpg" || ext == "jpeg" || ext == "png" || ext == "gif" || ext == "bmp")
-        return FileType::IMAGE;
-    if (ext == "mp4" || ext == "avi" || ext == "mov" || ext == "wmv" || ext == "mkv")
-        return FileType::VIDEO;
-    if (ext == "mp3" || ext == "wav" || ext == "flac" || ext == "aac")
-        return FileType::AUDIO;
-    return FileType::OTHER;
-}
+    void reconcileLoop() {
+        unique_lock<mutex> lk(reconcileMtx);
+        bool first = true;
+        while (!stopping) {
+            lk.unlock();
+            if (first) chunks.sweep();   // leftovers of uploads cut short by a crash
+            first = false;
+            reconcileUsage();
+            lk.lock();
+            reconcileCv.wait_for(lk, chrono::seconds(Config::QUOTA_RECONCILE_INTERVAL_S),
+                                 [&] { return stopping; });
+        }
+    }
 
-string randomHex(size_t bytes) {
-    static random_device rd;
-    static mt19937 gen(rd());
-    uniform_int_distribution<int> dist(0, 15);
-    stringstream ss;
-    for (size_t i = 0; i < bytes; ++i) {
-        ss << hex << dist(gen) << dist(gen);
+    // Brings one user's counter in line with their files. Skips the user
+    // while an upload holds a reservation, since the counter legitimately
+    // runs ahead of the catalog until it settles. Returns the correction.
+    int64_t reconcileUser(const string& username) {
+        lock_guard<mutex> lk(userLocks.forKey(username));
+        User* u = userRepo.find(username);
+        if (!u) return 0;
+        int64_t recorded = u->usedBytes.load();
+        if (u->usedBytes.inFlight()) return 0;
+        int64_t actual = fileRepo.bytesOf(username);
+        if (u->usedBytes.inFlight() || u->usedBytes.load() != recorded || recorded == actual) return 0;
+
+        u->usedBytes.adjust(actual - recorded);
+        persistUser(*u);
+        Logger::log(AuditEventType::SYSTEM, username, AuditReason::QUOTA_DRIFT,
+                    "recorded " + to_string(recorded) + " bytes, files " + to_string(actual));
+        return actual - recorded;
     }
-    return ss.str();
-}
 
-string generateSalt() {
-    return randomHex(16);
-}
+    // Logs the user's state; outside a batch waits until it is durable.
+    bool persistUser(const User& u) {
+        if (!batching) return userRepo.persist(u);
+        return commitUsers(userRepo.append(u));
+    }
 
-string generateMfaCode() {
-    static random_device rd;
-    static mt19937 gen(rd());
-    uniform_int_distribution<int> dist(0, 9);
-    string code;
-    for (int i = 0; i < 6; ++i) code.push_back('0' + dist(gen));
-    return code;
-}
+    bool commitUsers(uint64_t lsn) {
+        if (!batching) return userRepo.commit(lsn);
+        uint64_t seen = batchLsn.load();
+        while (seen < lsn && !batchLsn.compare_exchange_weak(seen, lsn)) {}
+        return true;
+    }
 
-string generateFileId() {
-    static random_device rd;
-    static mt19937 gen(rd());
-    uniform_int_distribution<uint64_t> dist;
-    stringstream ss;
-    ss << hex << dist(gen) << dist(gen);
-    return "file_" + ss.str();
-}
+    // A new salt and hash of password under the current policy, from the
+    // KDF pool; false if the pool could not take it in time.
+    bool hashPassword(const string& password, string& salt, string& hash) {
+        const PasswordHash::Params& policy = PasswordHash::policy();
+        string fresh = generateSalt();
+        uint8_t digest[SHA256::DIGEST_SIZE];
+        if (kdf.run(policy, fresh, password, digest) != KdfPool::Outcome::DONE) return false;
+        salt = std::move(fresh);
+        hash = PasswordHash::format(policy, digest);
+        return true;
+    }
 
-// ================== Models ==================
-struct User {
-    string username;
-    string salt;
-    string passwordHash;
-    string fullName;
-    int    age{};
-    string gender;
-    UserRole role{UserRole::FREE_USER};
-    double usedStorage{0.0};
-    time_t registrationDate{};
-    bool   isActive{true};
-    int    failedLogins{0};
-    bool   isLocked{false};
-    time_t lastLoginTime{0};
-    bool   mfaEnabled{false};
+    // Checks password against a stored salt and hash on the KDF pool.
+    LoginStatus checkPassword(const string& salt, const string& stored, const string& password) {
+        vector<KdfPool::Request> reqs(1);
+        uint8_t expected[SHA256::DIGEST_SIZE];
+        if (!PasswordHash::parse(stored, reqs[0].params, expected)) return LoginStatus::BAD_PASSWORD;
+        reqs[0].salt = salt;
+        reqs[0].password = password;
+        kdf.run(reqs, KdfPool::Clock::now() + chrono::milliseconds(Config::KDF_DEADLINE_MS));
+        if (reqs[0].outcome != KdfPool::Outcome::DONE) return LoginStatus::BUSY;
+        return constantTimeEqual(expected, reqs[0].digest, sizeof(expected)) ? LoginStatus::OK
+                                                                              : LoginStatus::BAD_PASSWORD;
+    }
 
-    string roleString() const {
-        switch (role) {
-            case UserRole::FREE_USER:   return "Free User";
-            case UserRole::PREMIUM_USER:return "Premium User";
-            case UserRole::ADMIN:       return "Administrator";
+    // A password that has just checked out against verifiedHash, which
+    // uses an outdated scheme.
+    struct HashUpgrade {
+        User*         user;
+        string        verifiedHash;
+        const string* password;
+    };
+
+    // Rehashes the passwords under the current policy, as one batch on the
+    // KDF pool. A user whose hash changed in the meantime is left alone; a
+    // rehash that cannot run now is retried at the next login. Returns the
+    // user log lsn to commit, 0 if nothing was written.
+    uint64_t upgradeHashes(const vector<HashUpgrade>& upgrades) {
+        if (upgrades.empty()) return 0;
+        const PasswordHash::Params& policy = PasswordHash::policy();
+        vector<KdfPool::Request> reqs(upgrades.size());
+        vector<string> salts(upgrades.size());
+        for (size_t i = 0; i < upgrades.size(); ++i) {
+            salts[i] = generateSalt();
+            reqs[i].params = policy;
+            reqs[i].salt = salts[i];
+            reqs[i].password = *upgrades[i].password;
         }
-        return "Unknown";
+        kdf.run(reqs, KdfPool::Clock::now() + chrono::milliseconds(Config::KDF_DEADLINE_MS));
+        uint64_t lsn = 0;
+        for (size_t i = 0; i < upgrades.size(); ++i) {
+            if (reqs[i].outcome != KdfPool::Outcome::DONE) continue;
+            User& u = *upgrades[i].user;
+            lock_guard<mutex> lk(userLocks.forKey(u.username));
+            if (u.passwordHash != upgrades[i].verifiedHash) continue;
+            u.salt = std::move(salts[i]);
+            u.passwordHash = PasswordHash::format(policy, reqs[i].digest);
+            lsn = userRepo.append(u);
+        }
+        return lsn;
     }
 
-    double storageLimit() const {
-        using namespace Config;
-        switch (role) {
-            case UserRole::FREE_USER:    return FREE_STORAGE_LIMIT;
-            case UserRole::PREMIUM_USER: return PREMIUM_STORAGE_LIMIT;
-            case UserRole::ADMIN:        return ADMIN_STORAGE_LIMIT;
+public:
+    CloudEngine() {
+        fileRepo.loadAll();
+        fileRepo.openPublicCatalog();
+        if (!chunks.open(Config::CHUNK_DIR)) throw runtime_error("cannot create " + Config::CHUNK_DIR);
+        if (!keys.open(Config::MASTER_KEY_FILE)) throw runtime_error("cannot load " + Config::MASTER_KEY_FILE);
+        if (!sessions.open(keys, Config::REVOKED_TOKENS_FILE))
+            throw runtime_error("cannot open " + Config::REVOKED_TOKENS_FILE);
+        chunks.retainOnly([&](const FileId& id) { return fileRepo.contains(id); });
+        if (!replication.open()) throw runtime_error("cannot open replicas in " + Config::REPLICA_DIR);
+        reconciler = thread([this] { reconcileLoop(); });
+        if (::pipe(metricsWake) == 0 && setFdFlags(metricsWake[0]) && setFdFlags(metricsWake[1])) {
+            metricsSocket = Metrics::listenUnix(Config::METRICS_SOCKET);
+            exporter = thread([this] { exportLoop(); });
         }
-        return FREE_STORAGE_LIMIT;
     }
 
-    string salutation() const {
-        bool male = (gender == "M" || gender == "m" || gender == "Male");
-        if (age > 40) return male ? "Sir" : "Ma'am";
-        return male ? "Mr." : "Ms.";
+    ~CloudEngine() {
+        {
+            lock_guard<mutex> lk(reconcileMtx);
+            stopping = true;
+        }
+        reconcileCv.notify_one();
+        if (reconciler.joinable()) reconciler.join();
+        if (exporter.joinable()) {
+            char stop = 0;
+            (void)!::write(metricsWake[1], &stop, 1);
+            exporter.join();
+        }
+        if (metricsSocket >= 0) {
+            ::close(metricsSocket);
+            ::unlink(Config::METRICS_SOCKET.c_str());
+        }
+        for (int fd : metricsWake)
+            if (fd >= 0) ::close(fd);
     }
-};
-
-struct FileRecord {
-    string id;
-    string name;
-    string owner;
-    Region region{Region::GLOBAL};
-    FileType type{FileType::OTHER};
-    string uploadDate;
-    double sizeMB{0.0};
-    string description;
-    bool   isPublic{false};
-    bool   encryptedAtRest{false};
 
-    string regionString() const {
-        switch (region) {
-            case Region::ASIA:    return "Asia";
-            case Region::EUROPE:  return "Europe";
-            case Region::AMERICA: return "America";
-            case Region::GLOBAL:  return "Global";
+    // Operation metrics in Prometheus text format, with gauges for content
+    // and replication.
+    string metricsText() const {
+        string out;
+        Metrics::appendPrometheus(out, Metrics::snapshot());
+        out += "# HELP cloud_users Registered users.\n# TYPE cloud_users gauge\n";
+        out += "cloud_users " + to_string(userRepo.size()) + "\n";
+        ChunkStore::Stats content = chunks.stats();
+        out += "# HELP cloud_content_bytes File content on disk (stored) and before dedup (logical).\n"
+               "# TYPE cloud_content_bytes gauge\n";
+        out += "cloud_content_bytes{kind=\"stored\"} " + to_string(content.storedBytes) + "\n";
+        out += "cloud_content_bytes{kind=\"logical\"} " + to_string(content.logicalBytes) + "\n";
+        Replicator::Status rep = replication.status();
+        string lagJobs, lagSeconds, online;
+        char num[32];
+        for (const auto& r : rep.replicas) {
+            string label = "{region=\"" + regionSlug(r.region) + "\"} ";
+            snprintf(num, sizeof(num), "%.3f", r.lagSeconds);
+            lagJobs += "cloud_replica_lag_jobs" + label + to_string(r.lagJobs) + "\n";
+            lagSeconds += "cloud_replica_lag_seconds" + label + num + "\n";
+            online += "cloud_replica_online" + label + (r.online ? "1" : "0") + "\n";
         }
-        return "Unknown";
+        out += "# HELP cloud_replica_lag_jobs Queued Global file changes a replica has not applied.\n"
+               "# TYPE cloud_replica_lag_jobs gauge\n" + lagJobs;
+        out += "# HELP cloud_replica_lag_seconds Age of the oldest change a replica has not applied.\n"
+               "# TYPE cloud_replica_lag_seconds gauge\n" + lagSeconds;
+        out += "# HELP cloud_replica_online Whether the replica is taking changes.\n"
+               "# TYPE cloud_replica_online gauge\n" + online;
+        return out;
     }
 
-    string typeString() const {
-        switch (type) {
-            case FileType::DOCUMENT: return "Document";
-            case FileType::IMAGE:    return "Image";
-            case FileType::VIDEO:    return "Video";
-            case FileType::AUDIO:    return "Audio";
-            case FileType::OTHER:    return "Other";
+    // Recomputes every user's usage from the file catalog and corrects any
+    // counter that has drifted from it (e.g. a crash between the catalog
+    // and user log writes). Counters are compared against a snapshot of
+    // per-owner totals first; only mismatches are rechecked under the
+    // user's lock.
+    UsageReport reconcileUsage() {
+        UsageReport report;
+        report.ranAt = time(nullptr);
+        unordered_map<string, int64_t> actual;
+        fileRepo.forEachOwnerBytes([&](const string& owner, int64_t bytes) { actual[owner] = bytes; });
+        vector<string> suspects;
+        userRepo.withColumns([&](const UserColumns& cols) {
+            report.usersChecked = cols.size();
+            for (size_t i = 0; i < cols.size(); ++i) {
+                auto it = actual.find(string(cols.name[i]));
+                if (cols.usedBytes[i] != (it == actual.end() ? 0 : it->second)) suspects.emplace_back(cols.name[i]);
+            }
+        });
+        for (const string& name : suspects) {
+            int64_t delta = reconcileUser(name);
+            if (delta == 0) continue;
+            ++report.usersCorrected;
+            report.driftBytes += delta < 0 ? -delta : delta;
         }
-        return "Unknown";
+        lock_guard<mutex> lk(reconcileMtx);
+        lastReconcile = report;
+        return report;
     }
-};
-
-// ================== Logger ==================
-class Logger {
-public:
-    static void log(AuditEventType type, const string& msg) {
-        ofstream out(Config::LOG_FILE, ios::app);
-        if (!out.is_open()) return;
 
-        string tag;
-        switch (type) {
-            case AuditEventType::SYSTEM:        tag = "SYSTEM"; break;
-            case AuditEventType::REGISTER:      tag = "REGISTER"; break;
-            case AuditEventType::LOGIN_SUCCESS: tag = "LOGIN_SUCCESS"; break;
-            case AuditEventType::LOGIN_FAIL:    tag = "LOGIN_FAIL"; break;
-            case AuditEventType::LOCKOUT:       tag = "LOCKOUT"; break;
-            case AuditEventType::LOGOUT:        tag = "LOGOUT"; break;
-            case AuditEventType::UPLOAD:        tag = "UPLOAD"; break;
-            case AuditEventType::DELETE:        tag = "DELETE"; break;
-            case AuditEventType::UPGRADE:       tag = "UPGRADE"; break;
-            case AuditEventType::ADMIN_ACTION:  tag = "ADMIN"; break;
-        }
-
-        out << "[" << getCurrentTime() << "]"
-            << "[" << tag << "] "
-            << msg << "\n";
+    UsageReport lastUsageReport() const {
+        lock_guard<mutex> lk(reconcileMtx);
+        return lastReconcile;
     }
-};
 
-// ================== UserRepository ==================
-class UserRepository {
-private:
-    unordered_map<string, User> users;
+    bool isLoggedIn() const { return currentUser != nullptr; }
+    User* current() { return currentUser; }
+    const UserRepository& users() const { return userRepo; }
+    FileRepository& files() { return fileRepo; }
 
-public:
-    UserRepository() { load(); }
+    // ---------- Session operations ----------
+    // Safe to call from many threads. Reads go through the repositories'
+    // shared locks; anything that changes a user's account or files holds
+    // that user's lock.
+    // A session token for a user who has just logged in.
+    string openSession(const string& username, Session& out) const {
+        SessionTokens::Claims c;
+        string token = sessions.issue(SessionTokens::Kind::SESSION, username, Config::SESSION_TTL_S, c);
+        out.id = c.id;
+        out.setUsername(username);
+        out.expiresAt = c.expires;
+        return token;
+    }
 
-    bool exists(const string& username) const {
-        return users.find(username) != users.end();
+    // The session a token stands for, if it is valid.
+    bool authenticate(string_view token, Session& out) const {
+        Metrics::Timer timer(Metrics::Op::AUTHENTICATE);
+        SessionTokens::Claims c;
+        if (!sessions.verify(token, SessionTokens::Kind::SESSION, c)) return false;
+        out.id = c.id;
+        out.setUsername(c.username());
+        out.expiresAt = c.expires;
+        return true;
     }
 
-    User* find(const string& username) {
-        auto it = users.find(username);
-        return it == users.end() ? nullptr : &it->second;
+    vector<FileRecord> filesFor(const Session& s) const {
+        Metrics::Timer timer(Metrics::Op::LIST);
+        return fileRepo.filesOf(string(s.username()));
     }
 
-    void add(const User& u) {
-        users[u.username] = u;
+    vector<FileRecord> searchFor(const Session& s, const string& term) {
+        Metrics::Timer timer(Metrics::Op::SEARCH);
+        return fileRepo.search(string(s.username()), term);
     }
 
-    const unordered_map<string, User>& all() const { return users; }
+    // The file, if it is the session user's own or public.
+    optional<FileRecord> fileFor(const Session& s, const FileId& id) const {
+        auto fr = fileRepo.getFile(id);
+        if (fr && fr->owner != s.username() && !fr->isPublic) return nullopt;
+        return fr;
+    }
 
-    bool save() {
-        ofstream file(Config::USERS_FILE);
-        if (!file.is_open()) return false;
-        for (const auto& [name, u] : users) {
-            file << u.username << "|"
-                 << u.salt << "|"
-                 << u.passwordHash << "|"
-                 << u.fullName << "|"
-                 << u.age << "|"
-                 << u.gender << "|"
-                 << static_cast<int>(u.role) << "|"
-                 << u.usedStorage << "|"
-                 << u.registrationDate << "|"
-                 << u.isActive << "|"
-                 << u.failedLogins << "|"
-                 << u.isLocked << "|"
-                 << u.lastLoginTime << "|"
-                 << u.mfaEnabled << "\n";
+    // Stores a new file for the session's user if it fits their quota. The
+    // bytes are reserved up front without the user lock, so one user's
+    // uploads can proceed together but never overcommit; the lock is only
+    // taken to settle the reservation and log the new total.
+    ApiStatus storeFile(const Session& s, FileRecord fr) {
+        Metrics::Timer timer(Metrics::Op::UPLOAD);
+        if (fr.sizeBytes <= 0 || fr.name.size() > UserFiles::MAX_NAME) return ApiStatus::BAD_REQUEST;
+        fr.owner.assign(s.username());
+        auto& userLock = userLocks.forKey(fr.owner);
+        User* u;
+        int64_t limit;
+        {
+            lock_guard<mutex> lk(userLock);
+            u = userRepo.find(fr.owner);
+            if (!u) return ApiStatus::NOT_FOUND;
+            limit = u->storageLimit();
         }
-        return true;
+        if (!u->usedBytes.tryReserve(fr.sizeBytes, limit)) return ApiStatus::QUOTA_EXCEEDED;
+        if (fr.id.empty()) fr.id = generateFileId();
+        if (fr.uploaded == 0) fr.uploaded = time(nullptr);
+        return addReserved(*u, fr);
     }
 
-    bool load() {
-        ifstream file(Config::USERS_FILE);
-        if (!file.is_open()) return true;
-        string line;
-        while (getline(file, line)) {
-            stringstream ss(line);
-            string token;
-            User u;
-
-            getline(ss, u.username, '|');
-            getline(ss, u.salt, '|');
-            getline(ss, u.passwordHash, '|');
-            getline(ss, u.fullName, '|');
-            getline(ss, token, '|'); u.age = stoi(token);
-            getline(ss, u.gender, '|');
-            getline(ss, token, '|'); u.role = static_cast<UserRole>(stoi(token));
-            getline(ss, token, '|'); u.usedStorage = stod(token);
-            getline(ss, token, '|'); u.registrationDate = stol(token);
-            getline(ss, token, '|'); u.isActive = (token == "1");
-            getline(ss, token, '|'); u.failedLogins = stoi(token);
-            getline(ss, token, '|'); u.isLocked = (token == "1");
-            getline(ss, token, '|'); u.lastLoginTime = stol(token);
-            getline(ss, token, '|'); u.mfaEnabled = (token == "1");
-
-            users[u.username] = u;
+    // Stores a file's bytes, read from content to the end, in the chunk
+    // store and records it with their exact size; fr gets the id, owner
+    // and size. Quota is reserved block by block as the content arrives,
+    // and the next block is read while the current one is stored. With
+    // fr.encryptedAtRest the bytes are encrypted under a new data key.
+    ApiStatus storeFile(const Session& s, FileRecord& fr, istream& content) {
+        Metrics::Timer timer(Metrics::Op::UPLOAD);
+        if (fr.name.size() > UserFiles::MAX_NAME) return ApiStatus::BAD_REQUEST;
+        fr.owner.assign(s.username());
+        auto& userLock = userLocks.forKey(fr.owner);
+        User* u;
+        int64_t limit;
+        {
+            lock_guard<mutex> lk(userLock);
+            u = userRepo.find(fr.owner);
+            if (!u) return ApiStatus::NOT_FOUND;
+            limit = u->storageLimit();
         }
-        return true;
+        if (!u->usedBytes.tryReserve(0, limit)) return ApiStatus::QUOTA_EXCEEDED;
+
+        if (fr.id.empty()) fr.id = generateFileId();
+        if (fr.uploaded == 0) fr.uploaded = time(nullptr);
+
+        ChunkStore::Upload up(chunks);
+        string wrappedKey;
+        if (fr.encryptedAtRest) {
+            uint8_t dek[KeyRing::KEY_SIZE];
+            KeyRing::newDataKey(dek);
+            up.encryptWith(dek);
+            wrappedKey = keys.wrap(fr.owner, fr.id, dek);
+            KeyRing::wipe(dek, sizeof(dek));
+        }
+        int64_t reserved = 0;
+        ApiStatus st = ApiStatus::OK;
+        {
+            ReadAhead source([&](string& block) {
+                block.resize(Config::UPLOAD_BLOCK_BYTES);
+                content.read(&block[0], (streamsize)block.size());
+                block.resize((size_t)max<streamsize>(content.gcount(), 0));
+                return !block.empty();
+            });
+            string block;
+            while (source.next(block)) {
+                int64_t n = (int64_t)block.size();
+                if (!u->usedBytes.tryGrow(n, limit)) { st = ApiStatus::QUOTA_EXCEEDED; break; }
+                reserved += n;
+                if (!up.write(block.data(), block.size())) { st = ApiStatus::IO_ERROR; break; }
+            }
+        }
+        if (st == ApiStatus::OK && content.bad()) st = ApiStatus::IO_ERROR;
+        if (st == ApiStatus::OK && up.size() == 0) st = ApiStatus::BAD_REQUEST;
+
+        fr.sizeBytes = (int64_t)up.size();
+        if (st == ApiStatus::OK && !chunks.commit(fr.id, up, wrappedKey)) st = ApiStatus::IO_ERROR;
+        if (st != ApiStatus::OK) {
+            u->usedBytes.cancel(reserved);
+            return st;
+        }
+        st = addReserved(*u, fr);
+        if (st == ApiStatus::IO_ERROR && !fileRepo.contains(fr.id)) chunks.remove(fr.id);
+        if (st == ApiStatus::OK) Metrics::add(Metrics::Counter::UPLOADED_BYTES, uint64_t(fr.sizeBytes));
+        return st;
+    }
+
+    // Writes a stored file's bytes to out. NOT_FOUND also covers files
+    // recorded without content.
+    ApiStatus readContent(const Session& s, const FileId& id, ostream& out) {
+        Metrics::Timer timer(Metrics::Op::DOWNLOAD);
+        auto fr = fileFor(s, id);
+        string wrappedKey;
+        if (!fr || !chunks.keyOf(id, wrappedKey)) return ApiStatus::NOT_FOUND;
+        uint8_t dek[KeyRing::KEY_SIZE];
+        bool encrypted = !wrappedKey.empty();
+        if (encrypted && !keys.unwrap(fr->owner, id, wrappedKey, dek)) return ApiStatus::IO_ERROR;
+        uint64_t bytes = 0;
+        bool ok = chunks.read(id, [&](const char* data, size_t len) {
+            out.write(data, (streamsize)len);
+            bytes += len;
+        }, encrypted ? dek : nullptr);
+        KeyRing::wipe(dek, sizeof(dek));
+        Metrics::add(Metrics::Counter::DOWNLOADED_BYTES, bytes);
+        return ok && out ? ApiStatus::OK : ApiStatus::IO_ERROR;
     }
-};
 
-// ================== FileRepository ==================
-class FileRepository {
 private:
-    unordered_map<string, vector<FileRecord>> filesByUser;
+    // Records a file for its owner u, whose bytes are already reserved on
+    // u's counter, and settles the reservation. The file is added before
+    // the user lock is taken: its id is new, so no other change to it can
+    // race the add.
+    ApiStatus addReserved(User& u, const FileRecord& fr) {
+        if (!fileRepo.addFile(fr.owner, fr)) {
+            u.usedBytes.cancel(fr.sizeBytes);
+            return ApiStatus::IO_ERROR;
+        }
+        unique_lock<mutex> lk(userLocks.forKey(fr.owner));
+        u.usedBytes.commit();
+        uint64_t lsn = replicate(fr.id, fr.region);
+        if (!persistUser(u)) return ApiStatus::IO_ERROR;
+        Logger::log(AuditEventType::UPLOAD, fr.owner, AuditReason::NONE, fr.name);
+        lk.unlock();
+        if (lsn) replication.settle(lsn);
+        return ApiStatus::OK;
+    }
+
+    // Queues a change to a GLOBAL file for the replicas; 0 for other
+    // regions. Called under the owner's lock, so one file's jobs queue in
+    // the order its changes were made.
+    uint64_t replicate(const FileId& id, Region region) {
+        return region == Region::GLOBAL ? replication.enqueue(id) : 0;
+    }
 
 public:
-    FileRepository() {
-        fs::create_directories(Config::DATA_DIR);
+    ApiStatus removeFile(const Session& s, const FileId& id) {
+        Metrics::Timer timer(Metrics::Op::DELETE);
+        unique_lock<mutex> lk(userLocks.forKey(s.username()));
+        auto fr = fileFor(s, id);   // another user's private file reads as missing
+        if (!fr) return ApiStatus::NOT_FOUND;
+        if (fr->owner != s.username()) return ApiStatus::FORBIDDEN;
+        User* u = userRepo.find(fr->owner);
+        if (!u) return ApiStatus::NOT_FOUND;
+        if (!fileRepo.deleteFile(id)) return ApiStatus::IO_ERROR;
+        chunks.remove(id);
+        uint64_t lsn = replicate(id, fr->region);
+
+        u->usedBytes.release(fr->sizeBytes);
+        if (!persistUser(*u)) return ApiStatus::IO_ERROR;
+        Logger::log(AuditEventType::DELETE, fr->owner, AuditReason::NONE, fr->name);
+        lk.unlock();
+        if (lsn) replication.settle(lsn);
+        return ApiStatus::OK;
+    }
+
+    ApiStatus setFileVisibility(const Session& s, const FileId& id, bool isPublic) {
+        Metrics::Timer timer(Metrics::Op::VISIBILITY);
+        unique_lock<mutex> lk(userLocks.forKey(s.username()));
+        auto fr = fileFor(s, id);
+        if (!fr) return ApiStatus::NOT_FOUND;
+        if (fr->owner != s.username()) return ApiStatus::FORBIDDEN;
+        if (!fileRepo.setPublic(id, isPublic)) return ApiStatus::IO_ERROR;
+        uint64_t lsn = replicate(id, fr->region);
+        lk.unlock();
+        if (lsn) replication.settle(lsn);
+        return ApiStatus::OK;
+    }
+
+    // ---------- Replication ----------
+    Replicator::Status replicationStatus() const { return replication.status(); }
+    void setReplicationAck(Replicator::Ack ack) { replication.setAck(ack); }
+    bool setReplicaOnline(Region region, bool online) { return replication.setOnline(region, online); }
+    bool drainReplication(chrono::milliseconds timeout) { return replication.drain(timeout); }
+
+    // ---------- Programmatic API ----------
+    // Console-free counterparts of the menu actions. Inputs are validated
+    // here rather than by prompts, so callers only see an ApiStatus.
+    ApiStatus registerUser(const RegisterRequest& req) {
+        Metrics::Timer timer(Metrics::Op::REGISTER);
+        if (!usernameProblem(req.username).empty() || !passwordProblem(req.password).empty() ||
+            !storableText(req.fullName) || req.age < 1 || req.age > 120 ||
+            (req.gender != "M" && req.gender != "m" && req.gender != "F" && req.gender != "f"))
+            return ApiStatus::BAD_REQUEST;
+
+        if (userRepo.exists(req.username)) return ApiStatus::ALREADY_EXISTS;   // before paying for the hash
+
+        User u;
+        u.username = req.username;
+        if (!hashPassword(req.password, u.salt, u.passwordHash)) return ApiStatus::BUSY;
+        u.fullName = req.fullName;
+        u.age = req.age;
+        u.gender = req.gender;
+        u.role = UserRole::FREE_USER;
+        u.usedBytes = 0;
+        u.registrationDate = time(nullptr);
+        u.isActive = true;
+        u.failedLogins = 0;
+        u.isLocked = false;
+        u.lastLoginTime = 0;
+        u.mfaEnabled = false;
+
+        lock_guard<mutex> lk(userLocks.forKey(u.username));
+        if (userRepo.exists(u.username)) return ApiStatus::ALREADY_EXISTS;
+        userRepo.add(u);
+        if (!persistUser(u)) return ApiStatus::IO_ERROR;
+        Logger::log(AuditEventType::REGISTER, u.username);
+        return ApiStatus::OK;
     }
 
-    vector<FileRecord>& filesOf(const string& username) {
-        return filesByUser[username];
+    // Password check with the same lockout rules as the console. Returns a
+    // session token, or for MFA users a challenge for verifyMfa().
+    LoginReply login(const LoginRequest& req) {
+        Metrics::Timer timer(Metrics::Op::LOGIN);
+        LoginReply reply;
+        LoginResult r = verifyLogins({LoginAttempt{req.username, req.password}})[0];
+        reply.failedLogins = r.failedLogins;
+        switch (r.status) {
+            case LoginStatus::OK: {
+                Session s;
+                reply.status = ApiStatus::OK;
+                reply.token = openSession(req.username, s);
+                reply.expiresAt = s.expiresAt;
+                break;
+            }
+            case LoginStatus::MFA_REQUIRED: {
+                SessionTokens::Claims c;
+                reply.status = ApiStatus::MFA_REQUIRED;
+                reply.mfaChallenge = sessions.issue(SessionTokens::Kind::MFA_CHALLENGE, req.username,
+                                                    Config::MFA_CHALLENGE_TTL_S, c);
+                reply.expiresAt = c.expires;
+                reply.mfaCode = sessions.mfaCode(c);
+                break;
+            }
+            case LoginStatus::INACTIVE:     reply.status = ApiStatus::INACTIVE; break;
+            case LoginStatus::BUSY:         reply.status = ApiStatus::BUSY; break;
+            case LoginStatus::LOCKED:
+            case LoginStatus::LOCKED_OUT:   reply.status = ApiStatus::LOCKED; break;
+            default:                        reply.status = ApiStatus::BAD_CREDENTIALS; break;
+        }
+        return reply;
     }
 
-    const vector<FileRecord>& filesOfConst(const string& username) const {
-        static vector<FileRecord> empty;
-        auto it = filesByUser.find(username);
-        return it == filesByUser.end() ? empty : it->second;
+    // Second step of an MFA login: the code for a challenge from login().
+    // Each challenge takes one answer; a wrong code means logging in again.
+    LoginReply verifyMfa(const MfaRequest& req) {
+        Metrics::Timer timer(Metrics::Op::MFA);
+        LoginReply reply;
+        SessionTokens::Claims c;
+        if (!sessions.verify(req.challenge, SessionTokens::Kind::MFA_CHALLENGE, c) ||
+            sessions.revoke(c.id, c.expires) == RevocationSet::Result::ALREADY)
+            return reply;
+        string username(c.username());
+        string expected = sessions.mfaCode(c);
+        if (req.code.size() != expected.size() ||
+            !constantTimeEqual(reinterpret_cast<const uint8_t*>(req.code.data()),
+                               reinterpret_cast<const uint8_t*>(expected.data()), expected.size())) {
+            Logger::log(AuditEventType::LOGIN_FAIL, username, AuditReason::MFA_FAILED);
+            return reply;
+        }
+
+        User* u = userRepo.find(username);
+        if (!u) return reply;
+        {
+            lock_guard<mutex> lk(userLocks.forKey(username));
+            reply.failedLogins = u->failedLogins;
+            if (!u->isActive) { reply.status = ApiStatus::INACTIVE; return reply; }
+            if (u->isLocked) { reply.status = ApiStatus::LOCKED; return reply; }
+            u->failedLogins = 0;
+            u->lastLoginTime = time(nullptr);
+            reply.failedLogins = 0;
+            if (!persistUser(*u)) { reply.status = ApiStatus::IO_ERROR; return reply; }
+        }
+        Logger::log(AuditEventType::LOGIN_SUCCESS, username);
+        Session s;
+        reply.status = ApiStatus::OK;
+        reply.token = openSession(username, s);
+        reply.expiresAt = s.expiresAt;
+        return reply;
     }
 
-    const unordered_map<string, vector<FileRecord>>& allFiles() const {
-        return filesByUser;
+    // Revokes the token until it would have expired.
+    ApiStatus logout(const string& token) {
+        Session s;
+        if (!authenticate(token, s)) return ApiStatus::NO_SESSION;
+        switch (sessions.revoke(s.id, s.expiresAt)) {
+            case RevocationSet::Result::ALREADY:     return ApiStatus::NO_SESSION;
+            case RevocationSet::Result::NOT_DURABLE: return ApiStatus::IO_ERROR;
+            case RevocationSet::Result::REVOKED:     break;
+        }
+        Logger::log(AuditEventType::LOGOUT, string(s.username()));
+        return ApiStatus::OK;
     }
 
-    bool saveUserFiles(const string& username) {
-        string filename = Config::DATA_DIR + username + ".dat";
-        ofstream file(filename);
-        if (!file.is_open()) return false;
-
-        for (const auto& fr : filesByUser[username]) {
-            file << fr.id << "|"
-                 << fr.name << "|"
-                 << fr.owner << "|"
-                 << static_cast<int>(fr.region) << "|"
-                 << static_cast<int>(fr.type) << "|"
-                 << fr.uploadDate << "|"
-                 << fr.sizeMB << "|"
-                 << fr.description << "|"
-                 << fr.isPublic << "|"
-                 << fr.encryptedAtRest << "\n";
+    UploadReply uploadFile(const UploadRequest& req) {
+        UploadReply reply;
+        Session s;
+        if (!authenticate(req.token, s)) { reply.status = ApiStatus::NO_SESSION; return reply; }
+        if (req.name.empty() || !storableText(req.name) || !storableText(req.description) ||
+            (req.sourcePath.empty() && req.sizeBytes <= 0)) {
+            reply.status = ApiStatus::BAD_REQUEST;
+            return reply;
         }
-        return true;
+        FileRecord fr;
+        fr.id = generateFileId();
+        fr.name = req.name;
+        fr.sizeBytes = req.sizeBytes;
+        fr.type = detectFileType(fr.name);
+        fr.region = req.region;
+        fr.description = req.description;
+        fr.isPublic = req.isPublic;
+        fr.encryptedAtRest = req.encryptedAtRest;
+        if (req.sourcePath.empty()) {
+            reply.status = storeFile(s, fr);
+        } else {
+            ifstream in(req.sourcePath, ios::binary);
+            reply.status = in ? storeFile(s, fr, in) : ApiStatus::NOT_FOUND;
+        }
+        if (reply.status == ApiStatus::OK) reply.fileId = fr.id;
+        return reply;
     }
 
-    bool loadUserFiles(const string& username) {
-        string filename = Config::DATA_DIR + username + ".dat";
-        ifstream file(filename);
-        if (!file.is_open()) return true;
+    // Writes the file's stored bytes to targetPath.
+    ApiStatus downloadFile(const FileRequest& req, const string& targetPath) {
+        Session s;
+        if (!authenticate(req.token, s)) return ApiStatus::NO_SESSION;
+        if (!fileFor(s, req.fileId) || !chunks.has(req.fileId)) return ApiStatus::NOT_FOUND;
+        ofstream out(targetPath, ios::binary | ios::trunc);
+        if (!out) return ApiStatus::IO_ERROR;
+        ApiStatus st = readContent(s, req.fileId, out);
+        out.close();
+        return st == ApiStatus::OK && !out ? ApiStatus::IO_ERROR : st;
+    }
 
-        filesByUser[username].clear();
-        string line;
-        while (getline(file, line)) {
-            stringstream ss(line);
-            string token;
-            FileRecord fr;
+    ApiStatus deleteFile(const FileRequest& req) {
+        Session s;
+        if (!authenticate(req.token, s)) return ApiStatus::NO_SESSION;
+        return removeFile(s, req.fileId);
+    }
+
+    FilesReply listFiles(const string& token) {
+        FilesReply reply;
+        Session s;
+        if (!authenticate(token, s)) reply.status = ApiStatus::NO_SESSION;
+        else reply.files = filesFor(s);
+        return reply;
+    }
 
-            getline(ss, fr.id, '|');
-            getline(ss, fr.name, '|');
-            getline(ss, fr.owner, '|');
-            getline(ss, token, '|'); fr.region = static_cast<Region>(stoi(token));
-            getline(ss, token, '|'); fr.type   = static_cast<FileType>(stoi(token));
-            getline(ss, fr.uploadDate, '|');
-            getline(ss, token, '|'); fr.sizeMB = stod(token);
-            getline(ss, fr.description, '|');
-            getline(ss, token, '|'); fr.isPublic = (token == "1");
-            getline(ss, token, '|'); fr.encryptedAtRest = (token == "1");
+    FilesReply searchFiles(const SearchRequest& req) {
+        FilesReply reply;
+        Session s;
+        if (!authenticate(req.token, s)) reply.status = ApiStatus::NO_SESSION;
+        else reply.files = searchFor(s, req.term);
+        return reply;
+    }
 
-            filesByUser[username].push_back(fr);
+    FilesReply getFile(const FileRequest& req) const {
+        Metrics::Timer timer(Metrics::Op::GET);
+        FilesReply reply;
+        Session s;
+        if (!authenticate(req.token, s)) {
+            reply.status = ApiStatus::NO_SESSION;
+        } else if (auto fr = fileFor(s, req.fileId)) {
+            reply.files.push_back(std::move(*fr));
+        } else {
+            reply.status = ApiStatus::NOT_FOUND;
         }
-        return true;
+        return reply;
     }
-};
 
-// ================== CloudEngine ==================
-class CloudEngine {
-private:
-    UserRepository userRepo;
-    FileRepository fileRepo;
-    User* currentUser{nullptr};
+    ApiStatus setVisibility(const VisibilityRequest& req) {
+        Session s;
+        if (!authenticate(req.token, s)) return ApiStatus::NO_SESSION;
+        return setFileVisibility(s, req.fileId, req.isPublic);
+    }
 
-public:
-    CloudEngine() = default;
+    PublicCatalog::Page publicFiles(const PublicRequest& req) {
+        return fileRepo.publicPage(req.order, req.after, req.limit);
+    }
 
-    bool isLoggedIn() const { return currentUser != nullptr; }
-    User* current() { return currentUser; }
-    const UserRepository& users() const { return userRepo; }
-    FileRepository& files() { return fileRepo; }
+    // ---------- Batches ----------
+    // Between beginBatch() and endBatch() user and file log writes are not
+    // synced one by one; flushBatch() makes everything so far durable with
+    // one sync per touched log. Replies given before a flush are not yet
+    // crash safe.
+    void beginBatch() {
+        batching = true;
+        fileRepo.setDeferredSync(true);
+        chunks.setDeferredSync(true);
+    }
+
+    bool flushBatch() {
+        bool ok = chunks.flush();
+        ok = fileRepo.flush() && ok;
+        uint64_t lsn = batchLsn.exchange(0);
+        if (lsn) ok = userRepo.commit(lsn) && ok;
+        return ok;
+    }
+
+    bool endBatch() {
+        bool ok = flushBatch();
+        fileRepo.setDeferredSync(false);
+        chunks.setDeferredSync(false);
+        batching = false;
+        return ok;
+    }
 
     // ---------- Auth ----------
     bool registerUser() {
@@ -420,8 +8016,9 @@ public:
         while (true) {
             cout << "Username: ";
             getline(cin, u.username);
-            if (u.username.size() < 3) {
-                cout << "Username must be at least 3 characters.\n";
+            string problem = usernameProblem(u.username);
+            if (!problem.empty()) {
+                cout << problem << "\n";
                 continue;
             }
             if (userRepo.exists(u.username)) {
@@ -435,17 +8032,9 @@ public:
         while (true) {
             cout << "Password (min " << Config::PASSWORD_MIN_LEN << " chars, letters+digits): ";
             getline(cin, pwd);
-            if ((int)pwd.size() < Config::PASSWORD_MIN_LEN) {
-                cout << "Password too short.\n";
-                continue;
-            }
-            bool hasDigit = false, hasAlpha = false;
-            for (char c : pwd) {
-                if (isdigit((unsigned char)c)) hasDigit = true;
-                if (isalpha((unsigned char)c)) hasAlpha = true;
-            }
-            if (!hasDigit || !hasAlpha) {
-                cout << "Password must contain both letters and digits.\n";
+            string problem = passwordProblem(pwd);
+            if (!problem.empty()) {
+                cout << problem << "\n";
                 continue;
             }
             cout << "Confirm password: ";
@@ -458,8 +8047,10 @@ public:
             break;
         }
 
-        u.salt = generateSalt();
-        u.passwordHash = sha256(u.salt + pwd);
+        if (!hashPassword(pwd, u.salt, u.passwordHash)) {
+            cout << "Server busy, please try again.\n";
+            return false;
+        }
 
         cout << "Full name: ";
         getline(cin, u.fullName);
@@ -485,7 +8076,7 @@ public:
         }
 
         u.role = UserRole::FREE_USER;
-        u.usedStorage = 0.0;
+        u.usedBytes = 0;
         u.registrationDate = time(nullptr);
         u.isActive = true;
         u.failedLogins = 0;
@@ -493,10 +8084,15 @@ public:
         u.lastLoginTime = 0;
         u.mfaEnabled = false;
 
+        lock_guard<mutex> lk(userLocks.forKey(u.username));
+        if (userRepo.exists(u.username)) {
+            cout << "Username already exists.\n";
+            return false;
+        }
         userRepo.add(u);
-        if (userRepo.save()) {
+        if (userRepo.persist(u)) {
             cout << "\nAccount created. Welcome, " << u.salutation() << " " << u.fullName << "!\n";
-            Logger::log(AuditEventType::REGISTER, "User=" + u.username);
+            Logger::log(AuditEventType::REGISTER, u.username);
             return true;
         }
         cout << "Failed to save user.\n";
@@ -514,33 +8110,48 @@ public:
         User* u = userRepo.find(username);
         if (!u) {
             cout << "Invalid credentials.\n";
-            Logger::log(AuditEventType::LOGIN_FAIL, "User=" + username + " reason=not_found");
+            Logger::log(AuditEventType::LOGIN_FAIL, username, AuditReason::NOT_FOUND);
             return false;
         }
 
+        unique_lock<mutex> lk(userLocks.forKey(username));
         if (!u->isActive) {
             cout << "Account is deactivated.\n";
-            Logger::log(AuditEventType::LOGIN_FAIL, "User=" + username + " reason=inactive");
+            Logger::log(AuditEventType::LOGIN_FAIL, username, AuditReason::INACTIVE);
+            return false;
+        }
+
+        if (u->isLocked) {
+            cout << "Account is locked due to too many failed attempts.\n";
+            Logger::log(AuditEventType::LOGIN_FAIL, username, AuditReason::LOCKED);
             return false;
         }
 
+        // The hash runs on the KDF pool without the user's lock
+        string stored = u->passwordHash, salt = u->salt;
+        lk.unlock();
+        LoginStatus check = checkPassword(salt, stored, password);
+        lk.lock();
+        if (check == LoginStatus::BUSY) {
+            cout << "Server busy, please try again.\n";
+            return false;
+        }
         if (u->isLocked) {
             cout << "Account is locked due to too many failed attempts.\n";
-            Logger::log(AuditEventType::LOGIN_FAIL, "User=" + username + " reason=locked");
+            Logger::log(AuditEventType::LOGIN_FAIL, username, AuditReason::LOCKED);
             return false;
         }
 
-        string hash = sha256(u->salt + password);
-        if (hash != u->passwordHash) {
+        if (check != LoginStatus::OK) {
             u->failedLogins++;
-            Logger::log(AuditEventType::LOGIN_FAIL, "User=" + username + " reason=bad_password");
+            Logger::log(AuditEventType::LOGIN_FAIL, username, AuditReason::BAD_PASSWORD);
             if (u->failedLogins >= Config::MAX_FAILED_LOGINS) {
                 u->isLocked = true;
-                userRepo.save();
+                userRepo.persist(*u);
                 cout << "Too many failed attempts. Account locked.\n";
-                Logger::log(AuditEventType::LOCKOUT, "User=" + username);
+                Logger::log(AuditEventType::LOCKOUT, username, AuditReason::TOO_MANY_FAILURES);
             } else {
-                userRepo.save();
+                userRepo.persist(*u);
                 cout << "Invalid credentials. Attempts: " << u->failedLogins << "/" << Config::MAX_FAILED_LOGINS << "\n";
             }
             return false;
@@ -552,10 +8163,12 @@ public:
             cout << "[MFA] Code: " << code << " (for demo)\n";
             cout << "Enter MFA code: ";
             string input;
+            lk.unlock();
             getline(cin, input);
+            lk.lock();
             if (input != code) {
                 cout << "Invalid MFA code.\n";
-                Logger::log(AuditEventType::LOGIN_FAIL, "User=" + username + " reason=mfa_failed");
+                Logger::log(AuditEventType::LOGIN_FAIL, username, AuditReason::MFA_FAILED);
                 return false;
             }
         }
@@ -563,24 +8176,158 @@ public:
         u->failedLogins = 0;
         u->isLocked = false;
         u->lastLoginTime = time(nullptr);
-        userRepo.save();
+        userRepo.persist(*u);
+        lk.unlock();
+        if (PasswordHash::needsRehash(stored))
+            if (uint64_t lsn = upgradeHashes({HashUpgrade{u, stored, &password}})) commitUsers(lsn);
 
         currentUser = u;
+        consoleToken = openSession(username, console);
         fileRepo.loadUserFiles(currentUser->username);
 
         cout << "\nWelcome back, " << currentUser->salutation() << " " << currentUser->fullName << "!\n";
         cout << "Role: " << currentUser->roleString() << "\n";
-        cout << "Storage: " << formatFileSize(currentUser->usedStorage)
+        cout << "Storage: " << formatFileSize(currentUser->usedBytes.load())
              << " / " << formatFileSize(currentUser->storageLimit()) << "\n";
 
-        Logger::log(AuditEventType::LOGIN_SUCCESS, "User=" + currentUser->username);
+        Logger::log(AuditEventType::LOGIN_SUCCESS, currentUser->username);
         return true;
     }
 
+    // Verifies many credentials at once, e.g. a reconnect storm after an
+    // outage. Legacy salted SHA-256 digests are computed together through
+    // sha256Batch, KDF hashes as one batch on the KDF pool; all are compared
+    // in constant time. Lockout bookkeeping matches login(), and changed
+    // users are committed to the log with a single sync. Attempts whose
+    // hash was not computed in time get BUSY and change nothing. MFA users
+    // whose password checks out get MFA_REQUIRED and keep their counters,
+    // since the second factor is still outstanding. Passwords that check out
+    // under an outdated scheme are rehashed. Does not change currentUser.
+    vector<LoginResult> verifyLogins(const vector<LoginAttempt>& attempts) {
+        Metrics::Timer timer(Metrics::Op::VERIFY_LOGINS);
+        vector<LoginResult> results(attempts.size());
+        const size_t D = SHA256::DIGEST_SIZE;
+        vector<User*> owners(attempts.size(), nullptr);
+        vector<string> salts(attempts.size()), stored(attempts.size());
+        vector<uint8_t> expected(attempts.size() * D), digests(attempts.size() * D);
+        vector<LoginStatus> checks(attempts.size(), LoginStatus::BUSY);   // outcome of the hash alone
+        vector<Sha256Job> jobs;
+        vector<KdfPool::Request> kdfReqs;
+        vector<size_t> kdfIndex, shaIndex;
+        jobs.reserve(attempts.size());
+
+        for (size_t i = 0; i < attempts.size(); ++i) {
+            User* u = userRepo.find(attempts[i].username);
+            owners[i] = u;
+            if (!u) continue;
+            {
+                lock_guard<mutex> lk(userLocks.forKey(attempts[i].username));
+                if (!u->isActive || u->isLocked) continue;
+                salts[i] = u->salt;
+                stored[i] = u->passwordHash;
+            }
+            PasswordHash::Params params;
+            if (!PasswordHash::parse(stored[i], params, &expected[i * D])) {
+                checks[i] = LoginStatus::BAD_PASSWORD;
+            } else if (params.scheme == PasswordHash::Scheme::SHA256_SALTED) {
+                Sha256Job job;
+                job.head    = reinterpret_cast<const uint8_t*>(salts[i].data());
+                job.headLen = salts[i].size();
+                job.tail    = reinterpret_cast<const uint8_t*>(attempts[i].password.data());
+                job.tailLen = attempts[i].password.size();
+                job.digest  = &digests[i * D];
+                jobs.push_back(job);
+                shaIndex.push_back(i);
+            } else {
+                KdfPool::Request req;
+                req.params = params;
+                req.salt = salts[i];
+                req.password = attempts[i].password;
+                kdfReqs.push_back(std::move(req));
+                kdfIndex.push_back(i);
+            }
+        }
+        sha256Batch(jobs.data(), jobs.size());
+        for (size_t i : shaIndex)
+            checks[i] = constantTimeEqual(&expected[i * D], &digests[i * D], D) ? LoginStatus::OK
+                                                                                : LoginStatus::BAD_PASSWORD;
+        kdf.run(kdfReqs, KdfPool::Clock::now() + chrono::milliseconds(Config::KDF_DEADLINE_MS));
+        for (size_t k = 0; k < kdfIndex.size(); ++k) {
+            size_t i = kdfIndex[k];
+            if (kdfReqs[k].outcome == KdfPool::Outcome::DONE)
+                checks[i] = constantTimeEqual(&expected[i * D], kdfReqs[k].digest, D) ? LoginStatus::OK
+                                                                                      : LoginStatus::BAD_PASSWORD;
+        }
+
+        uint64_t lastLsn = 0;
+        vector<HashUpgrade> upgrades;
+        for (size_t i = 0; i < attempts.size(); ++i) {
+            const string& username = attempts[i].username;
+            User* u = owners[i];
+            LoginResult& r = results[i];
+
+            if (!u) {
+                r.status = LoginStatus::NOT_FOUND;
+                Logger::log(AuditEventType::LOGIN_FAIL, username, AuditReason::NOT_FOUND);
+                continue;
+            }
+            lock_guard<mutex> lk(userLocks.forKey(username));
+            r.failedLogins = u->failedLogins;
+            if (!u->isActive) {
+                r.status = LoginStatus::INACTIVE;
+                Logger::log(AuditEventType::LOGIN_FAIL, username, AuditReason::INACTIVE);
+                continue;
+            }
+            // Re-checked here: an earlier attempt in this batch may have locked the account
+            if (u->isLocked) {
+                r.status = LoginStatus::LOCKED;
+                Logger::log(AuditEventType::LOGIN_FAIL, username, AuditReason::LOCKED);
+                continue;
+            }
+            if (checks[i] == LoginStatus::BUSY) {
+                r.status = LoginStatus::BUSY;
+                continue;
+            }
+
+            bool match = checks[i] == LoginStatus::OK;
+            if (match && PasswordHash::needsRehash(stored[i]))
+                upgrades.push_back(HashUpgrade{u, stored[i], &attempts[i].password});
+            if (!match) {
+                u->failedLogins++;
+                Logger::log(AuditEventType::LOGIN_FAIL, username, AuditReason::BAD_PASSWORD);
+                if (u->failedLogins >= Config::MAX_FAILED_LOGINS) {
+                    u->isLocked = true;
+                    r.status = LoginStatus::LOCKED_OUT;
+                    Logger::log(AuditEventType::LOCKOUT, username, AuditReason::TOO_MANY_FAILURES);
+                } else {
+                    r.status = LoginStatus::BAD_PASSWORD;
+                }
+                lastLsn = userRepo.append(*u);
+            } else if (u->mfaEnabled) {
+                r.status = LoginStatus::MFA_REQUIRED;
+            } else {
+                u->failedLogins = 0;
+                u->isLocked = false;
+                u->lastLoginTime = time(nullptr);
+                lastLsn = userRepo.append(*u);
+                r.status = LoginStatus::OK;
+                Logger::log(AuditEventType::LOGIN_SUCCESS, username);
+            }
+            r.failedLogins = u->failedLogins;
+        }
+
+        lastLsn = max(lastLsn, upgradeHashes(upgrades));
+        if (lastLsn) commitUsers(lastLsn);
+        return results;
+    }
+
     void logout() {
         if (!currentUser) return;
         cout << "\nGoodbye, " << currentUser->salutation() << " " << currentUser->fullName << "!\n";
-        Logger::log(AuditEventType::LOGOUT, "User=" + currentUser->username);
+        Logger::log(AuditEventType::LOGOUT, currentUser->username);
+        sessions.revoke(console.id, console.expiresAt);
+        console = Session();
+        consoleToken.clear();
         currentUser = nullptr;
     }
 
@@ -600,28 +8347,42 @@ public:
                 cout << "File name cannot be empty.\n";
                 continue;
             }
+            if (fr.name.size() > UserFiles::MAX_NAME) {
+                cout << "File name is too long.\n";
+                continue;
+            }
             break;
         }
 
+        ifstream content;
         while (true) {
-            cout << "File size (MB): ";
-            string sizeStr;
-            getline(cin, sizeStr);
-            try {
-                fr.sizeMB = stod(sizeStr);
-                if (fr.sizeMB <= 0) throw out_of_range("");
-                double newTotal = currentUser->usedStorage + fr.sizeMB;
-                if (newTotal > currentUser->storageLimit()) {
-                    cout << "Storage limit exceeded. Available: "
-                         << formatFileSize(currentUser->storageLimit() - currentUser->usedStorage) << "\n";
-                    if (currentUser->role == UserRole::FREE_USER)
-                        cout << "Consider upgrading to Premium.\n";
-                    return;
-                }
-                break;
-            } catch (...) {
-                cout << "Invalid size. Please enter a positive number.\n";
+            cout << "Local file to upload: ";
+            string path;
+            getline(cin, path);
+            error_code ec;
+            auto size = fs::file_size(path, ec);
+            if (ec || !fs::is_regular_file(path, ec)) {
+                cout << "Cannot read that file.\n";
+                continue;
+            }
+            if (size == 0) {
+                cout << "The file is empty.\n";
+                continue;
             }
+            int64_t available = currentUser->storageLimit() - currentUser->usedBytes.load();
+            if ((int64_t)size > available) {
+                cout << "Storage limit exceeded. Available: "
+                     << formatFileSize(max<int64_t>(0, available)) << "\n";
+                if (currentUser->role == UserRole::FREE_USER)
+                    cout << "Consider upgrading to Premium.\n";
+                return;
+            }
+            content.open(path, ios::binary);
+            if (!content) {
+                cout << "Cannot read that file.\n";
+                continue;
+            }
+            break;
         }
 
         fr.type = detectFileType(fr.name);
@@ -648,21 +8409,20 @@ public:
         char c; cin >> c; cin.ignore();
         fr.isPublic = (c == 'Y' || c == 'y');
 
-        cout << "Encrypt at rest? (Y/N, simulated): ";
+        cout << "Encrypt at rest (AES-256-GCM)? (Y/N): ";
         char e; cin >> e; cin.ignore();
         fr.encryptedAtRest = (e == 'Y' || e == 'y');
 
-        fr.uploadDate = getCurrentTime();
+        fr.uploaded = time(nullptr);
 
-        currentUser->usedStorage += fr.sizeMB;
-        auto& vec = fileRepo.filesOf(currentUser->username);
-        vec.push_back(fr);
-
-        if (userRepo.save() && fileRepo.saveUserFiles(currentUser->username)) {
-            cout << "\nFile uploaded successfully.\n";
+        ApiStatus st = storeFile(console, fr, content);
+        if (st == ApiStatus::OK) {
+            cout << "\nFile uploaded successfully (" << formatFileSize(fr.sizeBytes) << ").\n";
             cout << "Stored in region: " << fr.regionString() << " (simulated)\n";
+            if (fr.region == Region::GLOBAL) cout << "Replicas: Asia, Europe, America\n";
             cout << "Encrypted at rest: " << (fr.encryptedAtRest ? "Yes" : "No") << "\n";
-            Logger::log(AuditEventType::UPLOAD, "User=" + currentUser->username + " File=" + fr.name);
+        } else if (st == ApiStatus::QUOTA_EXCEEDED) {
+            cout << "Storage limit exceeded.\n";
         } else {
             cout << "Failed to save file.\n";
         }
@@ -670,13 +8430,13 @@ public:
 
     void listFiles(bool includePublic = false) {
         if (!currentUser) return;
-        const auto& ownFiles = fileRepo.filesOfConst(currentUser->username);
+        const vector<FileRecord> ownFiles = filesFor(console);
 
         cout << "\n=== My Files ===\n\n";
         if (ownFiles.empty()) {
             cout << "No files yet.\n";
         } else {
-            cout << "Storage: " << formatFileSize(currentUser->usedStorage)
+            cout << "Storage: " << formatFileSize(currentUser->usedBytes.load())
                  << " / " << formatFileSize(currentUser->storageLimit()) << "\n\n";
 
             cout << left << setw(4) << "No"
@@ -696,33 +8456,74 @@ public:
                 cout << setw(4) << (i + 1) << "  "
                      << setw(24) << name << "  "
                      << setw(10) << f.typeString() << "  "
-                     << setw(10) << formatFileSize(f.sizeMB) << "  "
+                     << setw(10) << formatFileSize(f.sizeBytes) << "  "
                      << setw(8)  << f.regionString() << "  "
                      << setw(6)  << (f.isPublic ? "Yes" : "No") << "  "
                      << setw(9)  << (f.encryptedAtRest ? "Yes" : "No") << "\n";
             }
         }
 
-        if (includePublic) {
+        if (includePublic) browsePublicFiles();
+    }
+
+    void browsePublicFiles() {
+        const size_t pageSize = 20;
+        auto order = PublicCatalog::Order::DATE;
+        PublicCatalog::Cursor cursor;
+
+        while (true) {
+            auto page = fileRepo.publicPage(order, cursor, pageSize);
             cout << "\n=== Public Files (All Users) ===\n\n";
-            const auto& all = fileRepo.allFiles();
-            int count = 0;
-            for (const auto& [owner, vec] : all) {
-                for (const auto& f : vec) {
-                    if (f.isPublic) {
-                        cout << "- " << f.name << " [" << f.typeString() << "] by " << f.owner
-                             << " (" << f.regionString() << ")\n";
-                        count++;
-                    }
-                }
+            if (page.entries.empty()) cout << "No public files.\n";
+            for (const auto& e : page.entries) {
+                cout << "- " << e.name << " [" << e.typeString() << "] by " << e.owner
+                     << " (" << e.regionString() << ") " << e.dateString() << "\n";
+            }
+
+            cout << "\n" << (page.more ? "[N]ext page  " : "")
+                 << "Order by [D]ate/[T]ype/[R]egion  [V]isibility of my files  [Enter] back: ";
+            string cmd; getline(cin, cmd);
+            char c = cmd.empty() ? '\0' : (char)tolower((unsigned char)cmd[0]);
+            if (c == 'n' && page.more) {
+                cursor = page.next;
+            } else if (c == 'd' || c == 't' || c == 'r') {
+                order = c == 'd' ? PublicCatalog::Order::DATE
+                      : c == 't' ? PublicCatalog::Order::TYPE : PublicCatalog::Order::REGION;
+                cursor = PublicCatalog::Cursor();
+            } else if (c == 'v') {
+                changeVisibility();
+                cursor = PublicCatalog::Cursor();
+            } else {
+                return;
             }
-            if (count == 0) cout << "No public files.\n";
         }
     }
 
+    void changeVisibility() {
+        if (!currentUser) return;
+        const vector<FileRecord> files = filesFor(console);
+        if (files.empty()) {
+            cout << "\nNo files yet.\n";
+            return;
+        }
+        cout << "\n";
+        for (size_t i = 0; i < files.size(); ++i)
+            cout << (i + 1) << ". " << files[i].name << " (" << (files[i].isPublic ? "public" : "private") << ")\n";
+        cout << "\nFile number to toggle (0 to cancel): ";
+        int n; cin >> n; cin.ignore();
+        if (n <= 0 || n > (int)files.size()) return;
+
+        const FileRecord& f = files[n - 1];
+        bool makePublic = !f.isPublic;
+        if (setFileVisibility(console, f.id, makePublic) == ApiStatus::OK)
+            cout << "'" << f.name << "' is now " << (makePublic ? "public" : "private") << ".\n";
+        else
+            cout << "Failed to update file.\n";
+    }
+
     void deleteFile() {
         if (!currentUser) return;
-        auto& files = fileRepo.filesOf(currentUser->username);
+        const vector<FileRecord> files = filesFor(console);
         if (files.empty()) {
             cout << "\nNo files to delete.\n";
             return;
@@ -744,44 +8545,63 @@ public:
             return;
         }
 
-        currentUser->usedStorage -= fr.sizeMB;
-        files.erase(files.begin() + (n - 1));
-
-        if (userRepo.save() && fileRepo.saveUserFiles(currentUser->username)) {
+        if (removeFile(console, fr.id) == ApiStatus::OK) {
             cout << "File deleted.\n";
-            Logger::log(AuditEventType::DELETE, "User=" + currentUser->username + " File=" + fr.name);
         } else {
             cout << "Failed to update storage.\n";
         }
     }
 
+    void downloadFile() {
+        if (!currentUser) return;
+        const vector<FileRecord> files = filesFor(console);
+        if (files.empty()) {
+            cout << "\nNo files to download.\n";
+            return;
+        }
+
+        listFiles();
+        cout << "\nEnter file number to download (0 to cancel): ";
+        int n; cin >> n; cin.ignore();
+        if (n <= 0 || n > (int)files.size()) {
+            cout << "Cancelled.\n";
+            return;
+        }
+
+        const FileRecord& fr = files[n - 1];
+        cout << "Save as (local path): ";
+        string path; getline(cin, path);
+        if (path.empty()) {
+            cout << "Cancelled.\n";
+            return;
+        }
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out) {
+            cout << "Cannot write that file.\n";
+            return;
+        }
+        ApiStatus st = readContent(console, fr.id, out);
+        out.close();
+        if (st == ApiStatus::OK && out) {
+            cout << "Saved " << formatFileSize(fr.sizeBytes) << " to " << path << "\n";
+        } else {
+            cout << (st == ApiStatus::NOT_FOUND ? "This file has no stored content.\n"
+                                                : "Failed to read the file.\n");
+        }
+    }
+
     void searchFiles() {
         if (!currentUser) return;
         cout << "\nSearch term: ";
         string term; getline(cin, term);
-        string termLower = term;
-        transform(termLower.begin(), termLower.end(), termLower.begin(), ::tolower);
 
-        const auto& files = fileRepo.filesOfConst(currentUser->username);
-        vector<const FileRecord*> results;
-
-        for (const auto& f : files) {
-            string nameLower = f.name;
-            transform(nameLower.begin(), nameLower.end(), nameLower.begin(), ::tolower);
-            string descLower = f.description;
-            transform(descLower.begin(), descLower.end(), descLower.begin(), ::tolower);
-
-            if (nameLower.find(termLower) != string::npos ||
-                descLower.find(termLower) != string::npos) {
-                results.push_back(&f);
-            }
-        }
+        vector<FileRecord> results = searchFor(console, term);
 
         cout << "\nFound " << results.size() << " file(s).\n\n";
         for (size_t i = 0; i < results.size(); ++i) {
-            const auto* f = results[i];
+            const auto* f = &results[i];
             cout << (i + 1) << ". " << f->name << " [" << f->typeString() << "] "
-                 << formatFileSize(f->sizeMB) << " - " << f->uploadDate << "\n";
+                 << formatFileSize(f->sizeBytes) << " - " << f->dateString() << "\n";
             if (!f->description.empty())
                 cout << "   " << f->description << "\n";
             cout << "   Region: " << f->regionString()
@@ -817,11 +8637,12 @@ public:
              << " (locked: " << (u.isLocked ? "yes" : "no") << ")\n";
 
         cout << "MFA enabled: " << (u.mfaEnabled ? "Yes" : "No") << "\n";
+        cout << "API session token (expires " << formatTime(console.expiresAt) << "):\n  " << consoleToken << "\n";
 
-        cout << "Storage: " << formatFileSize(u.usedStorage)
+        cout << "Storage: " << formatFileSize(u.usedBytes.load())
              << " / " << formatFileSize(u.storageLimit()) << "\n";
 
-        double pct = (u.usedStorage / u.storageLimit()) * 100.0;
+        double pct = (double)u.usedBytes.load() / (double)u.storageLimit() * 100.0;
         cout << "[";
         int bars = (int)(pct / 5.0);
         for (int i = 0; i < 20; ++i) cout << (i < bars ? "#" : "-");
@@ -833,8 +8654,9 @@ public:
         cout << "Choice: ";
         int c; cin >> c; cin.ignore();
         if (c == 1) {
+            lock_guard<mutex> lk(userLocks.forKey(u.username));
             u.mfaEnabled = !u.mfaEnabled;
-            userRepo.save();
+            userRepo.persist(u);
             cout << "MFA is now: " << (u.mfaEnabled ? "ENABLED" : "DISABLED") << "\n";
         }
     }
@@ -862,10 +8684,11 @@ public:
             return;
         }
 
+        lock_guard<mutex> lk(userLocks.forKey(currentUser->username));
         currentUser->role = UserRole::PREMIUM_USER;
-        if (userRepo.save()) {
+        if (userRepo.persist(*currentUser)) {
             cout << "You are now Premium.\n";
-            Logger::log(AuditEventType::UPGRADE, "User=" + currentUser->username);
+            Logger::log(AuditEventType::UPGRADE, currentUser->username);
         } else {
             cout << "Failed to save upgrade.\n";
         }
@@ -881,13 +8704,16 @@ public:
             return;
         }
         cout << "\n=== Admin: Users Overview ===\n\n";
-        const auto& all = userRepo.all();
-        for (const auto& [name, u] : all) {
-            cout << "- " << u.username << " (" << u.roleString() << ") "
-                 << "Storage: " << formatFileSize(u.usedStorage)
-                 << " | Locked: " << (u.isLocked ? "Yes" : "No")
-                 << " | MFA: " << (u.mfaEnabled ? "Yes" : "No") << "\n";
-        }
+        userRepo.withColumns([](const UserColumns& cols) {
+            User view;
+            for (size_t i = 0; i < cols.size(); ++i) {
+                view.role = static_cast<UserRole>(cols.role[i]);
+                cout << "- " << cols.name[i] << " (" << view.roleString() << ") "
+                     << "Storage: " << formatFileSize(cols.usedBytes[i])
+                     << " | Locked: " << ((cols.flags[i] & UserColumns::FLAG_LOCKED) ? "Yes" : "No")
+                     << " | MFA: " << ((cols.flags[i] & UserColumns::FLAG_MFA) ? "Yes" : "No") << "\n";
+            }
+        });
     }
 
     void adminUnlockUser() {
@@ -902,11 +8728,14 @@ public:
             cout << "User not found.\n";
             return;
         }
-        u->isLocked = false;
-        u->failedLogins = 0;
-        userRepo.save();
+        {
+            lock_guard<mutex> lk(userLocks.forKey(name));
+            u->isLocked = false;
+            u->failedLogins = 0;
+            userRepo.persist(*u);
+        }
         cout << "User unlocked.\n";
-        Logger::log(AuditEventType::ADMIN_ACTION, "Admin=" + currentUser->username + " unlocked " + name);
+        Logger::log(AuditEventType::ADMIN_ACTION, currentUser->username, AuditReason::UNLOCK_USER, name);
     }
 
     void adminSecurityDashboard() {
@@ -915,22 +8744,81 @@ public:
             return;
         }
         cout << "\n=== Admin: Security Dashboard (Simulated) ===\n\n";
-        const auto& all = userRepo.all();
-        int totalUsers = (int)all.size();
-        int locked = 0;
-        int premium = 0;
-        double totalStorage = 0.0;
+        UserColumns::Stats stats;
+        userRepo.withColumns([&](const UserColumns& cols) { stats = cols.aggregate(); });
+
+        cout << "Total users: " << stats.totalUsers << "\n";
+        cout << "Locked accounts: " << stats.lockedUsers << "\n";
+        cout << "Premium users: " << stats.premiumUsers << "\n";
+        cout << "MFA enabled: " << stats.mfaUsers << "\n";
+        cout << "Total used storage: " << formatFileSize(stats.totalBytes) << "\n";
+
+        ChunkStore::Stats content = chunks.stats();
+        cout << "Stored content: " << formatFileSize((int64_t)content.storedBytes) << " in "
+             << content.chunks << " chunks for " << content.files << " files ("
+             << formatFileSize((int64_t)content.logicalBytes) << " before dedup)\n";
+
+        UsageReport usage = lastUsageReport();
+        if (usage.ranAt != 0) {
+            cout << "Usage check (" << formatTime(usage.ranAt) << "): " << usage.usersCorrected
+                 << " of " << usage.usersChecked << " users corrected";
+            if (usage.usersCorrected) cout << ", " << formatFileSize(usage.driftBytes) << " drift";
+            cout << "\n";
+        }
 
-        for (const auto& [name, u] : all) {
-            if (u.isLocked) locked++;
-            if (u.role == UserRole::PREMIUM_USER) premium++;
-            totalStorage += u.usedStorage;
+        cout << "Revoked session tokens (not yet expired): " << sessions.revokedCount() << "\n";
+        uint8_t none[SHA256::DIGEST_SIZE] = {0};
+        string policy = PasswordHash::format(PasswordHash::policy(), none);
+        cout << "Password hashing: " << policy.substr(0, policy.rfind('$')) << ", " << kdf.queued()
+             << " hashes waiting\n";
+
+        Replicator::Status rep = replication.status();
+        cout << "Replication of Global files (" << (rep.ack == Replicator::Ack::SYNC ? "sync" : "async")
+             << " ack): " << rep.queued << " queued, last lsn " << rep.headLsn << "\n";
+        for (const auto& r : rep.replicas) {
+            cout << "  " << left << setw(8) << regionName(r.region) << (r.online ? "online " : "offline")
+                 << "  applied " << r.appliedLsn << ", " << r.files << " files ("
+                 << formatFileSize((int64_t)r.storedBytes) << "), lag " << r.lagJobs << " jobs / "
+                 << fixed << setprecision(1) << r.lagSeconds << " s";
+            if (r.failures) cout << ", " << r.failures << " failed batches";
+            cout << "\n";
         }
+    }
 
-        cout << "Total users: " << totalUsers << "\n";
-        cout << "Locked accounts: " << locked << "\n";
-        cout << "Premium users: " << premium << "\n";
-        cout << "Total used storage: " << formatFileSize(totalStorage) << "\n";
+    void adminPerfView() {
+        if (!isAdmin()) {
+            cout << "Admin only.\n";
+            return;
+        }
+        cout << "\n=== Admin: Performance ===\n\n";
+        Metrics::Snapshot snap = Metrics::snapshot();
+        auto us = [](double ns) {
+            ostringstream os;
+            if (ns < 1e6) os << fixed << setprecision(1) << ns / 1e3 << " us";
+            else os << fixed << setprecision(2) << ns / 1e6 << " ms";
+            return os.str();
+        };
+        cout << left << setw(18) << "Operation" << right << setw(10) << "Calls" << setw(12) << "Mean"
+             << setw(12) << "p50" << setw(12) << "p99" << setw(12) << "p99.9" << setw(12) << "Max" << "\n";
+        cout << string(88, '-') << "\n";
+        bool storage = false;
+        for (size_t i = 0; i < Metrics::OPS; ++i) {
+            const Metrics::OpStats& o = snap.ops[i];
+            if (!storage && Metrics::isPersistence(Metrics::Op(i))) {
+                storage = true;
+                cout << "  storage:\n";
+            }
+            if (!o.count) continue;
+            cout << left << setw(18) << Metrics::opName(Metrics::Op(i)) << right << setw(10) << o.count
+                 << setw(12) << us(o.meanNs()) << setw(12) << us(double(o.quantileNs(0.5)))
+                 << setw(12) << us(double(o.quantileNs(0.99))) << setw(12) << us(double(o.quantileNs(0.999)))
+                 << setw(12) << us(double(o.maxNs)) << "\n";
+        }
+        cout << left << "\nUploaded: " << formatFileSize((int64_t)snap.counters[(size_t)Metrics::Counter::UPLOADED_BYTES])
+             << "  Downloaded: " << formatFileSize((int64_t)snap.counters[(size_t)Metrics::Counter::DOWNLOADED_BYTES]) << "\n";
+        cout << "Prometheus text: " << Config::METRICS_FILE;
+        if (metricsSocket >= 0) cout << ", or curl --unix-socket " << Config::METRICS_SOCKET << " http://localhost/metrics";
+        cout << "\n";
     }
 };
 
@@ -969,24 +8857,26 @@ private:
         showBanner();
         cout << "\nWelcome, " << u->salutation() << " " << u->fullName << "\n";
         cout << u->roleString() << " | "
-             << formatFileSize(u->usedStorage) << " used\n";
+             << formatFileSize(u->usedBytes.load()) << " used\n";
         cout << "----------------------------------------\n\n";
 
         cout << "1) Upload file\n";
         cout << "2) List my files\n";
         cout << "3) Search my files\n";
         cout << "4) Delete file\n";
-        cout << "5) Profile & security\n";
+        cout << "5) Download file\n";
+        cout << "6) Profile & security\n";
         if (u->role == UserRole::FREE_USER)
-            cout << "6) Upgrade to Premium\n7) Logout\n8) Exit\n";
+            cout << "7) Upgrade to Premium\n8) Logout\n9) Exit\n";
         else if (u->role == UserRole::PREMIUM_USER)
-            cout << "6) Logout\n7) Exit\n";
+            cout << "7) Logout\n8) Exit\n";
         else if (u->role == UserRole::ADMIN) {
-            cout << "6) Admin: list users\n";
-            cout << "7) Admin: unlock user\n";
-            cout << "8) Admin: security dashboard\n";
-            cout << "9) Logout\n";
-            cout << "10) Exit\n";
+            cout << "7) Admin: list users\n";
+            cout << "8) Admin: unlock user\n";
+            cout << "9) Admin: security dashboard\n";
+            cout << "10) Admin: performance\n";
+            cout << "11) Logout\n";
+            cout << "12) Exit\n";
         }
         cout << "\nChoice: ";
     }
@@ -1003,7 +8893,7 @@ private:
                 break;
             case 3:
                 cout << "\nGoodbye.\n";
-                Logger::log(AuditEventType::SYSTEM, "Application closed");
+                Logger::log(AuditEventType::SYSTEM, "", AuditReason::APP_CLOSE);
                 exit(0);
             default:
                 cout << "Invalid choice.\n";
@@ -1016,28 +8906,29 @@ private:
         if (!u) return;
 
         if (u->role == UserRole::FREE_USER) {
-            if (c == 6) { engine.upgradeAccount(); pause(); return; }
-            if (c == 7) { engine.logout(); pause(); return; }
-            if (c == 8) {
+            if (c == 7) { engine.upgradeAccount(); pause(); return; }
+            if (c == 8) { engine.logout(); pause(); return; }
+            if (c == 9) {
                 cout << "\nGoodbye.\n";
-                Logger::log(AuditEventType::SYSTEM, "Application closed by " + u->username);
+                Logger::log(AuditEventType::SYSTEM, u->username, AuditReason::APP_CLOSE);
                 exit(0);
             }
         } else if (u->role == UserRole::PREMIUM_USER) {
-            if (c == 6) { engine.logout(); pause(); return; }
-            if (c == 7) {
+            if (c == 7) { engine.logout(); pause(); return; }
+            if (c == 8) {
                 cout << "\nGoodbye.\n";
-                Logger::log(AuditEventType::SYSTEM, "Application closed by " + u->username);
+                Logger::log(AuditEventType::SYSTEM, u->username, AuditReason::APP_CLOSE);
                 exit(0);
             }
         } else if (u->role == UserRole::ADMIN) {
-            if (c == 6) { engine.adminListUsers(); pause(); return; }
-            if (c == 7) { engine.adminUnlockUser(); pause(); return; }
-            if (c == 8) { engine.adminSecurityDashboard(); pause(); return; }
-            if (c == 9) { engine.logout(); pause(); return; }
-            if (c == 10) {
+            if (c == 7) { engine.adminListUsers(); pause(); return; }
+            if (c == 8) { engine.adminUnlockUser(); pause(); return; }
+            if (c == 9) { engine.adminSecurityDashboard(); pause(); return; }
+            if (c == 10) { engine.adminPerfView(); pause(); return; }
+            if (c == 11) { engine.logout(); pause(); return; }
+            if (c == 12) {
                 cout << "\nGoodbye.\n";
-                Logger::log(AuditEventType::SYSTEM, "Application closed by " + u->username);
+                Logger::log(AuditEventType::SYSTEM, u->username, AuditReason::APP_CLOSE);
                 exit(0);
             }
         }
@@ -1047,7 +8938,8 @@ private:
             case 2: engine.listFiles(true);   pause(); break;
             case 3: engine.searchFiles(); pause(); break;
             case 4: engine.deleteFile();  pause(); break;
-            case 5: engine.showProfile(); pause(); break;
+            case 5: engine.downloadFile(); pause(); break;
+            case 6: engine.showProfile(); pause(); break;
             default:
                 cout << "Invalid choice.\n";
                 pause();
@@ -1056,7 +8948,7 @@ private:
 
 public:
     void run() {
-        Logger::log(AuditEventType::SYSTEM, "Application started");
+        Logger::log(AuditEventType::SYSTEM, "", AuditReason::APP_START);
         while (true) {
             clearScreen();
             if (!engine.isLoggedIn()) {
@@ -1072,9 +8964,928 @@ public:
     }
 };
 
+// ================== Audit Query CLI ==================
+// cloud_app --audit-query [--user NAME] [--type TAG] [--since TIME] [--until TIME] [--limit N]
+// TIME is "YYYY-MM-DD", "YYYY-MM-DD HH:MM:SS" (local time) or epoch seconds.
+bool parseAuditTime(const string& text, time_t& out) {
+    if (!text.empty() && all_of(text.begin(), text.end(), ::isdigit)) {
+        int64_t secs;
+        auto res = from_chars(text.data(), text.data() + text.size(), secs);
+        if (res.ec != errc() || res.ptr != text.data() + text.size()) return false;
+        out = (time_t)secs;
+        return true;
+    }
+    tm t{};
+    t.tm_isdst = -1;
+    istringstream in(text);
+    in >> get_time(&t, text.size() > 10 ? "%Y-%m-%d %H:%M:%S" : "%Y-%m-%d");
+    if (in.fail()) return false;
+    out = mktime(&t);
+    return true;
+}
+
+int runAuditQuery(int argc, char** argv) {
+    AuditQuery q;
+    for (int i = 2; i < argc; ++i) {
+        string opt = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << opt << "\n";
+            return 2;
+        }
+        string val = argv[++i];
+        if (opt == "--user") {
+            q.user = val;
+        } else if (opt == "--type") {
+            if (!AuditFormat::parseTypeTag(val, q.type)) {
+                cerr << "Unknown event type: " << val << "\n";
+                return 2;
+            }
+            q.filterType = true;
+        } else if (opt == "--since" || opt == "--until") {
+            time_t t;
+            if (!parseAuditTime(val, t)) {
+                cerr << "Invalid time: " << val << "\n";
+                return 2;
+            }
+            (opt == "--since" ? q.from : q.to) = t;
+        } else if (opt == "--limit") {
+            auto res = from_chars(val.data(), val.data() + val.size(), q.limit);
+            if (res.ec != errc() || res.ptr != val.data() + val.size()) {
+                cerr << "Invalid limit: " << val << "\n";
+                return 2;
+            }
+        } else {
+            cerr << "Unknown option: " << opt << "\n";
+            return 2;
+        }
+    }
+
+    for (const auto& r : AuditLogReader::query(q)) cout << r.toString() << "\n";
+    return 0;
+}
+
+// ================== Self-Test ==================
+// cloud_app --self-test checks the crypto primitives against published
+// vectors: RFC 7693 (BLAKE2b), RFC 9106 §5.3 (Argon2id), RFC 8018
+// PBKDF2-HMAC-SHA256, and NIST GCM test case 16 on every AES back end
+// this CPU has. Exits 1 if any of them mismatches.
+namespace SelfTest {
+    bool check(const char* name, const uint8_t* got, size_t len, const char* expectHex) {
+        bool ok = toHex(got, len) == expectHex;
+        cout << (ok ? "ok    " : "FAIL  ") << name << "\n";
+        return ok;
+    }
+
+    vector<uint8_t> bytes(const char* hex) {
+        vector<uint8_t> out(strlen(hex) / 2);
+        fromHex(hex, out.data(), out.size());
+        return out;
+    }
+
+    bool blake2b() {
+        uint8_t out[64];
+        Blake2b::hash(out, sizeof(out), "abc", 3);
+        return check("BLAKE2b-512 (RFC 7693 appendix A)", out, sizeof(out),
+                     "ba80a53f981c4d0d6a2797b69f12f6e94c212f14685ac4b74b12bb6fdbffa2d1"
+                     "7d87c5392aab792dc252d5de4533cc9518d38aa8dbf1925ab92386edd4009923");
+    }
+
+    bool argon2id() {
+        uint8_t pwd[32], salt[16], secret[8], ad[12], out[32];
+        memset(pwd, 0x01, sizeof(pwd));
+        memset(salt, 0x02, sizeof(salt));
+        memset(secret, 0x03, sizeof(secret));
+        memset(ad, 0x04, sizeof(ad));
+        vector<argon2::Block> memory;
+        bool ok = argon2::hash({32, 3, 4}, pwd, sizeof(pwd), salt, sizeof(salt), secret, sizeof(secret), ad,
+                               sizeof(ad), out, sizeof(out), memory);
+        return check("Argon2id (RFC 9106 section 5.3)", out, ok ? sizeof(out) : 0,
+                     "0d640df58d78766c08c037a34a8b53c9d01ef0452d75b65eb52520e96b01e659");
+    }
+
+    bool pbkdf2() {
+        uint8_t out[SHA256::DIGEST_SIZE];
+        const uint8_t* pwd = reinterpret_cast<const uint8_t*>("password");
+        const uint8_t* salt = reinterpret_cast<const uint8_t*>("salt");
+        pbkdf2Sha256(pwd, 8, salt, 4, 1, out);
+        bool ok = check("PBKDF2-HMAC-SHA256, c=1", out, sizeof(out),
+                        "120fb6cffcf8b32c43e7225256c4f837a86548c92ccc35480805987cb70be17b");
+        pbkdf2Sha256(pwd, 8, salt, 4, 4096, out);
+        return check("PBKDF2-HMAC-SHA256, c=4096", out, sizeof(out),
+                     "c5e478d59288c841aa530db6845c4c8d962893a001ce4e11a4963873aa98134a") && ok;
+    }
+
+    bool aesGcm(aesimpl::Impl impl, const char* name) {
+        vector<uint8_t> key = bytes("feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308");
+        vector<uint8_t> nonce = bytes("cafebabefacedbaddecaf888");
+        vector<uint8_t> aad = bytes("feedfacedeadbeeffeedfacedeadbeefabaddad2");
+        vector<uint8_t> plain = bytes("d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+                                      "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39");
+        Aes256Gcm gcm(key.data(), impl);
+        vector<uint8_t> sealed(plain.size()), opened(plain.size());
+        uint8_t tag[Aes256Gcm::TAG_SIZE];
+        gcm.encrypt(nonce.data(), aad.data(), aad.size(), plain.data(), plain.size(), sealed.data(), tag);
+        string label = string("AES-256-GCM test case 16, ") + name;
+        bool ok = check((label + " ciphertext").c_str(), sealed.data(), sealed.size(),
+                        "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+                        "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662");
+        ok = check((label + " tag").c_str(), tag, sizeof(tag), "76fc6ece0f4e1768cddf8853bb2d551b") && ok;
+        bool opens = gcm.decrypt(nonce.data(), aad.data(), aad.size(), sealed.data(), sealed.size(), tag,
+                                 opened.data()) && opened == plain;
+        cout << (opens ? "ok    " : "FAIL  ") << label << " decrypt\n";
+        return ok && opens;
+    }
+}
+
+int runSelfTest() {
+    bool ok = SelfTest::blake2b();
+    ok = SelfTest::argon2id() && ok;
+    ok = SelfTest::pbkdf2() && ok;
+    ok = SelfTest::aesGcm(aesimpl::Impl::PORTABLE, "portable") && ok;
+#ifdef CLOUD_X86
+    if (cpu::hasAesNi()) ok = SelfTest::aesGcm(aesimpl::Impl::AESNI, "AES-NI") && ok;
+#endif
+    return ok ? 0 : 1;
+}
+
+// ================== Batch Mode ==================
+// cloud_app --batch [FILE] reads one flat JSON object per line (stdin when
+// FILE is omitted) and answers each with one JSON line on stdout:
+//   {"op":"register","user":"alice","password":"secret123","name":"Alice","age":30,"gender":"F"}
+//   {"op":"login","user":"alice","password":"secret123"}     -> "token"
+//   {"op":"mfa","code":"123456"}        (MFA users; login replied "challenge")
+//   {"op":"upload","name":"a.pdf","path":"/tmp/a.pdf","region":"Asia","public":true}
+//   {"op":"upload","name":"b.pdf","size":1.5}                (metadata only)
+//   {"op":"list"}  {"op":"search","term":"pdf"}  {"op":"get","id":"..."}
+//   {"op":"download","id":"...","path":"/tmp/out.pdf"}
+//   {"op":"delete","id":"..."}  {"op":"visibility","id":"...","public":false}
+//   {"op":"public","order":"date","limit":20,"after":"<cursor>"}
+//   {"op":"logout"}
+// Commands act on "token" when given, otherwise on the token of the last
+// successful login; "mfa" answers "challenge", by default the last one.
+// Writes are synced every BATCH_FLUSH_OPS commands and at the end; replies
+// are printed once the writes before them are durable.
+namespace BatchJson {
+    // String values unescaped, everything else as its raw text
+    using Object = unordered_map<string, string>;
+
+    void skipSpace(const string& s, size_t& i) {
+        while (i < s.size() && isspace((unsigned char)s[i])) ++i;
+    }
+
+    void appendUtf8(string& out, uint32_t cp) {
+        if (cp < 0x80) {
+            out += (char)cp;
+        } else if (cp < 0x800) {
+            out += (char)(0xC0 | (cp >> 6));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else {
+            out += (char)(0xE0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+
+    bool parseString(const string& s, size_t& i, string& out) {
+        if (i >= s.size() || s[i] != '"') return false;
+        out.clear();
+        for (++i; i < s.size(); ++i) {
+            char c = s[i];
+            if (c == '"') { ++i; return true; }
+            if (c != '\\') { out += c; continue; }
+            if (++i >= s.size()) return false;
+            switch (s[i]) {
+                case '"':  out += '"';  break;
+                case '\\': out += '\\'; break;
+                case '/':  out += '/';  break;
+                case 'b':  out += '\b'; break;
+                case 'f':  out += '\f'; break;
+                case 'n':  out += '\n'; break;
+                case 'r':  out += '\r'; break;
+                case 't':  out += '\t'; break;
+                case 'u': {
+                    uint32_t cp = 0;
+                    if (i + 4 >= s.size() ||
+                        from_chars(s.data() + i + 1, s.data() + i + 5, cp, 16).ptr != s.data() + i + 5)
+                        return false;
+                    appendUtf8(out, cp);
+                    i += 4;
+                    break;
+                }
+                default: return false;
+            }
+        }
+        return false;
+    }
+
+    // Flat objects only: nested objects and arrays are rejected.
+    bool parseObject(const string& s, Object& out) {
+        out.clear();
+        size_t i = 0;
+        skipSpace(s, i);
+        if (i >= s.size() || s[i++] != '{') return false;
+        skipSpace(s, i);
+        if (i < s.size() && s[i] == '}') { ++i; skipSpace(s, i); return i == s.size(); }
+        string key, value;
+        while (true) {
+            skipSpace(s, i);
+            if (!parseString(s, i, key)) return false;
+            skipSpace(s, i);
+            if (i >= s.size() || s[i++] != ':') return false;
+            skipSpace(s, i);
+            if (i < s.size() && s[i] == '"') {
+                if (!parseString(s, i, value)) return false;
+            } else {
+                size_t start = i;
+                while (i < s.size() && s[i] != ',' && s[i] != '}' && !isspace((unsigned char)s[i])) ++i;
+                value.assign(s, start, i - start);
+                if (value.empty() || value[0] == '{' || value[0] == '[') return false;
+            }
+            out[key] = value;
+            skipSpace(s, i);
+            if (i >= s.size()) return false;
+            if (s[i] == '}') { ++i; break; }
+            if (s[i++] != ',') return false;
+        }
+        skipSpace(s, i);
+        return i == s.size();
+    }
+
+    void appendString(string& out, const string& v) {
+        static const char* hex = "0123456789abcdef";
+        out += '"';
+        for (char c : v) {
+            unsigned char u = (unsigned char)c;
+            if (c == '"' || c == '\\') { out += '\\'; out += c; }
+            else if (c == '\n') out += "\\n";
+            else if (c == '\r') out += "\\r";
+            else if (c == '\t') out += "\\t";
+            else if (u < 0x20) { out += "\\u00"; out += hex[u >> 4]; out += hex[u & 15]; }
+            else out += c;
+        }
+        out += '"';
+    }
+
+    void appendField(string& out, const char* key, const string& v) {
+        out += ",\"";
+        out += key;
+        out += "\":";
+        appendString(out, v);
+    }
+
+    void appendRaw(string& out, const char* key, const string& v) {
+        out += ",\"";
+        out += key;
+        out += "\":";
+        out += v;
+    }
+
+    void appendFile(string& out, const FileRecord& f) {
+        out += "{\"id\":";
+        appendString(out, f.id.str());
+        appendField(out, "name", f.name);
+        appendField(out, "owner", f.owner);
+        appendField(out, "type", f.typeString());
+        appendField(out, "region", f.regionString());
+        appendRaw(out, "bytes", to_string(f.sizeBytes));
+        appendField(out, "uploaded", f.dateString());
+        appendField(out, "description", f.description);
+        appendRaw(out, "public", f.isPublic ? "true" : "false");
+        appendRaw(out, "encrypted", f.encryptedAtRest ? "true" : "false");
+        out += '}';
+    }
+}
+
+class BatchRunner {
+private:
+    CloudEngine& engine;
+    string lastToken;
+    string lastChallenge;
+    string replies;
+
+    static bool field(const BatchJson::Object& cmd, const char* key, string& out) {
+        auto it = cmd.find(key);
+        if (it == cmd.end()) return false;
+        out = it->second;
+        return true;
+    }
+
+    static string text(const BatchJson::Object& cmd, const char* key) {
+        string v;
+        field(cmd, key, v);
+        return v;
+    }
+
+    static bool flag(const BatchJson::Object& cmd, const char* key) {
+        return text(cmd, key) == "true";
+    }
+
+    template <class T>
+    static bool number(const BatchJson::Object& cmd, const char* key, T& out) {
+        string v;
+        if (!field(cmd, key, v)) return false;
+        if constexpr (is_floating_point_v<T>) {
+            char* end = nullptr;
+            out = (T)strtod(v.c_str(), &end);
+            return !v.empty() && *end == '\0';
+        } else {
+            auto res = from_chars(v.data(), v.data() + v.size(), out);
+            return res.ec == errc() && res.ptr == v.data() + v.size();
+        }
+    }
+
+    string tokenOf(const BatchJson::Object& cmd) const {
+        string token = lastToken;
+        field(cmd, "token", token);
+        return token;
+    }
+
+    static bool parseRegion(const string& name, Region& out) {
+        for (Region r : {Region::ASIA, Region::EUROPE, Region::AMERICA, Region::GLOBAL}) {
+            string n = regionName(r);
+            if (n.size() == name.size() &&
+                equal(n.begin(), n.end(), name.begin(),
+                      [](char a, char b) { return tolower((unsigned char)a) == tolower((unsigned char)b); })) {
+                out = r;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // "group|uploaded|id", the fields of PublicCatalog::Cursor
+    static string encodeCursor(const PublicCatalog::Cursor& c) {
+        if (!c.valid) return "";
+        return to_string(c.group) + "|" + to_string((int64_t)c.uploaded) + "|" + c.id.str();
+    }
+
+    static bool decodeCursor(const string& s, PublicCatalog::Cursor& c) {
+        c = PublicCatalog::Cursor();
+        if (s.empty()) return true;
+        size_t a = s.find('|');
+        size_t b = a == string::npos ? a : s.find('|', a + 1);
+        if (b == string::npos) return false;
+        unsigned group = 0;
+        auto res = from_chars(s.data(), s.data() + a, group);
+        if (res.ec != errc() || res.ptr != s.data() + a || group > 255) return false;
+        int64_t uploaded;
+        if (!FileCatalog::parseNumber(string_view(s).substr(a + 1, b - a - 1), uploaded) ||
+            !FileId::parse(string_view(s).substr(b + 1), c.id))
+            return false;
+        c.valid = true;
+        c.group = (uint8_t)group;
+        c.uploaded = (time_t)uploaded;
+        return true;
+    }
+
+    void appendFiles(string& out, const FilesReply& r) {
+        out += ",\"files\":[";
+        for (size_t i = 0; i < r.files.size(); ++i) {
+            if (i) out += ',';
+            BatchJson::appendFile(out, r.files[i]);
+        }
+        out += ']';
+    }
+
+    // Remembers the token or challenge for the commands that follow.
+    void appendLogin(string& out, const LoginReply& r) {
+        if (r.status == ApiStatus::OK) {
+            lastToken = r.token;
+            BatchJson::appendField(out, "token", r.token);
+            BatchJson::appendRaw(out, "expires", to_string((int64_t)r.expiresAt));
+        } else if (r.status == ApiStatus::MFA_REQUIRED) {
+            lastChallenge = r.mfaChallenge;
+            BatchJson::appendField(out, "challenge", r.mfaChallenge);
+            BatchJson::appendField(out, "mfa_code", r.mfaCode);   // simulated delivery, as on the console
+        } else {
+            BatchJson::appendRaw(out, "failed_logins", to_string(r.failedLogins));
+        }
+    }
+
+    static void appendReplication(string& out, const Replicator::Status& st) {
+        BatchJson::appendField(out, "ack", st.ack == Replicator::Ack::SYNC ? "sync" : "async");
+        BatchJson::appendRaw(out, "lsn", to_string(st.headLsn));
+        BatchJson::appendRaw(out, "queued", to_string(st.queued));
+        BatchJson::appendRaw(out, "ack_timeouts", to_string(st.ackTimeouts));
+        out += ",\"replicas\":[";
+        for (size_t i = 0; i < st.replicas.size(); ++i) {
+            const auto& r = st.replicas[i];
+            char lag[32];
+            snprintf(lag, sizeof(lag), "%.3f", r.lagSeconds);
+            if (i) out += ',';
+            out += "{\"region\":";
+            BatchJson::appendString(out, regionName(r.region));
+            BatchJson::appendRaw(out, "online", r.online ? "true" : "false");
+            BatchJson::appendRaw(out, "applied", to_string(r.appliedLsn));
+            BatchJson::appendRaw(out, "lag", to_string(r.lagJobs));
+            BatchJson::appendRaw(out, "lag_seconds", lag);
+            BatchJson::appendRaw(out, "files", to_string(r.files));
+            BatchJson::appendRaw(out, "bytes", to_string(r.storedBytes));
+            BatchJson::appendRaw(out, "failed_batches", to_string(r.failures));
+            out += '}';
+        }
+        out += ']';
+    }
+
+    // One reply line, without the trailing newline
+    void execute(const BatchJson::Object& cmd, string& out) {
+        string op = text(cmd, "op");
+        out = "{\"op\":";
+        BatchJson::appendString(out, op);
+        ApiStatus status = ApiStatus::BAD_REQUEST;
+        string extra;
+
+        if (op == "register") {
+            RegisterRequest req;
+            req.username = text(cmd, "user");
+            req.password = text(cmd, "password");
+            req.fullName = text(cmd, "name");
+            req.gender   = text(cmd, "gender");
+            if (number(cmd, "age", req.age)) status = engine.registerUser(req);
+        } else if (op == "login") {
+            LoginReply r = engine.login({text(cmd, "user"), text(cmd, "password")});
+            status = r.status;
+            appendLogin(extra, r);
+        } else if (op == "mfa") {
+            string challenge = lastChallenge;
+            field(cmd, "challenge", challenge);
+            LoginReply r = engine.verifyMfa({challenge, text(cmd, "code")});
+            status = r.status;
+            if (challenge == lastChallenge) lastChallenge.clear();
+            appendLogin(extra, r);
+        } else if (op == "logout") {
+            string token = tokenOf(cmd);
+            status = engine.logout(token);
+            if (token == lastToken) lastToken.clear();
+        } else if (op == "upload") {
+            UploadRequest req;
+            req.token = tokenOf(cmd);
+            req.name = text(cmd, "name");
+            req.description = text(cmd, "description");
+            req.isPublic = flag(cmd, "public");
+            req.encryptedAtRest = flag(cmd, "encrypted");
+            string region = text(cmd, "region");
+            req.sourcePath = text(cmd, "path");
+            double mb = 0;
+            bool sized = !req.sourcePath.empty() || number(cmd, "bytes", req.sizeBytes);
+            if (!sized && number(cmd, "size", mb) && mb > 0 && mb <= 1e12) {
+                req.sizeBytes = max<int64_t>(1, mbToBytes(mb));
+                sized = true;
+            }
+            if (sized && (region.empty() || parseRegion(region, req.region))) {
+                UploadReply r = engine.uploadFile(req);
+                status = r.status;
+                if (status == ApiStatus::OK) BatchJson::appendField(extra, "id", r.fileId.str());
+            }
+        } else if (op == "delete") {
+            FileId id;
+            if (FileId::parse(text(cmd, "id"), id)) status = engine.deleteFile(FileRequest{tokenOf(cmd), id});
+        } else if (op == "download") {
+            FileId id;
+            string path = text(cmd, "path");
+            if (FileId::parse(text(cmd, "id"), id) && !path.empty())
+                status = engine.downloadFile(FileRequest{tokenOf(cmd), id}, path);
+        } else if (op == "get" || op == "list" || op == "search") {
+            FileId id;
+            if (op != "get" || FileId::parse(text(cmd, "id"), id)) {
+                FilesReply r = op == "get"  ? engine.getFile(FileRequest{tokenOf(cmd), id})
+                             : op == "list" ? engine.listFiles(tokenOf(cmd))
+                                            : engine.searchFiles(SearchRequest{tokenOf(cmd), text(cmd, "term")});
+                status = r.status;
+                if (status == ApiStatus::OK) appendFiles(extra, r);
+            }
+        } else if (op == "visibility") {
+            string v;
+            FileId id;
+            if (field(cmd, "public", v) && (v == "true" || v == "false") && FileId::parse(text(cmd, "id"), id))
+                status = engine.setVisibility(VisibilityRequest{tokenOf(cmd), id, v == "true"});
+        } else if (op == "public") {
+            PublicRequest req;
+            string order = text(cmd, "order");
+            bool ok = decodeCursor(text(cmd, "after"), req.after);
+            if (order == "type") req.order = PublicCatalog::Order::TYPE;
+            else if (order == "region") req.order = PublicCatalog::Order::REGION;
+            else if (!order.empty() && order != "date") ok = false;
+            if (cmd.count("limit") && !number(cmd, "limit", req.limit)) ok = false;
+            if (ok && req.limit > 0) {
+                status = ApiStatus::OK;
+                auto page = engine.publicFiles(req);
+                extra += ",\"files\":[";
+                for (size_t i = 0; i < page.entries.size(); ++i) {
+                    const auto& e = page.entries[i];
+                    if (i) extra += ',';
+                    extra += "{\"id\":";
+                    BatchJson::appendString(extra, e.id.str());
+                    BatchJson::appendField(extra, "name", e.name);
+                    BatchJson::appendField(extra, "owner", e.owner);
+                    BatchJson::appendField(extra, "type", e.typeString());
+                    BatchJson::appendField(extra, "region", e.regionString());
+                    BatchJson::appendField(extra, "uploaded", e.dateString());
+                    extra += '}';
+                }
+                extra += ']';
+                if (page.more) BatchJson::appendField(extra, "next", encodeCursor(page.next));
+            }
+        } else if (op == "replication") {
+            string ack = text(cmd, "ack"), region = text(cmd, "region"), online;
+            Region r = Region::GLOBAL;
+            int waitMs = 0;
+            bool ok = (ack.empty() || ack == "sync" || ack == "async") &&
+                      (region.empty() || (parseRegion(region, r) && r != Region::GLOBAL &&
+                                          field(cmd, "online", online) && (online == "true" || online == "false"))) &&
+                      (!cmd.count("wait_ms") || (number(cmd, "wait_ms", waitMs) && waitMs >= 0));
+            if (ok) {
+                status = ApiStatus::OK;
+                if (!ack.empty()) engine.setReplicationAck(ack == "sync" ? Replicator::Ack::SYNC : Replicator::Ack::ASYNC);
+                if (!region.empty()) engine.setReplicaOnline(r, online == "true");
+                if (waitMs > 0) BatchJson::appendRaw(extra, "caught_up",
+                                                     engine.drainReplication(chrono::milliseconds(waitMs)) ? "true" : "false");
+                appendReplication(extra, engine.replicationStatus());
+            }
+        }
+
+        BatchJson::appendRaw(out, "status", string("\"") + apiStatusName(status) + "\"");
+        out += extra;
+        out += '}';
+    }
+
+    bool flush(ostream& os) {
+        bool ok = engine.flushBatch();
+        os << replies;
+        os.flush();
+        replies.clear();
+        return ok;
+    }
+
+public:
+    explicit BatchRunner(CloudEngine& e) : engine(e) {}
+
+    // Returns 0 when every line parsed and every flush succeeded.
+    int run(istream& in, ostream& os) {
+        engine.beginBatch();
+        string line, reply;
+        BatchJson::Object cmd;
+        size_t sinceFlush = 0;
+        bool ok = true;
+        while (getline(in, line)) {
+            if (line.empty() || line.find_first_not_of(" \t\r") == string::npos) continue;
+            if (BatchJson::parseObject(line, cmd)) {
+                execute(cmd, reply);
+            } else {
+                reply = "{\"op\":null,\"status\":\"BAD_REQUEST\"}";
+                ok = false;
+            }
+            replies += reply;
+            replies += '\n';
+            if (++sinceFlush >= Config::BATCH_FLUSH_OPS) {
+                ok = flush(os) && ok;
+                sinceFlush = 0;
+            }
+        }
+        ok = flush(os) && ok;
+        ok = engine.endBatch() && ok;
+        return ok ? 0 : 1;
+    }
+};
+
+int runBatch(int argc, char** argv) {
+    ios::sync_with_stdio(false);
+    ifstream file;
+    if (argc > 2) {
+        file.open(argv[2]);
+        if (!file) {
+            cerr << "Cannot open " << argv[2] << "\n";
+            return 2;
+        }
+    }
+    try {
+        CloudEngine engine;
+        BatchRunner runner(engine);
+        return runner.run(argc > 2 ? file : cin, cout);
+    } catch (const exception& e) {
+        cerr << "Fatal: " << e.what() << "\n";
+        return 1;
+    }
+}
+
+// ================== Benchmark ==================
+// Built only with -DCLOUD_BENCH, which turns the binary into the benchmark:
+//   g++ -std=c++17 -O2 -pthread -DCLOUD_BENCH cloud_storage.cpp -o cloud_bench
+//   ./cloud_bench --users 10000 --max-files 500 --zipf 1.1 --seed 1 > baseline.json
+// Generates a synthetic population in a fresh scratch directory (removed
+// afterwards unless --keep), times the repository operations and prints
+// one JSON document with ops/sec and p50/p99 latency per operation.
+#ifdef CLOUD_BENCH
+namespace Bench {
+    struct Options {
+        size_t   users{10000};
+        size_t   maxFiles{500};     // files per user follow Zipf(s) over 1..maxFiles
+        double   zipf{1.1};
+        uint64_t seed{1};
+        size_t   queries{5000};     // search and dashboard samples
+        bool     keep{false};
+    };
+
+    struct Result {
+        string name;
+        size_t ops{0};
+        double seconds{0};
+        double p50us{0};
+        double p99us{0};
+    };
+
+    // Times fn() once per op; fn returns false to stop early.
+    template <class Fn>
+    Result measure(const string& name, size_t ops, Fn&& fn) {
+        vector<double> lat;
+        lat.reserve(ops);
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < ops; ++i) {
+            auto t0 = chrono::steady_clock::now();
+            bool more = fn(i);
+            lat.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count());
+            if (!more) break;
+        }
+        Result r;
+        r.name = name;
+        r.ops = lat.size();
+        r.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (!lat.empty()) {
+            auto pct = [&](double p) {
+                size_t k = min(lat.size() - 1, (size_t)(p * (double)(lat.size() - 1) + 0.5));
+                nth_element(lat.begin(), lat.begin() + k, lat.end());
+                return lat[k];
+            };
+            r.p50us = pct(0.50);
+            r.p99us = pct(0.99);
+        }
+        cerr << "  " << name << ": " << r.ops << " ops in " << r.seconds << " s\n";
+        return r;
+    }
+
+    // Samples 1..n with P(k) proportional to 1/k^s.
+    class Zipf {
+        vector<double> cdf;
+    public:
+        Zipf(size_t n, double s) : cdf(max<size_t>(n, 1)) {
+            double sum = 0;
+            for (size_t k = 0; k < cdf.size(); ++k) cdf[k] = sum += 1.0 / pow((double)(k + 1), s);
+            for (double& c : cdf) c /= sum;
+        }
+        template <class Rng>
+        size_t operator()(Rng& rng) const {
+            double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+            return (size_t)(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()) + 1;
+        }
+    };
+
+    const char* const WORDS[] = {
+        "quarterly", "report", "budget", "holiday", "photos", "invoice", "draft", "final",
+        "meeting", "notes", "project", "roadmap", "family", "backup", "contract", "summary",
+        "design", "review", "presentation", "lecture", "recording", "podcast", "episode", "trailer",
+        "scan", "receipt", "tax", "return", "resume", "cover", "letter", "proposal",
+        "marketing", "campaign", "wedding", "birthday", "travel", "itinerary", "passport", "lease",
+        "research", "paper", "dataset", "analysis", "sprint", "retro", "onboarding", "handbook",
+    };
+    const char* const EXTENSIONS[] = {
+        "pdf", "docx", "xlsx", "pptx", "txt", "jpg", "png", "gif", "mp4", "mov", "mkv", "mp3", "wav", "zip", "csv",
+    };
+    constexpr size_t WORD_COUNT = sizeof(WORDS) / sizeof(WORDS[0]);
+    constexpr size_t EXT_COUNT  = sizeof(EXTENSIONS) / sizeof(EXTENSIONS[0]);
+
+    template <class Rng>
+    string words(Rng& rng, size_t n, char sep) {
+        string s;
+        for (size_t i = 0; i < n; ++i) {
+            if (i) s += sep;
+            s += WORDS[rng() % WORD_COUNT];
+        }
+        return s;
+    }
+
+    string userName(size_t i) { return "bench_user" + to_string(i); }
+
+    void appendResult(string& out, const Result& r) {
+        out += "    {\"name\": \"" + r.name + "\", \"ops\": " + to_string(r.ops);
+        char buf[160];
+        snprintf(buf, sizeof(buf), ", \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f}",
+                 r.seconds, r.seconds > 0 ? (double)r.ops / r.seconds : 0.0, r.p50us, r.p99us);
+        out += buf;
+    }
+
+    int run(const Options& opt) {
+        char scratch[] = "cloud_bench.XXXXXX";
+        if (!mkdtemp(scratch)) {
+            cerr << "Cannot create scratch directory\n";
+            return 1;
+        }
+        fs::path scratchDir = fs::absolute(scratch);
+        fs::path home = fs::current_path();
+        fs::current_path(scratchDir);
+        cerr << "Scratch directory: " << scratchDir.string() << "\n";
+
+        mt19937_64 rng(opt.seed);
+        Zipf filesPerUser(opt.maxFiles, opt.zipf);
+        vector<Result> results;
+        size_t totalFiles = 0;
+        {
+            // ---------- population ----------
+            cerr << "Generating " << opt.users << " users\n";
+            vector<size_t> fileCounts(opt.users);
+            {
+                UserRepository userRepo;
+                FileRepository fileRepo;
+                fileRepo.setDeferredSync(true);
+                time_t base = time(nullptr) - 365 * 86400;
+                for (size_t i = 0; i < opt.users; ++i) {
+                    User u;
+                    u.username = userName(i);
+                    u.salt = generateSalt();
+                    uint8_t digest[SHA256::DIGEST_SIZE];
+                    passwordDigest(u.salt, "passw0rd" + to_string(i), digest);
+                    u.passwordHash = toHex(digest, sizeof(digest));
+                    u.fullName = words(rng, 2, ' ');
+                    u.age = 18 + (int)(rng() % 60);
+                    u.gender = rng() % 2 ? "M" : "F";
+                    uint64_t roll = rng() % 100;
+                    u.role = roll < 1 ? UserRole::ADMIN : roll < 15 ? UserRole::PREMIUM_USER : UserRole::FREE_USER;
+                    u.registrationDate = base + (time_t)(rng() % (300 * 86400));
+                    u.isActive = true;
+                    u.isLocked = rng() % 50 == 0;
+                    u.failedLogins = u.isLocked ? Config::MAX_FAILED_LOGINS : 0;
+                    u.mfaEnabled = rng() % 5 == 0;
+                    u.lastLoginTime = u.registrationDate;
+
+                    fileCounts[i] = filesPerUser(rng);
+                    for (size_t f = 0; f < fileCounts[i]; ++f) {
+                        FileRecord fr;
+                        fr.id = generateFileId();
+                        fr.owner = u.username;
+                        fr.name = words(rng, 1 + rng() % 3, '_') + "." + EXTENSIONS[rng() % EXT_COUNT];
+                        fr.type = detectFileType(fr.name);
+                        fr.region = static_cast<Region>(rng() % 4);
+                        fr.sizeBytes = 10240 + (int64_t)(rng() % (200ull << 20));
+                        fr.uploaded = base + (time_t)(rng() % (365 * 86400));
+                        fr.description = words(rng, 3 + rng() % 6, ' ');
+                        fr.isPublic = rng() % 10 == 0;
+                        fr.encryptedAtRest = rng() % 2 == 0;
+                        u.usedBytes.adjust(fr.sizeBytes);
+                        fileRepo.addFile(u.username, fr);
+                    }
+                    totalFiles += fileCounts[i];
+                    userRepo.add(u);
+                    userRepo.append(u);
+                }
+                fileRepo.setDeferredSync(false);
+                fileRepo.flush();
+                cerr << "Generated " << totalFiles << " files\n";
+
+                // ---------- users ----------
+                results.push_back(measure("user_repo.save", 5, [&](size_t) { return userRepo.save(); }));
+            }
+            results.push_back(measure("user_repo.load", 5, [&](size_t) {
+                UserRepository repo;
+                return repo.size() == opt.users;
+            }));
+
+            // ---------- files ----------
+            results.push_back(measure("file_repo.load_all", 3, [&](size_t) {
+                FileRepository repo;
+                return repo.loadAll() == opt.users;
+            }));
+            FileRepository fileRepo;
+            results.push_back(measure("file_repo.load_user_files", opt.users, [&](size_t i) {
+                return fileRepo.loadUserFiles(userName(i));
+            }));
+            results.push_back(measure("file_repo.save_user_files", opt.users, [&](size_t i) {
+                return fileRepo.saveUserFiles(userName(i));
+            }));
+
+            // ---------- sha256 ----------
+            string block64(64, 'a'), block4k(4096, 'b');
+            size_t sink = 0;
+            results.push_back(measure("sha256.64B", 200000, [&](size_t) {
+                sink += sha256(block64).size();
+                return true;
+            }));
+            results.push_back(measure("sha256.4KiB", 20000, [&](size_t) {
+                sink += sha256(block4k).size();
+                return true;
+            }));
+
+            // ---------- search ----------
+            // Heavy users are drawn more often, like real traffic
+            Zipf pickUser(opt.users, 1.0);
+            vector<size_t> byFiles(opt.users);
+            iota(byFiles.begin(), byFiles.end(), 0);
+            sort(byFiles.begin(), byFiles.end(), [&](size_t a, size_t b) { return fileCounts[a] > fileCounts[b]; });
+            results.push_back(measure("file_repo.search", opt.queries, [&](size_t) {
+                const string& user = userName(byFiles[pickUser(rng) - 1]);
+                string term = WORDS[rng() % WORD_COUNT];
+                term = term.substr(0, 3 + rng() % (term.size() - 2));
+                sink += fileRepo.search(user, term).size();
+                return true;
+            }));
+
+            // ---------- public listing ----------
+            fileRepo.openPublicCatalog();
+            for (auto order : {PublicCatalog::Order::DATE, PublicCatalog::Order::TYPE, PublicCatalog::Order::REGION}) {
+                PublicCatalog::Cursor cursor;
+                const char* name = order == PublicCatalog::Order::DATE ? "public.page_by_date"
+                                 : order == PublicCatalog::Order::TYPE ? "public.page_by_type"
+                                                                       : "public.page_by_region";
+                results.push_back(measure(name, fileRepo.publicCount() / 20 + 1, [&](size_t) {
+                    auto page = fileRepo.publicPage(order, cursor, 20);
+                    cursor = page.next;
+                    sink += page.entries.size();
+                    return page.more;
+                }));
+            }
+            if (sink == 0) cerr << "(empty workload)\n";
+        }
+
+        // ---------- admin dashboard ----------
+        {
+            UserRepository userRepo;
+            UserColumns::Stats stats;
+            results.push_back(measure("admin.dashboard", opt.queries, [&](size_t) {
+                userRepo.withColumns([&](const UserColumns& cols) { stats = cols.aggregate(); });
+                return stats.totalUsers == opt.users;
+            }));
+        }
+
+        fs::current_path(home);
+        if (!opt.keep) {
+            error_code ec;
+            fs::remove_all(scratchDir, ec);
+        }
+
+        string out = "{\n  \"config\": {\"users\": " + to_string(opt.users) +
+                     ", \"files\": " + to_string(totalFiles) +
+                     ", \"max_files\": " + to_string(opt.maxFiles);
+        char buf[96];
+        snprintf(buf, sizeof(buf), ", \"zipf\": %.3f, \"seed\": %llu},\n",
+                 opt.zipf, (unsigned long long)opt.seed);
+        out += buf;
+        out += "  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            appendResult(out, results[i]);
+            out += i + 1 < results.size() ? ",\n" : "\n";
+        }
+        out += "  ]\n}\n";
+        cout << out;
+        return 0;
+    }
+}
+
+int runBench(int argc, char** argv) {
+    Bench::Options opt;
+    for (int i = 1; i < argc; ++i) {
+        string o = argv[i];
+        if (o == "--keep") { opt.keep = true; continue; }
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << o << "\n";
+            return 2;
+        }
+        string val = argv[++i];
+        try {
+            if (o == "--users")          opt.users = stoull(val);
+            else if (o == "--max-files") opt.maxFiles = stoull(val);
+            else if (o == "--zipf")      opt.zipf = stod(val);
+            else if (o == "--seed")      opt.seed = stoull(val);
+            else if (o == "--queries")   opt.queries = stoull(val);
+            else {
+                cerr << "Unknown option: " << o << "\n";
+                return 2;
+            }
+        } catch (...) {
+            cerr << "Invalid value for " << o << ": " << val << "\n";
+            return 2;
+        }
+    }
+    if (opt.users == 0 || opt.maxFiles == 0) {
+        cerr << "--users and --max-files must be positive\n";
+        return 2;
+    }
+    return Bench::run(opt);
+}
+#endif
+
 // ================== main ==================
-int main() {
-    CloudApp app;
-    app.run();
+int main(int argc, char** argv) {
+#ifdef CLOUD_BENCH
+    return runBench(argc, argv);
+#endif
+    if (argc > 1 && string(argv[1]) == "--audit-query") return runAuditQuery(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--batch") return runBatch(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--self-test") return runSelfTest();
+
+    try {
+        CloudApp app;
+        app.run();
+    } catch (const exception& e) {
+        cerr << "Fatal: " << e.what() << "\n";
+        return 1;
+    }
     return 0;
 }